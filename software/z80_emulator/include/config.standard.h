@@ -44,6 +44,9 @@
 #define FB_N_SIZE (FB_WIDTH * FB_LINE_HEIGHT)
 #define FB_N_OFFSET (ROM_N_OFFSET + ROM_N_SIZE)
 
+/* Framebuffer aperture (SGPU_MODE_APERTURE), banks of half a frame at FB_N_OFFSET */
+#define FB_APERTURE_SIZE (FB_WIDTH * FB_HEIGHT / 2)
+
 /* Framebuffer size */
 #define FB_WIDTH 160
 #define FB_HEIGHT 120
@@ -56,9 +59,79 @@
 #define SGPU_FB_PAGE_NUMBER 0
 #define _SGPU_CMD_BUF_ADDR 	1
 #define _SGPU_CMD_BUF_VALUE	2
+#define _SGPU_CAPS			3	// capabilities (read only)
+#define _SGPU_MODE			4
+#define _SGPU_RING_BASE		5	// page of the command ring in guest memory (0 = ring disabled)
+#define _SGPU_RING_HEAD		6	// offset behind the last queued entry (written by the CPU)
+#define _SGPU_RING_TAIL		7	// offset of the next entry to execute (read only)
+#define _SGPU_IRQ			8	// interrupt control/status
+#define _SGPU_FRONT			9	// index of the displayed framebuffer (read only)
+
+// Bit positions for the capability register
+#define SGPU_CAP_APERTURE	0	// SGPU_MODE_APERTURE is supported
+#define SGPU_CAP_BLIT		1	// SGPU_CMD_BLIT, SGPU_CMD_SCROLL and SGPU_CMD_DMA are supported
+#define SGPU_CAP_RING		2	// command ring and interrupts are supported
+#define SGPU_CAP_OBJECTS	3	// tile layer and sprites are supported
+#define SGPU_CAP_FLIP		4	// SGPU_MODE_DOUBLE_BUFFER and SGPU_CMD_FLIP are supported
+
+// Command engine throughput (framebuffer bytes per cycle)
+#define SGPU_BYTES_PER_CYCLE 8
+
+// Frames per second of emulated time, SGPU_CMD_FLIP completes at the start of a frame
+#define SGPU_FRAME_FREQUENCY 60
+#define SGPU_FB_COUNT		2
+
+// Bit positions for the mode register
+#define SGPU_MODE_APERTURE	0	// FB_APERTURE_SIZE window, FB_PAGE_NUMBER selects the bank
+#define SGPU_MODE_DOUBLE_BUFFER 1	// the CPU and commands draw into the framebuffer that is not displayed
+
+// Command ring: one page of entries laid out like the command buffer
+// (flags, command id, 6 parameter bytes), head and tail wrap at 256
+#define SGPU_RING_ENTRY_SIZE 8
+#define SGPU_RING_FLAG_IRQ	0	// set SGPU_IRQ_MARKED when the entry completes
+
+// Bit positions for the interrupt register, status bits are cleared by writing 1
+#define SGPU_IRQ_ENABLE_DRAINED	0
+#define SGPU_IRQ_ENABLE_MARKED	1
+#define SGPU_IRQ_ENABLE_FLIP	3
+#define SGPU_IRQ_DRAINED	4	// the ring has run empty
+#define SGPU_IRQ_MARKED		5	// an entry with SGPU_RING_FLAG_IRQ has completed
+#define SGPU_IRQ_ERROR		6	// an entry has been rejected (no interrupt)
+#define SGPU_IRQ_FLIP		7	// a flip with interrupt flag has completed
+
+// SGPU object unit (tile layer and sprites composited over the framebuffer)
+#define SGPU_OBJ_IO_OFFSET	50
+#define SGPU_OBJ_IO_SIZE	10
+#define _SGPU_OBJ_ADDR_LOW	0	// object memory address, incremented by every data access
+#define _SGPU_OBJ_ADDR_HIGH	1
+#define _SGPU_OBJ_DATA		2
+#define _SGPU_OBJ_CTRL		3
+#define _SGPU_TILE_KEY		4	// transparent tile color
+#define _SGPU_TILE_SCROLL_X	5	// tile layer offset in pixels, wraps around the map
+#define _SGPU_TILE_SCROLL_Y	6
+
+// Bit positions for the object control register
+#define SGPU_OBJ_TILES		0	// show the tile layer
+#define SGPU_OBJ_SPRITES	1	// show the sprites (above the tile layer)
+
+// Object memory layout
+#define SGPU_TILE_SIZE		8	// tiles are 8x8 bytes, one byte per pixel
+#define SGPU_TILE_COUNT		64
+#define SGPU_TILES_OFFSET	0x0000
+#define SGPU_MAP_WIDTH		(FB_WIDTH / SGPU_TILE_SIZE)
+#define SGPU_MAP_HEIGHT		(FB_HEIGHT / SGPU_TILE_SIZE)
+#define SGPU_MAP_OFFSET		0x1000	// one tile number per map cell, row by row
+#define SGPU_SPRITE_COUNT	16
+#define SGPU_SPRITE_SIZE	4	// x, y, tile, transparent color; y >= FB_HEIGHT hides the sprite
+#define SGPU_SPRITES_OFFSET	0x1200
+#define SGPU_OBJ_MEM_SIZE	(SGPU_SPRITES_OFFSET + SGPU_SPRITE_COUNT * SGPU_SPRITE_SIZE)
 
 #define SGPU_CMD_FILL		0x01
 #define SGPU_CMD_TTY_WRITE	0x02
+#define SGPU_CMD_BLIT		0x03	// src x, src y, dst x, dst y, width, height
+#define SGPU_CMD_SCROLL		0x04	// dx, dy (signed), value for uncovered bytes
+#define SGPU_CMD_DMA		0x05	// source address, framebuffer offset, count (16 bit each, high byte first)
+#define SGPU_CMD_FLIP		0x06	// flags (bit 0: raise SGPU_IRQ_FLIP), waits for the next frame
 #define SGPU_CMD_ACK		0xff
 #define SGPU_CMD_NACK		0xfe
 
@@ -68,6 +141,20 @@
 #define FB_PAGE_NUMBER (SGPU_IO_OFFSET + SGPU_FB_PAGE_NUMBER)
 #define SGPU_CMD_BUF_ADDR 	(SGPU_IO_OFFSET + _SGPU_CMD_BUF_ADDR)
 #define SGPU_CMD_BUF_VALUE 	(SGPU_IO_OFFSET + _SGPU_CMD_BUF_VALUE)
+#define SGPU_CAPS 			(SGPU_IO_OFFSET + _SGPU_CAPS)
+#define SGPU_MODE 			(SGPU_IO_OFFSET + _SGPU_MODE)
+#define SGPU_RING_BASE 		(SGPU_IO_OFFSET + _SGPU_RING_BASE)
+#define SGPU_RING_HEAD 		(SGPU_IO_OFFSET + _SGPU_RING_HEAD)
+#define SGPU_RING_TAIL 		(SGPU_IO_OFFSET + _SGPU_RING_TAIL)
+#define SGPU_IRQ 			(SGPU_IO_OFFSET + _SGPU_IRQ)
+#define SGPU_FRONT 			(SGPU_IO_OFFSET + _SGPU_FRONT)
+#define SGPU_OBJ_ADDR_LOW	(SGPU_OBJ_IO_OFFSET + _SGPU_OBJ_ADDR_LOW)
+#define SGPU_OBJ_ADDR_HIGH	(SGPU_OBJ_IO_OFFSET + _SGPU_OBJ_ADDR_HIGH)
+#define SGPU_OBJ_DATA		(SGPU_OBJ_IO_OFFSET + _SGPU_OBJ_DATA)
+#define SGPU_OBJ_CTRL		(SGPU_OBJ_IO_OFFSET + _SGPU_OBJ_CTRL)
+#define SGPU_TILE_KEY		(SGPU_OBJ_IO_OFFSET + _SGPU_TILE_KEY)
+#define SGPU_TILE_SCROLL_X	(SGPU_OBJ_IO_OFFSET + _SGPU_TILE_SCROLL_X)
+#define SGPU_TILE_SCROLL_Y	(SGPU_OBJ_IO_OFFSET + _SGPU_TILE_SCROLL_Y)
 #define TIMER0_CTRL	20			// control register for timer 0
 #define TIMER0_KCYCLES_LOW 21	// number of kilo cycles to count until IRQ or set ellapsed bit (low byte)
 #define TIMER0_KCYCLES_HIGH 22	// same as above, but high byte
@@ -89,6 +176,14 @@
 /* Clocking */
 #define CLOCK_FREQUENCY 1000000 // in Hz
 
+/* Scheduling */
+#define SLICE_FREQUENCY 1000 // emulation slices per second of emulated time
+#define INPUT_POLL_FREQUENCY 200 // in Hz of host time
+#define FRAME_FREQUENCY 60 // default refresh rate in Hz of host time
+
+/* Largest loop (in bytes) checked for busy-waiting */
+#define IDLE_LOOP_MAX_SIZE 64
+
 /* Timer 0 */
 
 // Bit positions for control register
@@ -18,6 +18,7 @@
 */
 
 #include <iostream>
+#include <iomanip> // setw, setfill
 #include <fstream>
 #include <string>
 #include <algorithm> // min
@@ -0,0 +1,317 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "capture.h"
+#include <cstdio> // snprintf
+
+Capture::Capture()
+{
+	format = CAPTURE_PPM;
+	width = 0;
+	height = 0;
+	last_frame = NULL;
+	converted = NULL;
+	converted_size = 0;
+	has_frame = false;
+	frame_count = 0;
+	duplicate_count = 0;
+
+	for (int i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 1) ? (0xedb88320 ^ (crc >> 1)) : (crc >> 1);
+		crc_table[i] = crc;
+	}
+}
+
+static bool hasExtension(const string& name, const char* extension)
+{
+	size_t length = strlen(extension);
+	return name.size() >= length && name.compare(name.size() - length, length, extension) == 0;
+}
+
+/* True if 'name' is safe as snprintf() format: one %d, %i or %u conversion and no other '%' */
+static bool isFrameNumberPattern(const string& name)
+{
+	size_t pos = name.find('%');
+	if (pos == string::npos || name.find('%', pos + 1) != string::npos) return false;
+
+	size_t end = name.find_first_not_of("0123456789-+ #.", pos + 1);
+	return end != string::npos && (name[end] == 'd' || name[end] == 'i' || name[end] == 'u');
+}
+
+int Capture::open(const string& name, int width, int height, int rate_num, int rate_den)
+{
+	this->name = name;
+	this->width = width;
+	this->height = height;
+
+	if (hasExtension(name, ".png")) format = CAPTURE_PNG;
+	else if (hasExtension(name, ".ppm")) format = CAPTURE_PPM;
+	else if (hasExtension(name, ".y4m")) format = CAPTURE_Y4M;
+	else if (hasExtension(name, ".rgb") || hasExtension(name, ".raw")) format = CAPTURE_RAW;
+	else
+	{
+		cerr << "Unknown capture format '" << name << "' (use .ppm, .png, .rgb/.raw or .y4m)" << endl;
+		return -1;
+	}
+
+	/* Image sequences need a frame number in the file name, which is used as format */
+	if (format == CAPTURE_PPM || format == CAPTURE_PNG)
+	{
+		if (name.find('%') == string::npos) this->name.insert(name.size() - 4, "_%06u");
+		else if (!isFrameNumberPattern(name))
+		{
+			cerr << "Capture name '" << name << "' must contain one frame number (e.g. %05d) and no other '%'" << endl;
+			return -1;
+		}
+	}
+
+	/* Conversion table (RGB332 is RRRGGGBB) */
+	for (int i = 0; i < 256; i++)
+	{
+		int r = ((i >> 5) & 7) * 255 / 7;
+		int g = ((i >> 2) & 7) * 255 / 7;
+		int b = (i & 3) * 255 / 3;
+		if (format == CAPTURE_Y4M)
+		{
+			/* BT.601 full range */
+			lut[i][0] = (byte)(0.299 * r + 0.587 * g + 0.114 * b + 0.5);
+			lut[i][1] = (byte)(128 - 0.168736 * r - 0.331264 * g + 0.5 * b + 0.5);
+			lut[i][2] = (byte)(128 + 0.5 * r - 0.418688 * g - 0.081312 * b + 0.5);
+		}
+		else
+		{
+			lut[i][0] = r;
+			lut[i][1] = g;
+			lut[i][2] = b;
+		}
+	}
+
+	converted_size = width * height * 3;
+	converted = new byte[converted_size];
+	last_frame = new byte[width * height];
+	has_frame = false;
+	frame_count = 0;
+	duplicate_count = 0;
+
+	if (format == CAPTURE_RAW || format == CAPTURE_Y4M)
+	{
+		stream.open(name.c_str(), ofstream::out | ofstream::binary | ofstream::trunc);
+		if (!stream.is_open())
+		{
+			cerr << "Unable to open capture file '" << name << "'" << endl;
+			return -1;
+		}
+		if (format == CAPTURE_Y4M)
+			stream << "YUV4MPEG2 W" << width << " H" << height << " F" << rate_num << ":" << rate_den << " Ip A1:1 C444 XCOLORRANGE=FULL\n"; // matches the LUT
+	}
+	return 0;
+}
+
+int Capture::writeFrame(const byte* pixels)
+{
+	unsigned int index = frame_count++;
+	unsigned int size = width * height;
+	if (has_frame && memcmp(pixels, last_frame, size) == 0)
+	{
+		duplicate_count++;
+		if (format == CAPTURE_PPM || format == CAPTURE_PNG) return 0; // the previous file shows it
+	}
+	else
+	{
+		memcpy(last_frame, pixels, size);
+		convert(pixels);
+		has_frame = true;
+	}
+
+	switch (format)
+	{
+		case CAPTURE_PPM:
+			return writePPM(getFileName(index));
+		case CAPTURE_PNG:
+			return writePNG(getFileName(index));
+		case CAPTURE_Y4M:
+			stream << "FRAME\n";
+			// fall through
+		default:
+			stream.write((const char*)converted, converted_size);
+			return stream.good() ? 0 : -1;
+	}
+}
+
+void Capture::convert(const byte* pixels)
+{
+	unsigned int size = width * height;
+	if (format == CAPTURE_Y4M)
+	{
+		/* Planar: all Y, then all U, then all V */
+		byte* y = converted;
+		byte* u = converted + size;
+		byte* v = converted + 2 * size;
+		for (unsigned int i = 0; i < size; i++)
+		{
+			const byte* yuv = lut[pixels[i]];
+			y[i] = yuv[0];
+			u[i] = yuv[1];
+			v[i] = yuv[2];
+		}
+	}
+	else
+	{
+		for (unsigned int i = 0; i < size; i++)
+			memcpy(converted + i * 3, lut[pixels[i]], 3);
+	}
+}
+
+string Capture::getFileName(unsigned int index)
+{
+	char file_name[1024];
+	snprintf(file_name, sizeof(file_name), name.c_str(), index);
+	return file_name;
+}
+
+int Capture::writePPM(const string& file_name)
+{
+	ofstream out(file_name.c_str(), ofstream::out | ofstream::binary | ofstream::trunc);
+	if (!out.is_open())
+	{
+		cerr << "Unable to write capture file '" << file_name << "'" << endl;
+		return -1;
+	}
+	out << "P6\n" << width << " " << height << "\n255\n";
+	out.write((const char*)converted, converted_size);
+	return out.good() ? 0 : -1;
+}
+
+static void putBigEndian(byte* out, uint32_t value)
+{
+	out[0] = (value >> 24) & 0xff;
+	out[1] = (value >> 16) & 0xff;
+	out[2] = (value >> 8) & 0xff;
+	out[3] = value & 0xff;
+}
+
+int Capture::writePNG(const string& file_name)
+{
+	ofstream out(file_name.c_str(), ofstream::out | ofstream::binary | ofstream::trunc);
+	if (!out.is_open())
+	{
+		cerr << "Unable to write capture file '" << file_name << "'" << endl;
+		return -1;
+	}
+
+	static const byte signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	out.write((const char*)signature, sizeof(signature));
+
+	byte header[13] = { 0 };
+	putBigEndian(header, width);
+	putBigEndian(header + 4, height);
+	header[8] = 8; // bits per channel
+	header[9] = 2; // RGB
+	writeChunk(out, "IHDR", header, sizeof(header));
+
+	/* zlib stream of stored (uncompressed) deflate blocks, each row starts with filter type 0 */
+	unsigned int row_size = width * 3 + 1;
+	unsigned int raw_size = row_size * height;
+	unsigned int block_count = (raw_size + 0xffff - 1) / 0xffff;
+	unsigned int size = 2 + raw_size + block_count * 5 + 4;
+	byte* data = new byte[size];
+	byte* pos = data;
+	*pos++ = 0x78; // deflate, 32K window
+	*pos++ = 0x01; // no compression, check bits
+
+	uint32_t adler_a = 1, adler_b = 0;
+	unsigned int done = 0, block_left = 0;
+	for (int y = 0; y < height; y++)
+	{
+		for (unsigned int x = 0; x < row_size; x++)
+		{
+			if (block_left == 0)
+			{
+				block_left = min(raw_size - done, 0xffffu);
+				*pos++ = (done + block_left == raw_size) ? 1 : 0; // last block
+				*pos++ = block_left & 0xff;
+				*pos++ = (block_left >> 8) & 0xff;
+				*pos++ = ~block_left & 0xff;
+				*pos++ = (~block_left >> 8) & 0xff;
+			}
+			byte value = (x == 0) ? 0 : converted[y * width * 3 + x - 1];
+			*pos++ = value;
+			adler_a = (adler_a + value) % 65521;
+			adler_b = (adler_b + adler_a) % 65521;
+			block_left--;
+			done++;
+		}
+	}
+	putBigEndian(pos, (adler_b << 16) | adler_a);
+	writeChunk(out, "IDAT", data, size);
+	delete[] data;
+
+	writeChunk(out, "IEND", NULL, 0);
+	return out.good() ? 0 : -1;
+}
+
+void Capture::writeChunk(ofstream& out, const char* type, const byte* data, unsigned int size)
+{
+	byte word[4];
+	putBigEndian(word, size);
+	out.write((const char*)word, 4);
+	out.write(type, 4);
+	if (size) out.write((const char*)data, size);
+
+	uint32_t crc = 0xffffffff;
+	for (int i = 0; i < 4; i++)
+		crc = crc_table[(crc ^ (byte)type[i]) & 0xff] ^ (crc >> 8);
+	for (unsigned int i = 0; i < size; i++)
+		crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	putBigEndian(word, crc ^ 0xffffffff);
+	out.write((const char*)word, 4);
+}
+
+void Capture::close()
+{
+	if (stream.is_open()) stream.close();
+	delete[] converted;
+	delete[] last_frame;
+	converted = NULL;
+	last_frame = NULL;
+}
+
+bool Capture::isOpen()
+{
+	return converted != NULL;
+}
+
+unsigned int Capture::getFrameCount()
+{
+	return frame_count;
+}
+
+unsigned int Capture::getDuplicateCount()
+{
+	return duplicate_count;
+}
+
+Capture::~Capture()
+{
+	close();
+}
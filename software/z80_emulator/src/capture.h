@@ -0,0 +1,95 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdafx.h>
+
+/* Output formats, chosen by the file extension */
+#define CAPTURE_PPM 0	// numbered binary PPM files
+#define CAPTURE_PNG 1	// numbered PNG files (uncompressed)
+#define CAPTURE_RAW 2	// single stream of RGB24 frames
+#define CAPTURE_Y4M 3	// single YUV4MPEG2 stream (4:4:4)
+
+/**
+ * Writes RGB332 frames to image sequences or video streams.
+ * Identical consecutive frames are converted only once; image
+ * sequences skip them (files are numbered by frame index),
+ * streams repeat the previous frame to keep their frame rate.
+ */
+class Capture
+{
+public:
+	Capture();
+
+	/**
+	 * Opens the capture target 'name' for frames of 'width' x 'height' pixels
+	 * at 'rate_num'/'rate_den' frames per second. Names of image sequences may
+	 * contain a printf-style frame number (e.g. frame%05d.png), otherwise one
+	 * is appended. Returns 0 on success and -1 on errors.
+	 */
+	int open(const string& name, int width, int height, int rate_num, int rate_den);
+
+	/**
+	 * Captures an RGB332 frame, returns -1 on write errors
+	 */
+	int writeFrame(const byte* pixels);
+
+	void close();
+
+	bool isOpen();
+
+	unsigned int getFrameCount();
+
+	unsigned int getDuplicateCount();
+
+	~Capture();
+
+private:
+	/**
+	 * Converts 'pixels' to RGB24 (or YUV planes for Y4M)
+	 */
+	void convert(const byte* pixels);
+
+	string getFileName(unsigned int index);
+
+	int writePPM(const string& file_name);
+
+	int writePNG(const string& file_name);
+
+	void writeChunk(ofstream& out, const char* type, const byte* data, unsigned int size);
+
+	int format;
+	string name;
+	ofstream stream; // RAW and Y4M
+	int width, height;
+	byte* last_frame; // RGB332, for duplicate detection
+	byte* converted;
+	unsigned int converted_size;
+	bool has_frame;
+	unsigned int frame_count, duplicate_count;
+
+	/* Per RGB332 value: R, G, B (or Y, U, V) */
+	byte lut[256][3];
+	uint32_t crc_table[256];
+};
+
+#endif // CAPTURE_H
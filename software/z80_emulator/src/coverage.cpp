@@ -0,0 +1,220 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "coverage.h"
+#include "symbols.h"
+#include <vector>
+
+static const char* kind_flags = "XRW";
+
+/* Rounds up to whole banks, so every page of a mapped bank lies inside the bitmap */
+static unsigned int getImageBits(int size, int bank_size)
+{
+	return (unsigned int)((size + bank_size - 1) / bank_size) * bank_size;
+}
+
+static void putLE(byte* dst, uint64_t value, int size)
+{
+	for (int i = 0; i < size; i++)
+		dst[i] = (byte)(value >> (i * 8));
+}
+
+Coverage::Coverage(int rom_size, int bootrom_size)
+{
+	this->rom_size = rom_size;
+	this->bootrom_size = bootrom_size;
+
+	/*
+	 * Bit layout of the image bitmaps: the scratch page for pages without
+	 * an image, then the ROM and the BootROM, each preceded by a guard byte
+	 * (BOOTROM_N_OFFSET is not page aligned, so its first page starts one
+	 * bit before the image). All images start on a byte boundary.
+	 */
+	rom_start = MEM_PAGE_SIZE + 8;
+	bootrom_start = rom_start + getImageBits(rom_size, ROM_N_SIZE) + 8;
+	unsigned int bytes = (bootrom_start + getImageBits(bootrom_size, BOOTROM_N_SIZE)) / 8 + 1;
+
+	for (int kind = 0; kind < COVERAGE_KINDS; kind++)
+	{
+		space[kind] = new byte[0x10000 / 8];
+		memset(space[kind], 0, 0x10000 / 8);
+		images[kind] = new byte[bytes];
+		memset(images[kind], 0, bytes);
+	}
+	for (int page = 0; page < MEM_PAGE_COUNT; page++)
+		image_base[page] = 0;
+}
+
+void Coverage::mapImage(int offset, int size, int image, int image_offset)
+{
+	int image_size = (image == COVERAGE_ROM) ? rom_size : (image == COVERAGE_BOOTROM) ? bootrom_size : 0;
+	bool mapped = image_offset < image_size;
+
+	int first = offset >> MEM_PAGE_SHIFT;
+	int last = (offset + size - 1) >> MEM_PAGE_SHIFT;
+	for (int page = first; page <= last && page < MEM_PAGE_COUNT; page++)
+	{
+		int page_addr = page << MEM_PAGE_SHIFT;
+		image_base[page] = mapped ? getImageStart(image) + image_offset + (page_addr - offset) : 0;
+	}
+}
+
+bool Coverage::isCode(dword address)
+{
+	unsigned int base = image_base[address >> MEM_PAGE_SHIFT];
+	if (base < rom_start) return GET_BIT(space[COVERAGE_EXECUTED][address >> 3], (address & 7)) != 0;
+
+	unsigned int index = base + (address & MEM_PAGE_MASK);
+	return GET_BIT(images[COVERAGE_EXECUTED][index >> 3], (index & 7)) != 0;
+}
+
+unsigned int Coverage::getImageStart(int image)
+{
+	return (image == COVERAGE_ROM) ? rom_start : bootrom_start;
+}
+
+bool Coverage::isSet(int image, int kind, int offset)
+{
+	if (image == COVERAGE_NONE) return GET_BIT(space[kind][offset >> 3], (offset & 7)) != 0;
+
+	unsigned int index = getImageStart(image) + offset;
+	return GET_BIT(images[kind][index >> 3], (index & 7)) != 0;
+}
+
+int Coverage::getCount(int image, int kind)
+{
+	int size = (image == COVERAGE_ROM) ? rom_size : (image == COVERAGE_BOOTROM) ? bootrom_size : 0x10000;
+	int count = 0;
+	for (int offset = 0; offset < size; offset++)
+	{
+		if (isSet(image, kind, offset)) count++;
+	}
+	return count;
+}
+
+int Coverage::write(const string& file_name)
+{
+	ofstream out(file_name.c_str(), ofstream::out | ofstream::binary);
+	if (!out.is_open())
+	{
+		cerr << "Unable to write coverage to '" << file_name << "'" << endl;
+		return -1;
+	}
+
+	byte header[COVERAGE_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	memcpy(header, COVERAGE_MAGIC, 8);
+	putLE(header + 8, COVERAGE_VERSION, 2);
+	putLE(header + 10, COVERAGE_KINDS, 2);
+	putLE(header + 12, rom_size, 4);
+	putLE(header + 16, bootrom_size, 4);
+	out.write((const char*)header, sizeof(header));
+
+	for (int kind = 0; kind < COVERAGE_KINDS; kind++)
+		out.write((const char*)space[kind], 0x10000 / 8);
+
+	for (int image = COVERAGE_ROM; image <= COVERAGE_BOOTROM; image++)
+	{
+		int size = (image == COVERAGE_ROM) ? rom_size : bootrom_size;
+		for (int kind = 0; kind < COVERAGE_KINDS; kind++)
+		{
+			vector<byte> bits(images[kind] + getImageStart(image) / 8, images[kind] + getImageStart(image) / 8 + (size + 7) / 8);
+			if (size & 7) bits.back() &= (byte)((1 << (size & 7)) - 1); // accesses past the end of the image (HALT fill)
+			if (!bits.empty()) out.write((const char*)&bits[0], bits.size());
+		}
+	}
+	return out.good() ? 0 : -1;
+}
+
+int Coverage::writeListing(const string& file_name, SymbolTable& symbols, const string& rom_name, const string& bootrom_name)
+{
+	ofstream out(file_name.c_str());
+	if (!out.is_open())
+	{
+		cerr << "Unable to write coverage listing to '" << file_name << "'" << endl;
+		return -1;
+	}
+
+	out << "# flags: X = executed, R = read, W = written" << endl;
+	out << "# address space" << endl;
+	writeRuns(out, COVERAGE_NONE, 0x10000, symbols);
+	out << endl << "# ROM '" << rom_name << "'" << endl;
+	writeRuns(out, COVERAGE_ROM, rom_size, symbols);
+	out << endl << "# BootROM '" << bootrom_name << "'" << endl;
+	writeRuns(out, COVERAGE_BOOTROM, bootrom_size, symbols);
+	return 0;
+}
+
+void Coverage::writeRuns(ostream& out, int image, int size, SymbolTable& symbols)
+{
+	out << "# " << dec << size << " bytes";
+	for (int kind = 0; kind < COVERAGE_KINDS; kind++)
+	{
+		int count = getCount(image, kind);
+		out << ", " << kind_flags[kind] << " " << count;
+		if (size) out << " (" << fixed << setprecision(1) << (100.0 * count / size) << "%)";
+	}
+	out << endl;
+
+	int start = 0;
+	while (start < size)
+	{
+		string flags;
+		for (int kind = 0; kind < COVERAGE_KINDS; kind++)
+			flags += isSet(image, kind, start) ? kind_flags[kind] : '-';
+
+		int end = start + 1;
+		while (end < size)
+		{
+			bool same = true;
+			for (int kind = 0; kind < COVERAGE_KINDS && same; kind++)
+				same = isSet(image, kind, end) == (flags[kind] != '-');
+			if (!same) break;
+			end++;
+		}
+
+		/* Images are listed by offset, with the bank and the CPU address it appears at */
+		int address = start;
+		out << hex << setfill('0');
+		if (image == COVERAGE_NONE)
+		{
+			out << setw(4) << start << "-" << setw(4) << (end - 1);
+		}
+		else
+		{
+			int bank_size = (image == COVERAGE_ROM) ? ROM_N_SIZE : BOOTROM_N_SIZE;
+			int bank = start / bank_size;
+			if (image == COVERAGE_ROM) address = (bank ? ROM_N_OFFSET : ROM_0_OFFSET) + start % bank_size;
+			else address = (bank ? BOOTROM_N_OFFSET : BOOTROM_0_OFFSET) + start % bank_size;
+			out << setw(6) << start << "-" << setw(6) << (end - 1) << "  " << bank << ":" << setw(4) << address;
+		}
+		out << setfill(' ') << dec << "  " << flags << "  " << setw(5) << (end - start)
+			<< "  " << symbols.describe((dword)address) << endl;
+		start = end;
+	}
+}
+
+Coverage::~Coverage()
+{
+	for (int kind = 0; kind < COVERAGE_KINDS; kind++)
+	{
+		delete[] space[kind];
+		delete[] images[kind];
+	}
+}
@@ -0,0 +1,131 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <config.standard.h>
+#include <stdafx.h>
+#include "memory.h"
+
+class SymbolTable;
+
+/* Access kinds, one bitmap each */
+#define COVERAGE_EXECUTED 0	// instruction bytes (opcode, prefix and operands)
+#define COVERAGE_READ 1		// data reads by the CPU
+#define COVERAGE_WRITTEN 2	// data writes by the CPU (including ignored writes to ROM)
+#define COVERAGE_KINDS 3
+
+/* Images with their own bitmaps, covering all banks */
+#define COVERAGE_NONE 0
+#define COVERAGE_ROM 1
+#define COVERAGE_BOOTROM 2
+
+/*
+ * Coverage file layout (little endian):
+ *   header: "Z80COVER", u16 version, u16 kind count, u32 ROM size,
+ *           u32 BootROM size, u8[12] reserved
+ *   address space: executed, read and written bitmaps of 0x2000 bytes each
+ *   ROM: executed, read and written bitmaps of (ROM size + 7) / 8 bytes each
+ *   BootROM: likewise
+ * Bit n of byte i stands for address (or image offset) i * 8 + n.
+ */
+#define COVERAGE_MAGIC "Z80COVER"
+#define COVERAGE_VERSION 1
+#define COVERAGE_HEADER_SIZE 32
+
+/**
+ * Per-byte bitmaps of the executed, read and written addresses of the
+ * 64 KiB address space and of every byte of the ROM and BootROM images
+ */
+class Coverage
+{
+public:
+	/**
+	 * Allocates the image bitmaps, all pages start unmapped
+	 */
+	Coverage(int rom_size, int bootrom_size);
+
+	/**
+	 * Marks an access to 'address' in the address space and in the image
+	 * mapped there, without branches
+	 */
+	inline void mark(int kind, dword address)
+	{
+		space[kind][address >> 3] |= (byte)(1 << (address & 7));
+		unsigned int index = image_base[address >> MEM_PAGE_SHIFT] + (address & MEM_PAGE_MASK);
+		images[kind][index >> 3] |= (byte)(1 << (index & 7));
+	}
+
+	inline void markExecuted(dword address, int length)
+	{
+		for (int i = 0; i < length; i++)
+			mark(COVERAGE_EXECUTED, (dword)(address + i));
+	}
+
+	/**
+	 * Maps 'size' bytes at 'offset' to 'image' starting at 'image_offset'
+	 * (bank switches). Offsets past the end of the image unmap the pages.
+	 */
+	void mapImage(int offset, int size, int image, int image_offset);
+
+	/**
+	 * True if the byte at 'address' has been executed as part of an
+	 * instruction, in the image currently mapped there if any
+	 */
+	bool isCode(dword address);
+
+	/**
+	 * Number of bytes of 'image' (COVERAGE_NONE = address space) marked as 'kind'
+	 */
+	int getCount(int image, int kind);
+
+	/**
+	 * Writes the bitmaps, returns -1 on errors
+	 */
+	int write(const string& file_name);
+
+	/**
+	 * Writes runs of bytes with the same accesses per region, annotated with symbols
+	 */
+	int writeListing(const string& file_name, SymbolTable& symbols, const string& rom_name, const string& bootrom_name);
+
+	~Coverage();
+
+private:
+	bool isSet(int image, int kind, int offset);
+
+	/**
+	 * Index of the first bit of 'image'
+	 */
+	unsigned int getImageStart(int image);
+
+	/**
+	 * Lists the runs of 'image' (COVERAGE_NONE = address space)
+	 */
+	void writeRuns(ostream& out, int image, int size, SymbolTable& symbols);
+
+	int rom_size, bootrom_size;
+	unsigned int rom_start, bootrom_start; // first bit of the images
+	byte* space[COVERAGE_KINDS];
+	byte* images[COVERAGE_KINDS]; // unmapped scratch page, ROM, BootROM
+	unsigned int image_base[MEM_PAGE_COUNT]; // bit index of the first byte of each page
+};
+
+#endif // COVERAGE_H
@@ -20,13 +20,88 @@
 
 #include "cpu.h"
 #include "wrappers.h"
+#include "profiler.h"
+#include "trace.h"
+#include "coverage.h"
+#include "savestate.h"
 #include <config.standard.h>
 
 CPU::CPU()
 {
+	if (!opcode_tables_built) buildOpcodeTables();
+	memory_map = NULL;
+	profiler = NULL;
+	tracer = NULL;
+	coverage = NULL;
+	idle_detection = true;
 	reset();
 }
 
+void CPU::setMemoryMap(MemoryMap* memory_map)
+{
+	this->memory_map = memory_map;
+}
+
+void CPU::setProfiler(Profiler* profiler)
+{
+	this->profiler = profiler;
+}
+
+void CPU::setTracer(Tracer* tracer)
+{
+	this->tracer = tracer;
+}
+
+void CPU::setCoverage(Coverage* coverage)
+{
+	this->coverage = coverage;
+}
+
+inline byte CPU::fetch(dword address)
+{
+	byte* page = memory_map->read[address >> MEM_PAGE_SHIFT];
+	if (page) return page[address & MEM_PAGE_MASK];
+	return Machine_ReadMem(address);
+}
+
+inline byte CPU::readMem(dword address)
+{
+	stats.reads[address >> MEM_PAGE_SHIFT]++;
+	if (coverage) coverage->mark(COVERAGE_READ, address);
+	byte* page = memory_map->read[address >> MEM_PAGE_SHIFT];
+	if (page) return page[address & MEM_PAGE_MASK];
+
+	byte value = Machine_ReadMem(address);
+	if (memory_map->traps[address >> MEM_PAGE_SHIFT] & MEM_TRAP_READ) Machine_CheckWatchpoint(address, value, MEM_TRAP_READ);
+	return value;
+}
+
+inline void CPU::writeMem(dword address, byte value)
+{
+	stats.writes[address >> MEM_PAGE_SHIFT]++;
+	if (coverage) coverage->mark(COVERAGE_WRITTEN, address);
+	byte* page = memory_map->write[address >> MEM_PAGE_SHIFT];
+	if (page)
+	{
+		byte* data = &page[address & MEM_PAGE_MASK];
+		if (*data != value) side_effects++; // rewriting the same value (e.g. pushing a return address) has no effect
+		*data = value;
+	}
+	else
+	{
+		side_effects++;
+		Machine_WriteMem(address, value);
+		if (memory_map->traps[address >> MEM_PAGE_SHIFT] & MEM_TRAP_WRITE) Machine_CheckWatchpoint(address, value, MEM_TRAP_WRITE);
+	}
+}
+
+inline void CPU::jump(dword target)
+{
+	if (idle_detection && target <= op_pc && (op_pc - target) <= IDLE_LOOP_MAX_SIZE)
+		checkIdleLoop(target);
+	pc = target;
+}
+
 void CPU::reset()
 {
 	af.af = 0;
@@ -35,12 +110,20 @@ void CPU::reset()
 	hl.hl = 0;
 	sp = RESET_SP;
 	pc = RESET_PC;
+	cycles = 0;
+	op_cycles = 0;
 	halted = 0;
 	irq = 0;
 	irq_disabled = 0;
 	irq_processing = 0;
 	irq_state_change_counter = 0;
 	irq_change_state = 0xff;
+	irq_entered = false;
+	side_effects = 0;
+	idle_period = 0;
+	idle_instructions = 0;
+	memset(&idle_loop, 0, sizeof(idle_loop));
+	memset(&stats, 0, sizeof(stats));
 }
 
 void CPU::printState()
@@ -56,6 +139,8 @@ void CPU::printState()
  	cout << "PC = " << pc << endl;
 	cout << "flags = " << (dword)af.f << endl << endl; // workaround
 
+	cout << "Cycles = " << dec << cycles << hex << endl;
+
 	cout << "Halted = " << halted << endl;
 	cout << "IRQ = " << (dword)irq << endl; // ditto
 	cout << "IRQ processing = " << (dword)irq_processing << endl;
@@ -71,6 +156,66 @@ void CPU::printState()
 	cout << endl;
 }
 
+void CPU::writeState(ostream& out)
+{
+	out << dec << "{";
+	out << "\"af\": " << af.af << ", ";
+	out << "\"bc\": " << bc.bc << ", ";
+	out << "\"de\": " << de.de << ", ";
+	out << "\"hl\": " << hl.hl << ", ";
+	out << "\"sp\": " << sp << ", ";
+	out << "\"pc\": " << pc << ", ";
+	out << "\"halted\": " << halted << ", ";
+	out << "\"irq\": " << (int)irq << ", ";
+	out << "\"irq_processing\": " << (int)irq_processing << ", ";
+	out << "\"irq_disabled\": " << (int)irq_disabled << ", ";
+	out << "\"cycles\": " << cycles;
+	out << "}";
+}
+
+void CPU::saveState(StateWriter& state)
+{
+	state.beginSection(STATE_SECTION_CPU);
+	state.put16(af.af);
+	state.put16(bc.bc);
+	state.put16(de.de);
+	state.put16(hl.hl);
+	state.put16(sp);
+	state.put16(pc);
+	state.put16(op_pc);
+	state.put64(cycles);
+	state.put64(op_cycles);
+	state.put8(irq);
+	state.put8(irq_processing);
+	state.put8(irq_state_change_counter);
+	state.put8(irq_change_state);
+	state.put8(irq_disabled);
+	state.put8((byte)halted);
+	state.endSection();
+}
+
+int CPU::loadState(StateReader& state)
+{
+	if (state.openSection(STATE_SECTION_CPU)) return -1;
+	reset(); // the idle loop state and statistics start over
+	af.af = state.get16();
+	bc.bc = state.get16();
+	de.de = state.get16();
+	hl.hl = state.get16();
+	sp = state.get16();
+	pc = state.get16();
+	op_pc = state.get16();
+	cycles = state.get64();
+	op_cycles = state.get64();
+	irq = state.get8();
+	irq_processing = state.get8();
+	irq_state_change_counter = state.get8();
+	irq_change_state = state.get8();
+	irq_disabled = state.get8();
+	halted = state.get8();
+	return state.hasError() ? -1 : 0;
+}
+
 void CPU::hexdump(int addr, string label, int downwards)
 {
 	cout << hex;
@@ -81,6 +226,7 @@ void CPU::hexdump(int addr, string label, int downwards)
 		else cout << "-0x" << ((i + 1) * 8) - 1 << "\t";
 		for (int j = 0; j < 8; j++)
 		{
+			// bypasses readMem(), dumps are not counted as memory accesses
 			if (!downwards) cout << "0x" << ((dword)Machine_ReadMem(addr + (i * 8 + j)) & 0xff) << " ";
 			else cout << "0x" << ((dword)Machine_ReadMem(addr + (-i * 8 - j)) & 0xff) << " ";
 		}
@@ -89,27 +235,153 @@ void CPU::hexdump(int addr, string label, int downwards)
 	cout << dec;
 }
 
-void CPU::next()
+/*
+ * Opcode description table. The opcode tables are generated from it,
+ * so the first matching description of a page wins. Opcodes not
+ * matched by any description are illegal (main page) or ignored
+ * (prefixed pages).
+ */
+const OpcodeDescription CPU::opcode_descriptions[] =
 {
-	FOR_I_(4, cycle());
-	if (halted) // CPU is halted
+	/* page, mask, match, operand length, cycles, class, handler, mnemonic */
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x00, 0, 4, OPCODE_CLASS_CONTROL, &CPU::opNop, "NOP" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x76, 0, 4, OPCODE_CLASS_CONTROL, &CPU::opHalt, "HALT" },
+
+	/* 8-bit loads */
+	{ OPCODE_PAGE_MAIN, 0xC7, 0x46, 0, 4, OPCODE_CLASS_LOAD8, &CPU::opLdRHL, "LD r, (HL)" },
+	{ OPCODE_PAGE_MAIN, 0xF8, 0x70, 0, 4, OPCODE_CLASS_LOAD8, &CPU::opLdHLR, "LD (HL), r" },
+	{ OPCODE_PAGE_MAIN, 0xC0, 0x40, 0, 4, OPCODE_CLASS_LOAD8, &CPU::opLdRR, "LD r, r'" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x36, 1, 7, OPCODE_CLASS_LOAD8, &CPU::opLdHLN, "LD (HL), n" },
+	{ OPCODE_PAGE_MAIN, 0xC7, 0x06, 1, 7, OPCODE_CLASS_LOAD8, &CPU::opLdRN, "LD r, n" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x0A, 0, 4, OPCODE_CLASS_LOAD8, &CPU::opLdABC, "LD A, (BC)" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x1A, 0, 4, OPCODE_CLASS_LOAD8, &CPU::opLdADE, "LD A, (DE)" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x3A, 2, 10, OPCODE_CLASS_LOAD8, &CPU::opLdANN, "LD A, (nn)" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x02, 0, 4, OPCODE_CLASS_LOAD8, &CPU::opLdBCA, "LD (BC), A" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x12, 0, 4, OPCODE_CLASS_LOAD8, &CPU::opLdDEA, "LD (DE), A" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x32, 2, 10, OPCODE_CLASS_LOAD8, &CPU::opLdNNA, "LD (nn), A" },
+
+	/* 16-bit loads */
+	{ OPCODE_PAGE_MAIN, 0xCF, 0x01, 2, 10, OPCODE_CLASS_LOAD16, &CPU::opLdDDNN, "LD dd, nn" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x2A, 2, 16, OPCODE_CLASS_LOAD16, &CPU::opLdHLNN, "LD HL, (nn)" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x22, 2, 16, OPCODE_CLASS_LOAD16, &CPU::opLdNNHL, "LD (nn), HL" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xF9, 0, 6, OPCODE_CLASS_LOAD16, &CPU::opLdSPHL, "LD SP, HL" },
+	{ OPCODE_PAGE_MAIN, 0xCF, 0xC5, 0, 11, OPCODE_CLASS_LOAD16, &CPU::opPush, "PUSH qq" },
+	{ OPCODE_PAGE_MAIN, 0xCF, 0xC1, 0, 10, OPCODE_CLASS_LOAD16, &CPU::opPop, "POP qq" },
+
+	/* 8-bit arithmetic and logic */
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x86, 0, 7, OPCODE_CLASS_ALU8, &CPU::opAddHL, "ADD A, (HL)" },
+	{ OPCODE_PAGE_MAIN, 0xF8, 0x80, 0, 4, OPCODE_CLASS_ALU8, &CPU::opAddR, "ADD A, r" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xC6, 1, 7, OPCODE_CLASS_ALU8, &CPU::opAddN, "ADD A, n" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x96, 0, 7, OPCODE_CLASS_ALU8, &CPU::opSubHL, "SUB A, (HL)" },
+	{ OPCODE_PAGE_MAIN, 0xF8, 0x90, 0, 4, OPCODE_CLASS_ALU8, &CPU::opSubR, "SUB A, r" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xD6, 1, 7, OPCODE_CLASS_ALU8, &CPU::opSubN, "SUB A, n" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xA6, 0, 7, OPCODE_CLASS_ALU8, &CPU::opAndHL, "AND A, (HL)" },
+	{ OPCODE_PAGE_MAIN, 0xF8, 0xA0, 0, 4, OPCODE_CLASS_ALU8, &CPU::opAndR, "AND A, r" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xE6, 1, 7, OPCODE_CLASS_ALU8, &CPU::opAndN, "AND A, n" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xB6, 0, 7, OPCODE_CLASS_ALU8, &CPU::opOrHL, "OR A, (HL)" },
+	{ OPCODE_PAGE_MAIN, 0xF8, 0xB0, 0, 4, OPCODE_CLASS_ALU8, &CPU::opOrR, "OR A, r" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xF6, 1, 7, OPCODE_CLASS_ALU8, &CPU::opOrN, "OR A, n" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xAE, 0, 7, OPCODE_CLASS_ALU8, &CPU::opXorHL, "XOR A, (HL)" },
+	{ OPCODE_PAGE_MAIN, 0xF8, 0xA8, 0, 4, OPCODE_CLASS_ALU8, &CPU::opXorR, "XOR A, r" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xEE, 1, 7, OPCODE_CLASS_ALU8, &CPU::opXorN, "XOR A, n" },
+
+	/* 16-bit arithmetic */
+	{ OPCODE_PAGE_MAIN, 0xCF, 0x03, 0, 6, OPCODE_CLASS_ALU16, &CPU::opIncSS, "INC ss" },
+	{ OPCODE_PAGE_MAIN, 0xCF, 0x0B, 0, 6, OPCODE_CLASS_ALU16, &CPU::opDecSS, "DEC ss" },
+
+	/* Rotates */
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x07, 0, 4, OPCODE_CLASS_ROTATE, &CPU::opRlca, "RLCA" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x17, 0, 4, OPCODE_CLASS_ROTATE, &CPU::opRla, "RLA" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x0F, 0, 4, OPCODE_CLASS_ROTATE, &CPU::opRrca, "RRCA" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0x1F, 0, 4, OPCODE_CLASS_ROTATE, &CPU::opRra, "RRA" },
+
+	/* Jumps, calls and returns */
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xC3, 2, 10, OPCODE_CLASS_BRANCH, &CPU::opJp, "JP nn" },
+	{ OPCODE_PAGE_MAIN, 0xC7, 0xC2, 2, 10, OPCODE_CLASS_BRANCH, &CPU::opJpCC, "JP cc, nn" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xE9, 0, 4, OPCODE_CLASS_BRANCH, &CPU::opJpHL, "JP (HL)" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xCD, 2, 17, OPCODE_CLASS_BRANCH, &CPU::opCall, "CALL nn" },
+	{ OPCODE_PAGE_MAIN, 0xC7, 0xC4, 2, 10, OPCODE_CLASS_BRANCH, &CPU::opCallCC, "CALL cc, nn" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xC9, 0, 10, OPCODE_CLASS_BRANCH, &CPU::opRet, "RET" },
+	{ OPCODE_PAGE_MAIN, 0xC7, 0xC0, 0, 5, OPCODE_CLASS_BRANCH, &CPU::opRetCC, "RET cc" },
+	{ OPCODE_PAGE_MAIN, 0xC7, 0xC7, 0, 4, OPCODE_CLASS_BRANCH, &CPU::opRst, "RST p" },
+	{ OPCODE_PAGE_MAIN, 0xF7, 0x10, 1, 7, OPCODE_CLASS_INVALID, &CPU::opIllegal, "DJNZ/JR e" },
+	{ OPCODE_PAGE_MAIN, 0xE7, 0x20, 1, 7, OPCODE_CLASS_INVALID, &CPU::opIllegal, "JR cc, e" },
+
+	/* Input/output */
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xDB, 1, 11, OPCODE_CLASS_IO, &CPU::opIn, "IN A, (n)" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xD3, 1, 11, OPCODE_CLASS_IO, &CPU::opOut, "OUT (n), A" },
+
+	/* CPU control */
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xFB, 0, 4, OPCODE_CLASS_CONTROL, &CPU::opEi, "EI" },
+	{ OPCODE_PAGE_MAIN, 0xFF, 0xF3, 0, 4, OPCODE_CLASS_CONTROL, &CPU::opDi, "DI" },
+
+	/* Extended instructions */
+	{ OPCODE_PAGE_ED, 0xFF, 0x4D, 0, 4, OPCODE_CLASS_BRANCH, &CPU::opReti, "RETI" },
+	{ OPCODE_PAGE_ED, 0xFF, 0xFF, 0, 4, OPCODE_CLASS_CONTROL, &CPU::opDds, "DDS" },
+
+	{ 0, 0, 0, 0, 0, 0, NULL, NULL } // end of table
+};
+
+OpcodeEntry CPU::opcode_table[OPCODE_PAGE_COUNT][256];
+bool CPU::opcode_tables_built = false;
+
+void CPU::buildOpcodeTables()
+{
+	for (int page = 0; page < OPCODE_PAGE_COUNT; page++)
 	{
-		if (irq && !irq_disabled) // continue operation if IRQ has been fired and irq not disabled
+		for (int opcode = 0; opcode < 256; opcode++)
 		{
-			halted = 0;
+			OpcodeEntry* entry = &opcode_table[page][opcode];
+			if (page == OPCODE_PAGE_MAIN)
+			{
+				entry->handler = &CPU::opIllegal;
+				entry->mnemonic = "illegal";
+			}
+			else
+			{
+				entry->handler = &CPU::opUnimplemented;
+				entry->mnemonic = "unimplemented";
+			}
+			entry->operand_length = 0;
+			entry->cycles = 4;
+			entry->next_page = OPCODE_PAGE_MAIN;
+			entry->op_class = OPCODE_CLASS_INVALID;
+
+			for (const OpcodeDescription* desc = opcode_descriptions; desc->handler != NULL; desc++)
+			{
+				if (desc->page == page && (opcode & desc->mask) == desc->match)
+				{
+					entry->handler = desc->handler;
+					entry->operand_length = desc->operand_length;
+					entry->cycles = desc->cycles;
+					entry->op_class = desc->op_class;
+					entry->mnemonic = desc->mnemonic;
+					break;
+				}
+			}
 		}
-		return;
 	}
 
-	if (irq && irq_processing && !irq_disabled)
-	{
-		irq_processing = 1;
+	/* Prefix bytes switch over to their page */
+	opcode_table[OPCODE_PAGE_MAIN][0xCB].next_page = OPCODE_PAGE_CB;
+	opcode_table[OPCODE_PAGE_MAIN][0xDD].next_page = OPCODE_PAGE_DD;
+	opcode_table[OPCODE_PAGE_MAIN][0xED].next_page = OPCODE_PAGE_ED;
+	opcode_table[OPCODE_PAGE_MAIN][0xFD].next_page = OPCODE_PAGE_FD;
 
-		/* Push current PC to stack and jump to 0038h */
-		push(pc);
-		pc = 0x0038;
-	}
+	opcode_tables_built = true;
+}
 
+void CPU::next()
+{
+	/* Pages with breakpoints have no read pointer, so only their instructions are checked */
+	byte* code = memory_map->read[pc >> MEM_PAGE_SHIFT];
+	if (!code && (memory_map->traps[pc >> MEM_PAGE_SHIFT] & MEM_TRAP_EXEC) && !halted && Machine_CheckBreakpoint(pc))
+		return;
+
+	op_cycles = cycles;
+	cycles += 4;
+
+	/* Delayed EI/DI, also applies while halted (EI; HALT) */
 	if (irq_state_change_counter == 0 && irq_change_state < 0xff)
 	{
 		if (irq_change_state == 1) irq_disabled = 0;
@@ -121,459 +393,597 @@ void CPU::next()
 		irq_state_change_counter--;
 	}
 
-	byte opcode0 = Machine_ReadMem(pc++);
-	if (opcode0 == 0xCB || opcode0 == 0xDD || opcode0 == 0xFD || opcode0 == 0xED)
+	if (halted) // CPU is halted
 	{
-		byte opcode1 = Machine_ReadMem(pc++);
-		if (opcode0 == 0xED)
+		stats.halted_cycles += 4;
+		if (profiler) profiler->addCycles(op_pc, 4, true);
+		if (irq && !irq_disabled) // continue operation if IRQ has been fired and irq not disabled
 		{
-			/* RETI */
-			if (opcode1 == 0x4D)
-			{
-				if (irq_processing)
-				{
-					FOR_I_(10, cycle());
-					pc = pop();
-					irq = 0;
-					irq_processing = 0;
-					irq_disabled = 1;
-				}
-			}
-
-			/* DDS (Debug Dump State) */
-			if (opcode1 == 0xFF)
-			{
-				cout << "DDS -> printState()" << endl;
-				printState();
-			}
+			halted = 0;
 		}
+		return;
 	}
-	else if (opcode0 != 0x00) // != NOP
+
+	bool irq_taken = false;
+	if (irq && !irq_processing && !irq_disabled)
 	{
-		dword opcode1 = 0;
-		/* Instruction operand fetching */
-		switch (opcode0)
-		{
-			/* 2-byte operand */
-			case 0x01:
-			case 0x11:
-			case 0x21:
-			case 0x31:
-			case 0xC2:
-			case 0xD2:
-			case 0xE2:
-			case 0xF2:
-			case 0xC3:
-			case 0xC4:
-			case 0xD4:
-			case 0xE4:
-			case 0xF4:
-			case 0x2A:
-			case 0x3A:
-			case 0xCA:
-			case 0xDA:
-			case 0xEA:
-			case 0xFA:
-			case 0xCC:
-			case 0xDC:
-			case 0xEC:
-			case 0xFC:
-			case 0xCD:
-			case 0x32:
-				FOR_I_(6, cycle()); // all these instruction need at least 10 cycles, so 10 - 4 = 6
-				opcode1 = Machine_ReadMem(pc++);
-				opcode1 |= (Machine_ReadMem(pc++) << 8);
-				break;
-
-			/* 1-byte operand */
-			case 0x10:
-			case 0x20:
-			case 0x30:
-			case 0xD3:
-			case 0x06:
-			case 0x16:
-			case 0x26:
-			case 0x36:
-			case 0xC6:
-			case 0xD6:
-			case 0xE6:
-			case 0xF6:
-			case 0x18:
-			case 0x28:
-			case 0x38:
-			case 0xDB:
-			case 0x0E:
-			case 0x1E:
-			case 0x2E:
-			case 0x3E:
-			case 0xCE:
-			case 0xDE:
-			case 0xEE:
-			case 0xFE:
-				FOR_I_(3, cycle());
-				opcode1 = Machine_ReadMem(pc++);
-				break;
-
-			default:
-				break;
-		}
+		irq_taken = true;
+		irq_processing = 1;
+		stats.irqs++;
 
-		/* LD r, r' */
-		if (RANGE(opcode0, 0x40, 0x45) || RANGE(opcode0, 0x47, 0x4D) || RANGE(opcode0, 0x50, 0x55) || RANGE(opcode0, 0x57, 0x5D)
-			|| RANGE(opcode0, 0x60, 0x65) || RANGE(opcode0, 0x67, 0x6D) || RANGE(opcode0, 0x78, 0x7D) || opcode0 == 0x4F
-			|| opcode0 == 0x5F || opcode0 == 0x6F || opcode0 == 0x7F)
-		{
-			setRegisterValueByCode((opcode0 >> 3) & 0x7, getRegisterValueByCode(opcode0 & 0x7));
-		}
-		/* LD r, n */
-		else if (opcode0 == 0x06 || opcode0 == 0x16 || opcode0 == 0x26 || opcode0 == 0x0E || opcode0 == 0x1E || opcode0 == 0x2E || opcode0 == 0x3E)
-		{
-			setRegisterValueByCode((opcode0 >> 3) & 0x7, opcode1);
-		}
-		/* LD r, (HL) */
-		else if (opcode0 == 0x46 || opcode0 == 0x56 || opcode0 == 0x66 || opcode0 == 0x4E || opcode0 == 0x5E || opcode0 == 0x6E || opcode0 == 0x7E)
-		{
-			setRegisterValueByCode((opcode0 >> 3) & 0x7, Machine_ReadMem(hl.hl));
-		}
-		/* LD (HL), r */
-		else if ((RANGE(opcode0, 0x70, 0x77) && opcode0 != 0x76) || opcode0 == 0x36 || opcode0 == 0x46 || opcode0 == 0x56 || opcode0 == 0x66)
-		{
-			Machine_WriteMem(hl.hl, getRegisterValueByCode(opcode0 & 0x07));
-		}
-		/* LD (HL), n */
-		else if (opcode0 == 0x36)
-		{
-			Machine_WriteMem(hl.hl, opcode1 & 0xff);
-		}
-		/* LD A, (BC/DE/nn) */
-		else if (opcode0 == 0x0A || opcode0 == 0x1A || opcode0 == 0x3A)
-		{
-			switch (opcode0)
-			{
-				case 0x0A:
-					af.a = Machine_ReadMem(bc.bc);
-					break;
-				case 0x1A:
-					af.a = Machine_ReadMem(de.de);
-					break;
-				case 0x3A:
-					af.a = Machine_ReadMem(opcode1);
-					break;
-			}
-		}
-		/* LD (BC/DE/nn), A */
-		else if (opcode0 == 0x02 || opcode0 == 0x12 || opcode0 == 0x32)
-		{
-			switch (opcode0)
-			{
-				case 0x02:
-					Machine_WriteMem(bc.bc, af.a);
-					break;
-				case 0x12:
-					Machine_WriteMem(de.de, af.a);
-					break;
-				case 0x32:
-					Machine_WriteMem(opcode1, af.a);
-					break;
-			}
-		}
-		/* LD dd, nn */
-		else if (opcode0 == 0x01 || opcode0 == 0x11 || opcode0 == 0x21 || opcode0 == 0x31)
-		{
-			setRegisterPairValueByCode((opcode0 >> 4) & 0x3, opcode1);
-		}
-		/* LD HL, (nn) */
-		else if (opcode0 == 0x2A)
-		{
-			FOR_I_(6, cycle());
-			hl.h = Machine_ReadMem(opcode1 + 1);
-			hl.l = Machine_ReadMem(opcode1);
-		}
-		/* LD (nn), HL */
-		else if (opcode0 == 0x22)
-		{
-			FOR_I_(6, cycle());
-			Machine_WriteMem(opcode1 + 1, hl.h);
-			Machine_WriteMem(opcode1, hl.l);
-		}
-		/* LD SP, HL */
-		else if (opcode0 == 0xF9)
-		{
-			FOR_I_(2, cycle());
-			sp = hl.hl;
-		}
-		/* PUSH qq */
-		else if (opcode0 == 0xC5 || opcode0 == 0xD5 || opcode0 == 0xE5 || opcode0 == 0xF5)
-		{
-			FOR_I_(7, cycle());
-			unsigned int pair;
-			if (((opcode0 >> 4) & 0x3) != 3) pair = getRegisterPairValueByCode((opcode0 >> 4) & 0x3);
-			else pair = af.af;
-			push(pair);
-		}
-		/* POP qq */
-		else if (opcode0 == 0xC1 || opcode0 == 0xD1 || opcode0 == 0xE1 || opcode0 == 0xF1)
-		{
-			FOR_I_(6, cycle());
-			int value = pop();
-			if (((opcode0 >> 4) & 0x3) != 3) setRegisterPairValueByCode((opcode0 >> 4) & 0x3, value);
-			else af.af = value;
-		}
-		/* ADD A, r */
-		else if (RANGE(opcode0, 0x80, 0x87) && opcode0 != 0x86)
-		{
-			unsigned int old = (unsigned int)af.a;
-			af.a += getRegisterValueByCode(opcode0 & 0x3);
-			if (af.a < old) SET_BIT(af.f, FLAG_CARRY_POS);
-			updateFlags(af.a);
-		}
-		/* ADD A, n */
-		else if (opcode0 == 0xC6)
-		{
-			unsigned int old = (unsigned int)af.a;
-			af.a += opcode1 & 0xff;
-			if (af.a < old) SET_BIT(af.f, FLAG_CARRY_POS);
-			updateFlags(af.a);
-		}
-		/* ADD A, (HL) */
-		else if (opcode0 == 0x86)
-		{
-			unsigned int old = (unsigned int)af.a;
-			FOR_I_(3, cycle());
-			af.a += Machine_ReadMem(hl.hl);
-			if (af.a < old) SET_BIT(af.f, FLAG_CARRY_POS);
-			updateFlags(af.a);
-		}
-		/* SUB A, r */
-		else if (RANGE(opcode0, 0x90, 0x97) && opcode0 != 0x96)
-		{
-			af.a -= getRegisterValueByCode(opcode0 & 0x3);
-			updateFlags(af.a);
-		}
-		/* SUB A, n */
-		else if (opcode0 == 0xD6)
-		{
-			af.a -= opcode1 & 0xff;
-			updateFlags(af.a);
-		}
-		/* SUB A, (HL) */
-		else if (opcode0 == 0x96)
-		{
-			FOR_I_(3, cycle());
-			af.a -= Machine_ReadMem(hl.hl);
-			updateFlags(af.a);
-		}
-		/* AND A, r */
-		else if (RANGE(opcode0, 0xA0, 0xA7) && opcode0 != 0xA6)
-		{
-			af.a &= getRegisterValueByCode(opcode0 & 0x3);
-			updateFlags2(af.a);
-		}
-		/* AND A, n */
-		else if (opcode0 == 0xE6)
-		{
-			af.a &= opcode1 & 0xff;
-			updateFlags2(af.a);
-		}
-		/* AND A, (HL) */
-		else if (opcode0 == 0xA6)
-		{
-			FOR_I_(3, cycle());
-			af.a &= Machine_ReadMem(hl.hl);
-			updateFlags2(af.a);
-		}
-		/* OR A, r */
-		else if (RANGE(opcode0, 0xB0, 0xB7) && opcode0 != 0xB6)
-		{
-			af.a |= getRegisterValueByCode(opcode0 & 0x3);
-			updateFlags2(af.a);
-		}
-		/* OR A, n */
-		else if (opcode0 == 0xF6)
-		{
-			af.a |= opcode1 & 0xff;
-			updateFlags2(af.a);
-		}
-		/* OR A, (HL) */
-		else if (opcode0 == 0xB6)
-		{
-			FOR_I_(3, cycle());
-			af.a |= Machine_ReadMem(hl.hl);
-			updateFlags2(af.a);
-		}
-		/* XOR A, r */
-		else if (RANGE(opcode0, 0xA8, 0xAF) && opcode0 != 0xAE)
-		{
-			af.a ^= getRegisterValueByCode(opcode0 & 0x3);
-			updateFlags2(af.a);
-		}
-		/* XOR A, n */
-		else if (opcode0 == 0xEE)
-		{
-			af.a ^= opcode1 & 0xff;
-			updateFlags2(af.a);
-		}
-		/* XOR A, (HL) */
-		else if (opcode0 == 0xAE)
-		{
-			FOR_I_(3, cycle());
-			af.a ^= Machine_ReadMem(hl.hl);
-			updateFlags2(af.a);
-		}
-		/* JP nn */
-		else if (opcode0 == 0xC3)
-		{
-			pc = opcode1;
-		}
-		/* JP cc, nn */
-		else if (opcode0 == 0xC2 || opcode0 == 0xD2 || opcode0 == 0xE2 || opcode0 == 0xF2 ||
-			opcode0 == 0xCA || opcode0 == 0xDA || opcode0 == 0xEA || opcode0 == 0xFA)
-		{
-			if (isConditionTrue((opcode0 >> 3) & 0x3)) pc = opcode1;
-		}
-		/* JP (HL) */
-		else if (opcode0 == 0xE9)
-		{
-			pc = hl.hl;
-		}
-		/* CALL nn */
-		else if (opcode0 == 0xCD)
-		{
-			FOR_I_(7, cycle());
-			push(pc);
-			pc = opcode1;
-		}
-		/* CALL cc, nn */
-		else if (opcode0 == 0xC4 || opcode0 == 0xD4 || opcode0 == 0xE4 || opcode0 == 0xF4 ||
-			opcode0 == 0xCC || opcode0 == 0xDC || opcode0 == 0xEC || opcode0 == 0xFC)
-		{
-			if (isConditionTrue((opcode0 >> 3) & 0x3))
-			{
-				FOR_I_(7, cycle());
-				push(pc + 2);
-				pc = opcode1;
-			}
-		}
-		/* RET */
-		else if (opcode0 == 0xC9)
-		{
-			pc = pop();
-			FOR_I_(6, cycle());
-		}
-		/* RET cc */
-		else if (opcode0 == 0xC0 || opcode0 == 0xD0 || opcode0 == 0xE0 || opcode0 == 0xF0 ||
-			opcode0 == 0xC8 || opcode0 == 0xD8 || opcode0 == 0xE8 || opcode0 == 0xF8)
-		{
-			cycle();
-			if (isConditionTrue((opcode0 >> 3) & 0x3))
-			{
-				FOR_I_(6, cycle());
-				pc = pop();
-			}
-		}
-		/* IN A, (n) */
-		else if (opcode0 == 0xDB)
-		{
-			FOR_I_(4, cycle());
-			af.a = Machine_ReadIO(opcode1 & 0xff);
-		}
-		/* OUT (n), A */
-		else if (opcode0 == 0xD3)
-		{
-			FOR_I_(4, cycle());
-			Machine_WriteIO(opcode1 & 0xff, af.a);
-		}
-		/* INC ss */
-		else if (opcode0 == 0x03 || opcode0 == 0x13 || opcode0 == 0x23 || opcode0 == 0x33)
-		{
-			FOR_I_(2, cycle());
-			int mask = (opcode0 >> 4) & 0x3;
-			int value = getRegisterPairValueByCode(mask);
-			setRegisterPairValueByCode(mask, value + 1);
-		}
-		/* DEC ss */
-		else if (opcode0 == 0x0B || opcode0 == 0x1B || opcode0 == 0x2B || opcode0 == 0x3B)
-		{
-			FOR_I_(2, cycle());
-			int mask = (opcode0 >> 4) & 0x3;
-			int value = getRegisterPairValueByCode(mask);
-			setRegisterPairValueByCode(mask, value - 1);
-		}
-		/* RLCA */
-		else if (opcode0 == 0x07)
-		{
-			int bit7 = GET_BIT(af.a, 7);
-			bit7 != 0 ? bit7 = 1 : bit7 = 0;
-			if (bit7 == 1) { SET_BIT(af.a, 7); SET_BIT(af.f, FLAG_CARRY_POS); }
-			else { CLR_BIT(af.a, 7); CLR_BIT(af.f, FLAG_CARRY_POS); }
-			CLR_BIT(af.f, FLAG_HALFCARRY_POS);
-			CLR_BIT(af.f, FLAG_ADDSUBTRACT_POS);
-		}
-		/* RLA */
-		else if (opcode0 == 0x17)
-		{
-			int bit7 = GET_BIT(af.a, 7);
-			bit7 != 0 ? bit7 = 1 : bit7 = 0;
-			if (bit7 == 1) SET_BIT(af.f, FLAG_CARRY_POS);
-			else CLR_BIT(af.f, FLAG_CARRY_POS);
-			CLR_BIT(af.f, FLAG_HALFCARRY_POS);
-			CLR_BIT(af.f, FLAG_ADDSUBTRACT_POS);
-		}
-		/* RRCA */
-		else if (opcode0 == 0x0F)
-		{
-			int bit0 = GET_BIT(af.a, 0);
-			af.a >>= 1;
-			bit0 &= 1;
-			if (bit0 == 1) { SET_BIT(af.a, 7); SET_BIT(af.f, FLAG_CARRY_POS); }
-			else { CLR_BIT(af.a, 7); CLR_BIT(af.f, FLAG_CARRY_POS); }
-			CLR_BIT(af.f, FLAG_HALFCARRY_POS);
-			CLR_BIT(af.f, FLAG_ADDSUBTRACT_POS);
-		}
-		/* RRA */
-		else if (opcode0 == 0x1F)
-		{
-			int bit0 = GET_BIT(af.a, 0);
-			af.a >>= 1;
-			bit0 &= 1;
-			if (bit0 == 1) SET_BIT(af.f, FLAG_CARRY_POS);
-			else CLR_BIT(af.f, FLAG_CARRY_POS);
-			CLR_BIT(af.f, FLAG_HALFCARRY_POS);
-			CLR_BIT(af.f, FLAG_ADDSUBTRACT_POS);
-		}
-		/* EI */
-		else if (opcode0 == 0xFB)
-		{
-			irq_change_state = 1;
-			irq_state_change_counter = 2;
-		}
-		/* DI */
-		else if (opcode0 == 0xF3)
-		{
-			irq_change_state = 0;
-			irq_state_change_counter = 2;
-		}
-		/* RST p */
-		else if ((opcode0 & 0xC7) == 0xC7)
-		{
-			int t = (opcode0 >> 3) & 0x7;
-			pc = (t * 8);
-			cout << "RST " << hex << (t * 8) << endl;
-		}
-		else
+		/* Push current PC to stack and jump to 0038h */
+		push(pc);
+		pc = 0x0038;
+		code = memory_map->read[pc >> MEM_PAGE_SHIFT];
+		if (profiler) profiler->enter(pc, sp, PROFILER_NODE_IRQ);
+
+		/* A breakpoint on the vector stops after the entry, its cycles go to the handler */
+		if (!code && (memory_map->traps[pc >> MEM_PAGE_SHIFT] & MEM_TRAP_EXEC))
 		{
-			switch (opcode0)
+			cycles = op_cycles;
+			if (Machine_CheckBreakpoint(pc))
 			{
-				case 0x76: // halt
-					cout << "CPU has been halted until next interrupt or reset!" << endl;
-					halted = 1;
-					break;
-				default:
-					cout << "Illegal opcode @ " << hex << (pc - 1) << endl;
-					break;
+				if (irq_change_state < 0xff) irq_state_change_counter++; // counted down again on resume
+				irq_entered = true;
+				return;
 			}
+			cycles += 4;
 		}
 	}
+
+	/* Decode */
+	op_pc = pc;
+	byte prefix = 0;
+	byte opcode = code ? code[pc & MEM_PAGE_MASK] : Machine_ReadMem(pc);
+	pc++;
+	const OpcodeEntry* entry = &opcode_table[OPCODE_PAGE_MAIN][opcode];
+	if (entry->next_page != OPCODE_PAGE_MAIN)
+	{
+		prefix = opcode;
+		opcode = fetch(pc++);
+		entry = &opcode_table[entry->next_page][opcode];
+	}
+
+	/* Instruction operand fetching */
+	dword operand = 0;
+	if (entry->operand_length == 1)
+	{
+		operand = fetch(pc++);
+	}
+	else if (entry->operand_length == 2)
+	{
+		operand = fetch(pc++);
+		operand |= (fetch(pc++) << 8);
+	}
+	if (coverage) coverage->markExecuted(op_pc, (dword)(pc - op_pc));
+
+	/* Execute (the first 4 cycles have already been spent above) */
+	stats.instructions++;
+	stats.fetches[op_pc >> MEM_PAGE_SHIFT]++;
+	stats.classes[entry->op_class]++;
+	cycles += entry->cycles - 4;
+	(this->*entry->handler)(opcode, operand);
+	if (profiler) profiler->count(op_pc, (unsigned int)(cycles - op_cycles));
+	if (tracer)
+	{
+		traceInstruction(prefix, opcode, operand, entry->operand_length, irq_taken || irq_entered);
+		irq_entered = false;
+	}
+}
+
+void CPU::traceInstruction(byte prefix, byte opcode, dword operand, int operand_length, bool irq_taken)
+{
+	byte bytes[4];
+	int length = 0;
+	if (prefix) bytes[length++] = prefix;
+	bytes[length++] = opcode;
+	for (int i = 0; i < operand_length; i++)
+		bytes[length++] = (operand >> (i * 8)) & 0xff;
+
+	dword regs[TRACE_REG_COUNT] = { af.af, bc.bc, de.de, hl.hl, sp };
+	tracer->record(op_pc, bytes, length, regs, cycles, irq_taken);
+}
+
+/************************
+ * Instruction handlers *
+ ************************/
+
+void CPU::opNop(byte opcode, dword operand)
+{
+}
+
+void CPU::opIllegal(byte opcode, dword operand)
+{
+	cout << "Illegal opcode @ " << hex << op_pc << dec << endl;
+	if (tracer) tracer->requestDump(TRACE_DUMP_ILLEGAL);
+}
+
+void CPU::opUnimplemented(byte opcode, dword operand)
+{
+	// prefixed instructions without implementation are skipped silently
+}
+
+/* LD r, r' */
+void CPU::opLdRR(byte opcode, dword operand)
+{
+	setRegisterValueByCode((opcode >> 3) & 0x7, getRegisterValueByCode(opcode & 0x7));
+}
+
+/* LD r, n */
+void CPU::opLdRN(byte opcode, dword operand)
+{
+	setRegisterValueByCode((opcode >> 3) & 0x7, operand);
+}
+
+/* LD r, (HL) */
+void CPU::opLdRHL(byte opcode, dword operand)
+{
+	setRegisterValueByCode((opcode >> 3) & 0x7, readMem(hl.hl));
+}
+
+/* LD (HL), r */
+void CPU::opLdHLR(byte opcode, dword operand)
+{
+	writeMem(hl.hl, getRegisterValueByCode(opcode & 0x07));
+}
+
+/* LD (HL), n */
+void CPU::opLdHLN(byte opcode, dword operand)
+{
+	writeMem(hl.hl, operand & 0xff);
+}
+
+/* LD A, (BC) */
+void CPU::opLdABC(byte opcode, dword operand)
+{
+	af.a = readMem(bc.bc);
+}
+
+/* LD A, (DE) */
+void CPU::opLdADE(byte opcode, dword operand)
+{
+	af.a = readMem(de.de);
+}
+
+/* LD A, (nn) */
+void CPU::opLdANN(byte opcode, dword operand)
+{
+	af.a = readMem(operand);
+}
+
+/* LD (BC), A */
+void CPU::opLdBCA(byte opcode, dword operand)
+{
+	writeMem(bc.bc, af.a);
+}
+
+/* LD (DE), A */
+void CPU::opLdDEA(byte opcode, dword operand)
+{
+	writeMem(de.de, af.a);
+}
+
+/* LD (nn), A */
+void CPU::opLdNNA(byte opcode, dword operand)
+{
+	writeMem(operand, af.a);
+}
+
+/* LD dd, nn */
+void CPU::opLdDDNN(byte opcode, dword operand)
+{
+	setRegisterPairValueByCode((opcode >> 4) & 0x3, operand);
+}
+
+/* LD HL, (nn) */
+void CPU::opLdHLNN(byte opcode, dword operand)
+{
+	hl.h = readMem(operand + 1);
+	hl.l = readMem(operand);
+}
+
+/* LD (nn), HL */
+void CPU::opLdNNHL(byte opcode, dword operand)
+{
+	writeMem(operand + 1, hl.h);
+	writeMem(operand, hl.l);
+}
+
+/* LD SP, HL */
+void CPU::opLdSPHL(byte opcode, dword operand)
+{
+	sp = hl.hl;
+}
+
+/* PUSH qq */
+void CPU::opPush(byte opcode, dword operand)
+{
+	unsigned int pair;
+	if (((opcode >> 4) & 0x3) != 3) pair = getRegisterPairValueByCode((opcode >> 4) & 0x3);
+	else pair = af.af;
+	push(pair);
+}
+
+/* POP qq */
+void CPU::opPop(byte opcode, dword operand)
+{
+	int value = pop();
+	if (((opcode >> 4) & 0x3) != 3) setRegisterPairValueByCode((opcode >> 4) & 0x3, value);
+	else af.af = value;
+}
+
+/* ADD A, r */
+void CPU::opAddR(byte opcode, dword operand)
+{
+	unsigned int old = (unsigned int)af.a;
+	af.a += getRegisterValueByCode(opcode & 0x7);
+	if (af.a < old) SET_BIT(af.f, FLAG_CARRY_POS);
+	updateFlags(af.a);
+}
+
+/* ADD A, n */
+void CPU::opAddN(byte opcode, dword operand)
+{
+	unsigned int old = (unsigned int)af.a;
+	af.a += operand & 0xff;
+	if (af.a < old) SET_BIT(af.f, FLAG_CARRY_POS);
+	updateFlags(af.a);
+}
+
+/* ADD A, (HL) */
+void CPU::opAddHL(byte opcode, dword operand)
+{
+	unsigned int old = (unsigned int)af.a;
+	af.a += readMem(hl.hl);
+	if (af.a < old) SET_BIT(af.f, FLAG_CARRY_POS);
+	updateFlags(af.a);
+}
+
+/* SUB A, r */
+void CPU::opSubR(byte opcode, dword operand)
+{
+	af.a -= getRegisterValueByCode(opcode & 0x7);
+	updateFlags(af.a);
+}
+
+/* SUB A, n */
+void CPU::opSubN(byte opcode, dword operand)
+{
+	af.a -= operand & 0xff;
+	updateFlags(af.a);
+}
+
+/* SUB A, (HL) */
+void CPU::opSubHL(byte opcode, dword operand)
+{
+	af.a -= readMem(hl.hl);
+	updateFlags(af.a);
+}
+
+/* AND A, r */
+void CPU::opAndR(byte opcode, dword operand)
+{
+	af.a &= getRegisterValueByCode(opcode & 0x7);
+	updateFlags2(af.a);
+}
+
+/* AND A, n */
+void CPU::opAndN(byte opcode, dword operand)
+{
+	af.a &= operand & 0xff;
+	updateFlags2(af.a);
+}
+
+/* AND A, (HL) */
+void CPU::opAndHL(byte opcode, dword operand)
+{
+	af.a &= readMem(hl.hl);
+	updateFlags2(af.a);
+}
+
+/* OR A, r */
+void CPU::opOrR(byte opcode, dword operand)
+{
+	af.a |= getRegisterValueByCode(opcode & 0x7);
+	updateFlags2(af.a);
+}
+
+/* OR A, n */
+void CPU::opOrN(byte opcode, dword operand)
+{
+	af.a |= operand & 0xff;
+	updateFlags2(af.a);
+}
+
+/* OR A, (HL) */
+void CPU::opOrHL(byte opcode, dword operand)
+{
+	af.a |= readMem(hl.hl);
+	updateFlags2(af.a);
+}
+
+/* XOR A, r */
+void CPU::opXorR(byte opcode, dword operand)
+{
+	af.a ^= getRegisterValueByCode(opcode & 0x7);
+	updateFlags2(af.a);
+}
+
+/* XOR A, n */
+void CPU::opXorN(byte opcode, dword operand)
+{
+	af.a ^= operand & 0xff;
+	updateFlags2(af.a);
+}
+
+/* XOR A, (HL) */
+void CPU::opXorHL(byte opcode, dword operand)
+{
+	af.a ^= readMem(hl.hl);
+	updateFlags2(af.a);
+}
+
+/* JP nn */
+void CPU::opJp(byte opcode, dword operand)
+{
+	jump(operand);
+}
+
+/* JP cc, nn */
+void CPU::opJpCC(byte opcode, dword operand)
+{
+	if (isConditionTrue((opcode >> 3) & 0x7)) jump(operand);
+}
+
+/* JP (HL) */
+void CPU::opJpHL(byte opcode, dword operand)
+{
+	pc = hl.hl;
+}
+
+/* CALL nn */
+void CPU::opCall(byte opcode, dword operand)
+{
+	push(pc);
+	pc = operand;
+	if (profiler) profiler->enter(pc, sp, PROFILER_NODE_CALL);
+}
+
+/* CALL cc, nn */
+void CPU::opCallCC(byte opcode, dword operand)
+{
+	if (isConditionTrue((opcode >> 3) & 0x7))
+	{
+		cycles += 7;
+		push(pc);
+		pc = operand;
+		if (profiler) profiler->enter(pc, sp, PROFILER_NODE_CALL);
+	}
+}
+
+/* RET */
+void CPU::opRet(byte opcode, dword operand)
+{
+	pc = pop();
+	if (profiler) profiler->leave(sp);
+}
+
+/* RET cc */
+void CPU::opRetCC(byte opcode, dword operand)
+{
+	if (isConditionTrue((opcode >> 3) & 0x7))
+	{
+		cycles += 6;
+		pc = pop();
+		if (profiler) profiler->leave(sp);
+	}
+}
+
+/* IN A, (n) */
+void CPU::opIn(byte opcode, dword operand)
+{
+	af.a = Machine_ReadIO(operand & 0xff);
+}
+
+/* OUT (n), A */
+void CPU::opOut(byte opcode, dword operand)
+{
+	Machine_WriteIO(operand & 0xff, af.a);
+}
+
+/* INC ss */
+void CPU::opIncSS(byte opcode, dword operand)
+{
+	int mask = (opcode >> 4) & 0x3;
+	int value = getRegisterPairValueByCode(mask);
+	setRegisterPairValueByCode(mask, value + 1);
+}
+
+/* DEC ss */
+void CPU::opDecSS(byte opcode, dword operand)
+{
+	int mask = (opcode >> 4) & 0x3;
+	int value = getRegisterPairValueByCode(mask);
+	setRegisterPairValueByCode(mask, value - 1);
+}
+
+/* RLCA */
+void CPU::opRlca(byte opcode, dword operand)
+{
+	int bit7 = GET_BIT(af.a, 7);
+	bit7 != 0 ? bit7 = 1 : bit7 = 0;
+	if (bit7 == 1) { SET_BIT(af.a, 7); SET_BIT(af.f, FLAG_CARRY_POS); }
+	else { CLR_BIT(af.a, 7); CLR_BIT(af.f, FLAG_CARRY_POS); }
+	CLR_BIT(af.f, FLAG_HALFCARRY_POS);
+	CLR_BIT(af.f, FLAG_ADDSUBTRACT_POS);
+}
+
+/* RLA */
+void CPU::opRla(byte opcode, dword operand)
+{
+	int bit7 = GET_BIT(af.a, 7);
+	bit7 != 0 ? bit7 = 1 : bit7 = 0;
+	if (bit7 == 1) SET_BIT(af.f, FLAG_CARRY_POS);
+	else CLR_BIT(af.f, FLAG_CARRY_POS);
+	CLR_BIT(af.f, FLAG_HALFCARRY_POS);
+	CLR_BIT(af.f, FLAG_ADDSUBTRACT_POS);
+}
+
+/* RRCA */
+void CPU::opRrca(byte opcode, dword operand)
+{
+	int bit0 = GET_BIT(af.a, 0);
+	af.a >>= 1;
+	bit0 &= 1;
+	if (bit0 == 1) { SET_BIT(af.a, 7); SET_BIT(af.f, FLAG_CARRY_POS); }
+	else { CLR_BIT(af.a, 7); CLR_BIT(af.f, FLAG_CARRY_POS); }
+	CLR_BIT(af.f, FLAG_HALFCARRY_POS);
+	CLR_BIT(af.f, FLAG_ADDSUBTRACT_POS);
+}
+
+/* RRA */
+void CPU::opRra(byte opcode, dword operand)
+{
+	int bit0 = GET_BIT(af.a, 0);
+	af.a >>= 1;
+	bit0 &= 1;
+	if (bit0 == 1) SET_BIT(af.f, FLAG_CARRY_POS);
+	else CLR_BIT(af.f, FLAG_CARRY_POS);
+	CLR_BIT(af.f, FLAG_HALFCARRY_POS);
+	CLR_BIT(af.f, FLAG_ADDSUBTRACT_POS);
+}
+
+/* EI */
+void CPU::opEi(byte opcode, dword operand)
+{
+	irq_change_state = 1;
+	irq_state_change_counter = 2;
+}
+
+/* DI */
+void CPU::opDi(byte opcode, dword operand)
+{
+	irq_change_state = 0;
+	irq_state_change_counter = 2;
+}
+
+/* RST p */
+void CPU::opRst(byte opcode, dword operand)
+{
+	int t = (opcode >> 3) & 0x7;
+	pc = (t * 8);
+	if (profiler) profiler->enter(pc, sp, PROFILER_NODE_CALL); // no return address is pushed, RET leaves the caller as well
+	cout << "RST " << hex << (t * 8) << endl;
+}
+
+/* HALT */
+void CPU::opHalt(byte opcode, dword operand)
+{
+	cout << "CPU has been halted until next interrupt or reset!" << endl;
+	halted = 1;
+	if (tracer && isIRQDisabled()) tracer->requestDump(TRACE_DUMP_HALT); // only a reset can continue
+}
+
+/* RETI */
+void CPU::opReti(byte opcode, dword operand)
+{
+	if (irq_processing)
+	{
+		cycles += 10;
+		pc = pop();
+		if (profiler) profiler->leave(sp);
+		irq = 0;
+		irq_processing = 0;
+		irq_disabled = 1;
+	}
+}
+
+/* DDS (Debug Dump State) */
+void CPU::opDds(byte opcode, dword operand)
+{
+	cout << "DDS -> printState()" << endl;
+	printState();
+	if (tracer) tracer->requestDump(TRACE_DUMP_REQUEST);
+}
+
+uint64_t CPU::skipIdle(uint64_t until)
+{
+	if (halted)
+	{
+		if ((irq && !irq_disabled) || irq_change_state < 0xff || cycles >= until)
+			return 0; // about to wake up or EI/DI pending
+
+		uint64_t steps = (until - cycles + 3) / 4; // a halted next() takes 4 cycles
+		op_cycles = cycles + (steps - 1) * 4;
+		cycles += steps * 4;
+		stats.halted_cycles += steps * 4;
+		if (profiler) profiler->addCycles(op_pc, steps * 4, true);
+		return steps * 4;
+	}
+
+	if (!idle_period) return 0;
+
+	/* Skip whole iterations, the one reaching 'until' is executed */
+	uint64_t period = idle_period;
+	idle_period = 0;
+	if (cycles >= until) return 0;
+
+	uint64_t skipped = ((until - 1 - cycles) / period) * period;
+	cycles += skipped;
+	op_cycles += skipped;
+	idle_loop.cycles = cycles;
+	stats.skipped_instructions += (skipped / period) * idle_instructions;
+	if (profiler) profiler->addCycles(op_pc, skipped, false); // attributed to the loop branch
+	return skipped;
+}
+
+void CPU::setIdleLoopDetection(bool enabled)
+{
+	idle_detection = enabled;
+	idle_period = 0;
+	idle_loop.cycles = 0;
+	idle_loop.head = idle_loop.branch = 0;
+}
+
+/*
+ * A loop is idle if one iteration ends with the same registers as the
+ * previous one, without side effects in between. Its memory and I/O reads
+ * then return the same values until the next device event, so all
+ * iterations up to that event behave the same.
+ */
+void CPU::checkIdleLoop(dword target)
+{
+	bool same = idle_loop.head == target && idle_loop.branch == op_pc
+		&& idle_loop.side_effects == side_effects && idle_loop.cycles != 0
+		&& idle_loop.af == af.af && idle_loop.bc == bc.bc && idle_loop.de == de.de
+		&& idle_loop.hl == hl.hl && idle_loop.sp == sp
+		&& irq_change_state == 0xff;
+
+	if (same)
+	{
+		idle_period = cycles - idle_loop.cycles;
+		idle_instructions = stats.instructions - idle_loop.instructions;
+		idle_loop.cycles = cycles;
+		idle_loop.instructions = stats.instructions;
+		return;
+	}
+
+	idle_loop.head = target;
+	idle_loop.branch = op_pc;
+	idle_loop.af = af.af;
+	idle_loop.bc = bc.bc;
+	idle_loop.de = de.de;
+	idle_loop.hl = hl.hl;
+	idle_loop.sp = sp;
+	idle_loop.side_effects = side_effects;
+	idle_loop.cycles = cycles;
+	idle_loop.instructions = stats.instructions;
+}
+
+const char* CPU::getOpcodeClassName(int op_class)
+{
+	static const char* names[OPCODE_CLASS_COUNT] = { "control", "load8", "load16", "alu8", "alu16", "rotate", "branch", "io", "invalid" };
+	return (op_class >= 0 && op_class < OPCODE_CLASS_COUNT) ? names[op_class] : "";
 }
 
 void CPU::triggerIRQ()
@@ -583,22 +993,17 @@ void CPU::triggerIRQ()
 
 void CPU::push(dword value)
 {
-	Machine_WriteMem(--sp, (value >> 8) & 0xff);
-	Machine_WriteMem(--sp, value & 0xff);
+	writeMem(--sp, (value >> 8) & 0xff);
+	writeMem(--sp, value & 0xff);
 }
 
 dword CPU::pop()
 {
-	unsigned int value = Machine_ReadMem(sp++);
-	value |= (Machine_ReadMem(sp++)) << 8;
+	unsigned int value = readMem(sp++);
+	value |= (readMem(sp++)) << 8;
 	return value & 0xffff;
 }
 
-void CPU::cycle()
-{
-	Machine_Cycle();
-}
-
 void CPU::updateFlags(int registerValue)
 {
 	af.f = 0;
@@ -723,14 +1128,14 @@ bool CPU::isConditionTrue(int code)
 			return !GET_BIT(af.f, FLAG_CARRY_POS);
 		case 3: // C
 			return GET_BIT(af.f, FLAG_CARRY_POS);
-		case 4: // O
+		case 4: // PO
 			return !GET_BIT(af.f, FLAG_PARITYOVERFLOW_POS);
-		case 5: // E
+		case 5: // PE
 			return GET_BIT(af.f, FLAG_PARITYOVERFLOW_POS);
-		case 6: // P
-			return GET_BIT(af.f, FLAG_SIGN_POS);
-		case 7: // N
+		case 6: // P (positive)
 			return !GET_BIT(af.f, FLAG_SIGN_POS);
+		case 7: // M (minus)
+			return GET_BIT(af.f, FLAG_SIGN_POS);
 		default:
 			return false;
 	}
@@ -18,6 +18,7 @@
 */
 
 #include <stdafx.h>
+#include "memory.h"
 
 #define REG_CODE_A 7
 #define REG_CODE_B 0
@@ -39,6 +40,84 @@
 #define FLAG_ADDSUBTRACT_POS 1
 #define FLAG_CARRY_POS 0
 
+/* Opcode table pages (one per prefix byte) */
+#define OPCODE_PAGE_MAIN 0
+#define OPCODE_PAGE_CB 1
+#define OPCODE_PAGE_DD 2
+#define OPCODE_PAGE_ED 3
+#define OPCODE_PAGE_FD 4
+#define OPCODE_PAGE_COUNT 5
+
+/* Opcode classes counted by the statistics */
+#define OPCODE_CLASS_CONTROL 0		// NOP, HALT, EI, DI
+#define OPCODE_CLASS_LOAD8 1
+#define OPCODE_CLASS_LOAD16 2		// including PUSH and POP
+#define OPCODE_CLASS_ALU8 3
+#define OPCODE_CLASS_ALU16 4
+#define OPCODE_CLASS_ROTATE 5
+#define OPCODE_CLASS_BRANCH 6		// jumps, calls, returns (including RETI) and restarts
+#define OPCODE_CLASS_IO 7
+#define OPCODE_CLASS_INVALID 8		// illegal or unimplemented opcodes
+#define OPCODE_CLASS_COUNT 9
+
+class CPU;
+class Profiler;
+class Tracer;
+class Coverage;
+class StateWriter;
+class StateReader;
+
+/**
+ * Executes a decoded instruction. 'operand' holds the
+ * immediate bytes (little endian) fetched after the opcode.
+ */
+typedef void (CPU::*OpcodeHandler)(byte opcode, dword operand);
+
+/**
+ * Describes a group of opcodes, every opcode of page 'page'
+ * with (opcode & mask) == match is executed by 'handler'.
+ * The first matching description wins.
+ */
+struct OpcodeDescription
+{
+	byte page;
+	byte mask;
+	byte match;
+	byte operand_length; // number of immediate bytes (0 - 2)
+	byte cycles; // T-states taken regardless of the outcome
+	byte op_class; // OPCODE_CLASS_*
+	OpcodeHandler handler;
+	const char* mnemonic;
+};
+
+/**
+ * Decoded entry of an opcode table page
+ */
+struct OpcodeEntry
+{
+	OpcodeHandler handler;
+	byte operand_length;
+	byte cycles;
+	byte next_page; // != OPCODE_PAGE_MAIN for prefix bytes
+	byte op_class;
+	const char* mnemonic;
+};
+
+/**
+ * Execution counters of the CPU, always maintained (plain increments)
+ */
+struct CPUStats
+{
+	uint64_t instructions; // executed instructions (a prefixed instruction counts once)
+	uint64_t skipped_instructions; // instructions of skipped idle loop iterations
+	uint64_t classes[OPCODE_CLASS_COUNT]; // executed instructions by OPCODE_CLASS_*
+	uint64_t halted_cycles;
+	uint64_t irqs; // interrupts taken
+	uint64_t fetches[MEM_PAGE_COUNT]; // executed instructions by page of their address
+	uint64_t reads[MEM_PAGE_COUNT]; // data reads by page (instruction bytes are counted once in 'fetches')
+	uint64_t writes[MEM_PAGE_COUNT];
+};
+
 class CPU
 {
 public:
@@ -46,6 +125,44 @@ public:
 
 	void printState();
 
+	/**
+	 * Writes the register file as a JSON object
+	 */
+	void writeState(ostream& out);
+
+	/**
+	 * Appends the registers and the interrupt state to 'state'
+	 */
+	void saveState(StateWriter& state);
+
+	/**
+	 * Restores the registers and the interrupt state, returns -1 on errors
+	 */
+	int loadState(StateReader& state);
+
+	inline dword getPC()
+	{
+		return pc;
+	}
+
+	inline dword getSP()
+	{
+		return sp;
+	}
+
+	inline bool isHalted()
+	{
+		return halted != 0;
+	}
+
+	/**
+	 * Returns true if IRQs are disabled and stay disabled (no EI pending)
+	 */
+	inline bool isIRQDisabled()
+	{
+		return irq_disabled != 0 && irq_change_state != 1;
+	}
+
 	void reset();
 
 	/**
@@ -54,18 +171,170 @@ public:
 	void next();
 
 	/**
-     * Cycle for one clock period (1/f)
-     */
-	void cycle();
+	 * True if the CPU is halted or spinning in a loop without side effects
+	 */
+	inline bool isIdle()
+	{
+		return halted || idle_period;
+	}
+
+	/**
+	 * Advances an idle CPU up to cycle 'until' as if next() had been
+	 * called repeatedly, returns the number of skipped cycles
+	 */
+	uint64_t skipIdle(uint64_t until);
+
+	/**
+	 * Marks that machine state visible to the program may have changed
+	 * (device events, I/O writes), so loops have to be verified again
+	 */
+	inline void noteSideEffect()
+	{
+		side_effects++;
+	}
+
+	void setIdleLoopDetection(bool enabled);
+
+	inline const CPUStats& getStats()
+	{
+		return stats;
+	}
+
+	static const char* getOpcodeClassName(int op_class);
+
+	/**
+	 * Reports every instruction, call and return to 'profiler' (NULL = off)
+	 */
+	void setProfiler(Profiler* profiler);
+
+	/**
+	 * Records every instruction into 'tracer' (NULL = off)
+	 */
+	void setTracer(Tracer* tracer);
+
+	/**
+	 * Marks executed, read and written bytes in 'coverage' (NULL = off)
+	 */
+	void setCoverage(Coverage* coverage);
+
+	/**
+	 * Number of clock periods (1/f) spent since reset
+	 */
+	inline uint64_t getCycles()
+	{
+		return cycles;
+	}
+
+	/**
+	 * Cycle count at the start of the instruction being executed
+	 */
+	inline uint64_t getInstructionCycles()
+	{
+		return op_cycles;
+	}
+
+	/**
+	 * Address of the instruction being executed
+	 */
+	inline dword getInstructionPC()
+	{
+		return op_pc;
+	}
 
 	/**
 	 * Request maskable interrupt (IRQ)
 	 */
 	void triggerIRQ();
 
+	/**
+	 * Sets the page table used for memory accesses
+	 */
+	void setMemoryMap(MemoryMap* memory_map);
+
 	~CPU();
 
 private:
+	static void buildOpcodeTables();
+
+	/**
+	 * Sets the PC to 'target', short backward jumps are checked for idle loops
+	 */
+	inline void jump(dword target);
+
+	void checkIdleLoop(dword target);
+
+	/**
+	 * Passes the executed instruction and the resulting registers to the tracer
+	 */
+	void traceInstruction(byte prefix, byte opcode, dword operand, int operand_length, bool irq_taken);
+
+	/* Instruction handlers */
+	void opNop(byte opcode, dword operand);
+	void opIllegal(byte opcode, dword operand);
+	void opUnimplemented(byte opcode, dword operand);
+	void opLdRR(byte opcode, dword operand);
+	void opLdRN(byte opcode, dword operand);
+	void opLdRHL(byte opcode, dword operand);
+	void opLdHLR(byte opcode, dword operand);
+	void opLdHLN(byte opcode, dword operand);
+	void opLdABC(byte opcode, dword operand);
+	void opLdADE(byte opcode, dword operand);
+	void opLdANN(byte opcode, dword operand);
+	void opLdBCA(byte opcode, dword operand);
+	void opLdDEA(byte opcode, dword operand);
+	void opLdNNA(byte opcode, dword operand);
+	void opLdDDNN(byte opcode, dword operand);
+	void opLdHLNN(byte opcode, dword operand);
+	void opLdNNHL(byte opcode, dword operand);
+	void opLdSPHL(byte opcode, dword operand);
+	void opPush(byte opcode, dword operand);
+	void opPop(byte opcode, dword operand);
+	void opAddR(byte opcode, dword operand);
+	void opAddN(byte opcode, dword operand);
+	void opAddHL(byte opcode, dword operand);
+	void opSubR(byte opcode, dword operand);
+	void opSubN(byte opcode, dword operand);
+	void opSubHL(byte opcode, dword operand);
+	void opAndR(byte opcode, dword operand);
+	void opAndN(byte opcode, dword operand);
+	void opAndHL(byte opcode, dword operand);
+	void opOrR(byte opcode, dword operand);
+	void opOrN(byte opcode, dword operand);
+	void opOrHL(byte opcode, dword operand);
+	void opXorR(byte opcode, dword operand);
+	void opXorN(byte opcode, dword operand);
+	void opXorHL(byte opcode, dword operand);
+	void opJp(byte opcode, dword operand);
+	void opJpCC(byte opcode, dword operand);
+	void opJpHL(byte opcode, dword operand);
+	void opCall(byte opcode, dword operand);
+	void opCallCC(byte opcode, dword operand);
+	void opRet(byte opcode, dword operand);
+	void opRetCC(byte opcode, dword operand);
+	void opIn(byte opcode, dword operand);
+	void opOut(byte opcode, dword operand);
+	void opIncSS(byte opcode, dword operand);
+	void opDecSS(byte opcode, dword operand);
+	void opRlca(byte opcode, dword operand);
+	void opRla(byte opcode, dword operand);
+	void opRrca(byte opcode, dword operand);
+	void opRra(byte opcode, dword operand);
+	void opEi(byte opcode, dword operand);
+	void opDi(byte opcode, dword operand);
+	void opRst(byte opcode, dword operand);
+	void opHalt(byte opcode, dword operand);
+	void opReti(byte opcode, dword operand);
+	void opDds(byte opcode, dword operand);
+
+	/**
+	 * Reads an instruction byte, unlike readMem() the access is not counted
+	 */
+	byte fetch(dword address);
+
+	byte readMem(dword address);
+
+	void writeMem(dword address, byte value);
+
 	void push(dword value);
 
 	dword pop();
@@ -141,10 +410,38 @@ private:
 
 	dword pc;
 	dword sp;
+	dword op_pc; // address of the instruction being executed
+	uint64_t cycles;
+	uint64_t op_cycles;
 	byte irq;
 	byte irq_processing;
 	byte irq_state_change_counter;
 	byte irq_change_state;
 	byte irq_disabled;
 	int halted;
+	bool irq_entered; // stopped at a breakpoint on the vector after taking an IRQ
+
+	/* Idle loop detection */
+	bool idle_detection;
+	uint64_t side_effects; // memory writes changing a value, I/O writes, device events
+	uint64_t idle_period; // cycles per iteration of a detected idle loop, 0 = none
+	uint64_t idle_instructions; // instructions per iteration of the idle loop
+	struct
+	{
+		dword head, branch;
+		dword af, bc, de, hl, sp;
+		uint64_t side_effects;
+		uint64_t cycles;
+		uint64_t instructions;
+	} idle_loop; // state at the last backward jump
+
+	MemoryMap* memory_map;
+	CPUStats stats;
+	Profiler* profiler;
+	Tracer* tracer;
+	Coverage* coverage;
+
+	static const OpcodeDescription opcode_descriptions[];
+	static OpcodeEntry opcode_table[OPCODE_PAGE_COUNT][256];
+	static bool opcode_tables_built;
 };
@@ -0,0 +1,293 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "debugger.h"
+#include <sstream>
+
+Debugger::Debugger()
+{
+	memset(io_traps, 0, sizeof(io_traps));
+	reader = NULL;
+	lock = NULL;
+	channel_closed = false;
+}
+
+static bool parseNumber(const string& str, int* value)
+{
+	char* end;
+	long number;
+	if (str.empty()) return false;
+	if (str[0] == '$') number = strtol(str.c_str() + 1, &end, 16);
+	else number = strtol(str.c_str(), &end, 0);
+	if (*end != 0 || number < 0 || number > 0xffff) return false;
+	*value = (int)number;
+	return true;
+}
+
+bool Debugger::parseRange(const string& arg, SymbolTable& symbols, int* first, int* last)
+{
+	size_t dash = arg.find('-', 1);
+	string parts[2] = { arg.substr(0, dash), dash == string::npos ? arg : arg.substr(dash + 1) };
+	int values[2];
+	for (int i = 0; i < 2; i++)
+	{
+		if (parseNumber(parts[i], &values[i])) continue;
+		values[i] = symbols.findAddress(parts[i]);
+		if (values[i] < 0)
+		{
+			cerr << "Unknown address '" << parts[i] << "'" << endl;
+			return false;
+		}
+	}
+	if (values[1] < values[0])
+	{
+		cerr << "Invalid range '" << arg << "'" << endl;
+		return false;
+	}
+	*first = values[0];
+	*last = values[1];
+	return true;
+}
+
+bool Debugger::parseAccess(const string& arg, byte fallback, byte* access)
+{
+	if (arg.empty()) *access = fallback;
+	else if (arg == "r") *access = MEM_TRAP_READ;
+	else if (arg == "w") *access = MEM_TRAP_WRITE;
+	else if (arg == "rw") *access = MEM_TRAP_READ | MEM_TRAP_WRITE;
+	else
+	{
+		cerr << "Invalid access '" << arg << "' (r, w or rw)" << endl;
+		return false;
+	}
+	return true;
+}
+
+int Debugger::execute(const string& line, SymbolTable& symbols)
+{
+	istringstream words(line);
+	string command, arg, mode, extra;
+	words >> command >> arg >> mode >> extra;
+	if (command.empty() || command[0] == '#') return DEBUG_NONE;
+
+	int first, last;
+	byte access;
+	if ((command == "break" || command == "b") && !arg.empty() && mode.empty())
+	{
+		if (!parseRange(arg, symbols, &first, &last)) return DEBUG_ERROR;
+		breakpoints.insert((dword)first);
+		cout << "Breakpoint at " << symbols.describe((dword)first) << endl;
+		return DEBUG_TRAPS;
+	}
+	if ((command == "delete" || command == "d") && !arg.empty() && mode.empty())
+	{
+		if (!parseRange(arg, symbols, &first, &last)) return DEBUG_ERROR;
+		if (!breakpoints.erase((dword)first)) cerr << "No breakpoint at " << symbols.describe((dword)first) << endl;
+		return DEBUG_TRAPS;
+	}
+	if ((command == "watch" || command == "w") && !arg.empty() && extra.empty())
+	{
+		if (!parseRange(arg, symbols, &first, &last) || !parseAccess(mode, MEM_TRAP_WRITE, &access)) return DEBUG_ERROR;
+		Watch watch = { (dword)first, (dword)last, access };
+		watches.push_back(watch);
+		return DEBUG_TRAPS;
+	}
+	if (command == "unwatch" && !arg.empty() && mode.empty())
+	{
+		if (!parseRange(arg, symbols, &first, &last)) return DEBUG_ERROR;
+		for (unsigned int i = 0; i < watches.size();) // every watchpoint overlapping the range
+		{
+			if (watches[i].first <= last && watches[i].last >= first) watches.erase(watches.begin() + i);
+			else i++;
+		}
+		return DEBUG_TRAPS;
+	}
+	if ((command == "watch-io" || command == "unwatch-io") && !arg.empty() && extra.empty())
+	{
+		if (!parseNumber(arg, &first) || first > 0xff)
+		{
+			cerr << "Invalid port '" << arg << "'" << endl;
+			return DEBUG_ERROR;
+		}
+		if (command == "unwatch-io") io_traps[first] = 0;
+		else if (parseAccess(mode, MEM_TRAP_WRITE, &access)) io_traps[first] |= access;
+		else return DEBUG_ERROR;
+		return DEBUG_NONE; // ports are checked on every access, there is no page to mark
+	}
+	if (arg.empty()) // the remaining commands take no arguments
+	{
+		if (command == "list" || command == "l")
+		{
+			list(symbols);
+			return DEBUG_NONE;
+		}
+		if (command == "help" || command == "h")
+		{
+			printHelp();
+			return DEBUG_NONE;
+		}
+		if (command == "continue" || command == "c") return DEBUG_CONTINUE;
+		if (command == "step" || command == "s") return DEBUG_STEP;
+		if (command == "pause" || command == "p") return DEBUG_PAUSE;
+		if (command == "regs" || command == "r") return DEBUG_REGS;
+		if (command == "quit" || command == "q") return DEBUG_QUIT;
+	}
+
+	cerr << "Invalid command '" << line << "'" << endl;
+	printHelp();
+	return DEBUG_ERROR;
+}
+
+bool Debugger::isBreakpoint(dword address)
+{
+	return breakpoints.count(address) != 0;
+}
+
+bool Debugger::isWatched(dword address, byte access)
+{
+	for (unsigned int i = 0; i < watches.size(); i++)
+	{
+		if ((watches[i].access & access) && address >= watches[i].first && address <= watches[i].last) return true;
+	}
+	return false;
+}
+
+void Debugger::getPageTraps(byte* traps)
+{
+	memset(traps, 0, MEM_PAGE_COUNT);
+	for (set<dword>::iterator it = breakpoints.begin(); it != breakpoints.end(); ++it)
+		traps[*it >> MEM_PAGE_SHIFT] |= MEM_TRAP_EXEC;
+	for (unsigned int i = 0; i < watches.size(); i++)
+	{
+		for (int page = watches[i].first >> MEM_PAGE_SHIFT; page <= (watches[i].last >> MEM_PAGE_SHIFT); page++)
+			traps[page] |= watches[i].access;
+	}
+}
+
+void Debugger::list(SymbolTable& symbols)
+{
+	for (set<dword>::iterator it = breakpoints.begin(); it != breakpoints.end(); ++it)
+		cout << "break " << symbols.describe(*it) << endl;
+	for (unsigned int i = 0; i < watches.size(); i++)
+	{
+		const char* access = (watches[i].access == MEM_TRAP_READ) ? "r" : (watches[i].access == MEM_TRAP_WRITE) ? "w" : "rw";
+		cout << "watch " << symbols.describe(watches[i].first) << "-" << symbols.describe(watches[i].last) << " " << access << endl;
+	}
+	for (int port = 0; port < 256; port++)
+	{
+		if (!io_traps[port]) continue;
+		const char* access = (io_traps[port] == MEM_TRAP_READ) ? "r" : (io_traps[port] == MEM_TRAP_WRITE) ? "w" : "rw";
+		cout << "watch-io " << dec << port << " " << access << endl;
+	}
+}
+
+int Debugger::openChannel()
+{
+	lock = SDL_CreateMutex();
+	if (lock) reader = SDL_CreateThread(readerMain, "Commands", this);
+	if (!reader)
+	{
+		cerr << "Unable to read commands from stdin: " << SDL_GetError() << endl;
+		return -1;
+	}
+	return 0;
+}
+
+int Debugger::readerMain(void* data)
+{
+	Debugger* debugger = (Debugger*)data;
+	string line;
+	while (getline(cin, line))
+	{
+		SDL_LockMutex(debugger->lock);
+		debugger->commands.push_back(line);
+		SDL_UnlockMutex(debugger->lock);
+	}
+
+	SDL_LockMutex(debugger->lock);
+	debugger->channel_closed = true;
+	SDL_UnlockMutex(debugger->lock);
+	return 0;
+}
+
+bool Debugger::isChannelOpen()
+{
+	if (!reader) return false;
+	SDL_LockMutex(lock);
+	bool open = !channel_closed || !commands.empty();
+	SDL_UnlockMutex(lock);
+	return open;
+}
+
+static string getCommandName(const string& line)
+{
+	string command;
+	istringstream(line) >> command;
+	return command;
+}
+
+bool Debugger::pollCommand(string* line, bool paused)
+{
+	if (!reader) return false;
+	SDL_LockMutex(lock);
+	deque<string>::iterator next = commands.begin();
+	if (next != commands.end() && !paused)
+	{
+		/* Commands inspecting a stopped CPU wait, pause and quit may overtake them */
+		string command = getCommandName(*next);
+		if (command == "step" || command == "s" || command == "regs" || command == "r")
+		{
+			for (next++; next != commands.end(); next++)
+			{
+				command = getCommandName(*next);
+				if (command == "pause" || command == "p" || command == "quit" || command == "q") break;
+			}
+		}
+	}
+	bool available = next != commands.end();
+	if (available)
+	{
+		*line = *next;
+		commands.erase(next);
+	}
+	SDL_UnlockMutex(lock);
+	return available;
+}
+
+void Debugger::printHelp()
+{
+	cout << "Commands (addresses may be numbers or symbols):" << endl;
+	cout << "  break <addr>                stop before executing addr" << endl;
+	cout << "  delete <addr>               remove the breakpoint at addr" << endl;
+	cout << "  watch <addr>[-<addr>] [r|w|rw] stop after an access to the range (default: w)" << endl;
+	cout << "  unwatch <addr>[-<addr>]     remove the watchpoints overlapping the range" << endl;
+	cout << "  watch-io <port> [r|w|rw]    stop after an access to the I/O port (default: w)" << endl;
+	cout << "  unwatch-io <port>           remove the watchpoint of the I/O port" << endl;
+	cout << "  list                        show breakpoints and watchpoints" << endl;
+	cout << "  continue, step, pause       resume, execute one instruction, stop" << endl;
+	cout << "  regs                        print the registers" << endl;
+	cout << "  quit                        stop the emulator" << endl;
+}
+
+Debugger::~Debugger()
+{
+	/* The reader may be blocked on stdin, so it is left to exit with the process */
+	if (reader) SDL_DetachThread(reader);
+	else if (lock) SDL_DestroyMutex(lock);
+}
@@ -0,0 +1,132 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include <stdafx.h>
+#include <SDL2/SDL.h>
+#include <deque>
+#include <set>
+#include <vector>
+#include "memory.h"
+#include "symbols.h"
+
+/* Results of Debugger::execute() for the machine to carry out */
+#define DEBUG_ERROR -1		// invalid command (usage has been printed)
+#define DEBUG_NONE 0		// nothing to do
+#define DEBUG_TRAPS 1		// breakpoints or watchpoints changed, the page traps have to be updated
+#define DEBUG_CONTINUE 2	// resume execution
+#define DEBUG_STEP 3		// execute one instruction
+#define DEBUG_PAUSE 4		// stop execution and wait for commands
+#define DEBUG_REGS 5		// print the registers
+#define DEBUG_QUIT 6		// stop the emulator
+
+/**
+ * Breakpoints on PC and watchpoints on memory ranges and I/O ports.
+ * The machine turns them into page traps (MEM_TRAP_*), so only accesses
+ * to marked pages reach the checks here.
+ */
+class Debugger
+{
+public:
+	Debugger();
+
+	/**
+	 * Executes one command, see printHelp(). Returns one of DEBUG_*.
+	 */
+	int execute(const string& line, SymbolTable& symbols);
+
+	/**
+	 * True for a breakpoint at 'address'
+	 */
+	bool isBreakpoint(dword address);
+
+	/**
+	 * True if 'access' (MEM_TRAP_READ/WRITE) of 'address' is watched
+	 */
+	bool isWatched(dword address, byte access);
+
+	/**
+	 * True if 'access' (MEM_TRAP_READ/WRITE) of I/O port 'port' is watched
+	 */
+	inline bool isWatchedIO(dword port, byte access)
+	{
+		return (io_traps[port & 0xff] & access) != 0;
+	}
+
+	/**
+	 * Fills 'traps' with the MEM_TRAP_* flags of every page
+	 */
+	void getPageTraps(byte* traps);
+
+	/**
+	 * Reads commands from stdin on a separate thread
+	 */
+	int openChannel();
+
+	/**
+	 * True while the command channel can deliver commands
+	 */
+	bool isChannelOpen();
+
+	/**
+	 * Fetches the next command received on the channel, returns false if there
+	 * is none. While running ('paused' = false) step and regs wait until
+	 * execution pauses, commands behind them as well, except pause and quit.
+	 */
+	bool pollCommand(string* line, bool paused);
+
+	static void printHelp();
+
+	~Debugger();
+
+private:
+	struct Watch
+	{
+		dword first, last;
+		byte access; // MEM_TRAP_READ/WRITE
+	};
+
+	/**
+	 * Parses an address, a symbol name or a range 'first-last'. Returns false on errors.
+	 */
+	bool parseRange(const string& arg, SymbolTable& symbols, int* first, int* last);
+
+	/**
+	 * Parses r, w or rw (default: 'fallback')
+	 */
+	bool parseAccess(const string& arg, byte fallback, byte* access);
+
+	void list(SymbolTable& symbols);
+
+	static int readerMain(void* data);
+
+	set<dword> breakpoints;
+	vector<Watch> watches;
+	byte io_traps[256];
+
+	/* Command channel */
+	SDL_Thread* reader;
+	SDL_mutex* lock;
+	deque<string> commands;
+	bool channel_closed; // stdin reached its end
+};
+
+#endif // DEBUGGER_H
@@ -25,11 +25,45 @@ Machine::Machine()
 	instance = this;
 	clock_frequency = CLOCK_FREQUENCY;
 	running = 1;
-	cycle_spec.tv_sec = 0;
-	cycle_spec.tv_nsec = 1 / (GetClockFrequency() / 1000000) * 1000;
-	t0_kcycles_counted = 0;
+	exit_reason = EXIT_REASON_QUIT;
+	check_stop = false;
+	start_ticks = 0;
+	start_counter = 0;
+	start_cycles = 0;
+	slice_done = false;
+	idle_cycles = 0;
+	loop_cycles = 0;
+	next_input_ticks = 0;
+	next_frame_ticks = 0;
+	frame_interval = 0;
+#ifdef NO_CYCLING
+	speed = 0;
+#else
+	speed = 1;
+#endif
+	t0_start = 0;
+	t0_kcycles = 0;
 	t0_ctrl = 0;
 	cpu = NULL; // avoid segmentation fault when trying to delete CPU
+	sgpu = NULL;
+	profiler = NULL;
+	tracer = NULL;
+	coverage = NULL;
+	debugger = NULL;
+	paused = false;
+	breakpoints_suspended = false;
+	memset(memory_map.traps, 0, sizeof(memory_map.traps));
+	capture_frame = NULL;
+	next_capture = 0;
+	timer0_irqs = 0;
+	memset(&last_status, 0, sizeof(last_status));
+	next_status_ticks = 0;
+	bootrom = NULL;
+	bootrom_size = 0;
+	bootrom_page = 0;
+	rom = NULL;
+	rom_size = 0;
+	rom_page = 0;
 }
 
 void Machine::setRomName(string rom_name)
@@ -42,15 +76,26 @@ string Machine::getRomName()
 	return rom_name;
 }
 
+void Machine::setOptions(const Options& options)
+{
+	this->options = options;
+	rom_name = options.rom_name;
+	check_stop = options.stop_on_halt || options.stop_pc >= 0;
+	if (options.speed >= 0) speed = options.speed;
+	else if (options.headless) speed = 0;
+	bool present = !options.headless || !options.shm_name.empty(); // shared memory is updated like a window
+	frame_interval = (!present || options.refresh == 0) ? 0 : max(1000 / options.refresh, 1u);
+}
+
 int Machine::init()
 {
 	/* Marking zeropage (for debugging purposes) */
 	memset(zeropage, 0xAA, sizeof(zeropage));
 
 	/* BootROM / BIOS loading */
-	cout << "Loading BootROM '" << BOOTROM_FILENAME << "'..." << endl;
+	cout << "Loading BootROM '" << options.bootrom_name << "'..." << endl;
 
-	ifstream bootrom_file(BOOTROM_FILENAME, ifstream::in | ifstream::binary | ifstream::ate);
+	ifstream bootrom_file(options.bootrom_name.c_str(), ifstream::in | ifstream::binary | ifstream::ate);
 	if (!bootrom_file.is_open())
 	{
 		cerr << "Unable to load BootROM!" << endl;
@@ -96,75 +141,729 @@ int Machine::init()
 	rom_file.close();
 	cout << endl;
 
+	/* SGPU init */
+	sgpu = new SGPU(FB_N_OFFSET);
+	if (!options.shm_name.empty())
+	{
+		if (shared_frame.open(options.shm_name)) return -1;
+		sgpu->setSharedFrame(&shared_frame);
+	}
+	if (options.headless) sgpu->initHeadless();
+	else sgpu->init(640, 480, options.render_thread);
+	sgpu->initFB0(FB_WIDTH, FB_HEIGHT);
+	if (options.sgpu_thread) sgpu->startWorker();
+
+	/* Frame capture */
+	if (!options.capture_name.empty())
+	{
+		if (capture.open(options.capture_name, FB_WIDTH, FB_HEIGHT, GetClockFrequency(), (int)options.capture_interval))
+			return -1;
+		capture_frame = new byte[FB_WIDTH * FB_HEIGHT];
+		sgpu->initCaptureConsole(); // the capture still works without console
+	}
+
+	/* Coverage, bank switches remap its image bitmaps */
+	if (!options.coverage_file.empty() || !options.coverage_listing_file.empty())
+		coverage = new Coverage(rom_size, bootrom_size);
+
+	/* Memory bus */
+	mapMemory();
+	sgpu->setMemoryMap(&memory_map);
+
 	/* CPU initialization */
 	cpu = new CPU();
+	cpu->setMemoryMap(&memory_map);
+	cpu->setIdleLoopDetection(options.idle_skip);
+	cpu->setCoverage(coverage);
+	if (!options.load_state_file.empty() && loadState(options.load_state_file)) return -1;
 	cpu->printState();
 
-	/* SGPU init */
-	sgpu = new SGPU(FB_N_OFFSET);
-	sgpu->init(640, 480);
-	sgpu->initFB0(FB_WIDTH, FB_HEIGHT);
+	/* Profiler */
+	if (!options.symbols_file.empty() && symbols.load(options.symbols_file)) return -1;
+	if (!options.profile_file.empty() || !options.profile_pc_file.empty())
+	{
+		profiler = new Profiler();
+		profiler->start(cpu->getPC(), cpu->getSP());
+		cpu->setProfiler(profiler);
+	}
+
+	/* Execution trace */
+	if (!options.trace_file.empty())
+	{
+		tracer = new Tracer();
+		if (tracer->init(options.trace_file, options.trace_size * 1024 * 1024)) return -1;
+		tracer->installSignalHandlers();
+		cpu->setTracer(tracer);
+	}
+
+	/* Debugger */
+	if (!options.debug_commands.empty() || !options.commands_file.empty())
+	{
+		debugger = new Debugger();
+		vector<string> commands = options.debug_commands;
+		if (!options.commands_file.empty() && options.commands_file != "-")
+		{
+			ifstream commands_file(options.commands_file.c_str());
+			if (!commands_file.is_open())
+			{
+				cerr << "Unable to read commands from '" << options.commands_file << "'" << endl;
+				return -1;
+			}
+			string line;
+			while (getline(commands_file, line))
+				commands.push_back(line);
+		}
+		for (unsigned int i = 0; i < commands.size(); i++)
+		{
+			if (debugger->execute(commands[i], symbols) == DEBUG_ERROR) return -1;
+		}
+		applyTraps();
+
+		/* Interactive sessions start paused, so breakpoints can be set first */
+		if (options.commands_file == "-")
+		{
+			if (debugger->openChannel()) return -1;
+			paused = true;
+		}
+	}
 
 	/* Keyboard */
-	kbd_state = new byte[255];
+	kbd_state = new byte[256];
+	memset(kbd_state, 0, 256);
+	kbd_char = 0;
+	kbd_last = 0;
 
 	return 0;
 }
 
 int Machine::run()
-{	
+{
+	start_ticks = SDL_GetTicks();
+	next_input_ticks = start_ticks;
+	next_frame_ticks = start_ticks;
+	start_counter = SDL_GetPerformanceCounter();
+	last_status.counter = start_counter;
+	start_cycles = cpu->getCycles();
+	last_status.cycles = start_cycles;
+	next_status_ticks = start_ticks + options.status_interval;
+	if (options.max_cycles) scheduler.schedule(EVENT_LIMIT, start_cycles + options.max_cycles);
+	if (capture.isOpen())
+	{
+		next_capture = cpu->getCycles() + options.capture_interval;
+		scheduler.schedule(EVENT_CAPTURE, next_capture);
+	}
+
+	uint64_t slice_cycles = max(GetClockFrequency() / SLICE_FREQUENCY, 1);
+	uint64_t idle_slice_cycles = max(GetClockFrequency() / INPUT_POLL_FREQUENCY, 1); // halted: sleep until the next input poll
+	if (speed > 0) throttle.start(cpu->getCycles(), GetClockFrequency(), speed);
 	while (running)
 	{
-		/* Keyboard/event handling */
-		SDL_Event event;
-		while (SDL_PollEvent(&event))
+		if (paused)
+		{
+			waitWhilePaused();
+			continue;
+		}
+
+		bool idle = cpu->isHalted() && speed > 0;
+		runSlice(cpu->getCycles() + (idle ? idle_slice_cycles : slice_cycles));
+		serviceHost();
+		if (speed > 0) throttle.sync(cpu->getCycles());
+		else if (!options.headless) waitForHost();
+	}
+
+	if (speed > 0)
+	{
+		cout << "Throttle: max. lag " << throttle.getMaxLag() << " ms, "
+			<< throttle.getDroppedTime() << " ms behind real time" << endl;
+	}
+	if (capture.isOpen())
+	{
+		captureFrame(); // final state
+		cout << dec << "Capture: " << capture.getFrameCount() << " frames, "
+			<< capture.getDuplicateCount() << " duplicates" << endl;
+		capture.close();
+	}
+	cout << dec << "Idle: " << idle_cycles << " cycles skipped while halted, "
+		<< loop_cycles << " in busy-wait loops (of " << cpu->getCycles() << " cycles)" << endl;
+	if (options.status_interval) printStatus();
+	if (profiler)
+	{
+		if (!options.profile_file.empty()) profiler->writeFolded(options.profile_file, symbols);
+		if (!options.profile_pc_file.empty()) profiler->writeFlat(options.profile_pc_file, symbols);
+	}
+	if (tracer) tracer->dump(TRACE_DUMP_EXIT);
+	if (coverage)
+	{
+		cout << dec << "Coverage: " << coverage->getCount(COVERAGE_ROM, COVERAGE_EXECUTED) << " of " << rom_size << " ROM bytes and "
+			<< coverage->getCount(COVERAGE_BOOTROM, COVERAGE_EXECUTED) << " of " << bootrom_size << " BootROM bytes executed" << endl;
+		if (!options.coverage_file.empty()) coverage->write(options.coverage_file);
+		if (!options.coverage_listing_file.empty())
+			coverage->writeListing(options.coverage_listing_file, symbols, rom_name, options.bootrom_name);
+	}
+
+	if (!options.save_state_file.empty()) saveState(options.save_state_file);
+	if (!options.state_file.empty()) writeJSON(options.state_file, &Machine::writeState);
+	if (!options.stats_file.empty()) writeJSON(options.stats_file, &Machine::writeStats);
+
+	delete cpu; // its register and memory dump may still read the framebuffer
+	cpu = NULL;
+	delete sgpu;
+	sgpu = NULL;
+	return exit_reason;
+}
+
+void Machine::runSlice(uint64_t end)
+{
+	scheduler.schedule(EVENT_SLICE, end);
+	slice_done = false;
+	while (running && !slice_done)
+	{
+		if (check_stop)
 		{
-			if (event.type == SDL_QUIT)
+			while (running && cpu->getCycles() < scheduler.getNextDeadline())
 			{
-				running = 0;
-				break;
+				cpu->next();
+				checkStopConditions();
+				if (running && cpu->isIdle()) skipIdle();
 			}
-			else if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP)
+		}
+		else
+		{
+			while (cpu->getCycles() < scheduler.getNextDeadline())
 			{
-				int val = event.key.state == SDL_PRESSED ? 1 : 0;
-				int key = event.key.keysym.sym;
+				cpu->next();
+				if (cpu->isIdle()) skipIdle(); // fast-forward to the next event
+			}
+		}
+		processEvents();
+	}
+}
 
-				if (key <= 255 && key != 0) kbd_state[key] = val;
-				else if (key == SDLK_LSHIFT || key == SDLK_RSHIFT) kbd_state[0] = val; // map shift key to keycode 0
+void Machine::skipIdle()
+{
+	bool halted = cpu->isHalted();
+	uint64_t skipped = cpu->skipIdle(scheduler.getNextDeadline());
+	if (halted) idle_cycles += skipped;
+	else loop_cycles += skipped;
+}
+
+void Machine::waitForHost()
+{
+	/* Only timer 0 can wake up the CPU, SGPU completion is waited for as well */
+	if (!cpu->isHalted() || scheduler.isScheduled(EVENT_TIMER0) || scheduler.isScheduled(EVENT_SGPU)) return;
+
+	Sint32 ms = (Sint32)(next_input_ticks - SDL_GetTicks());
+	if (ms > 0) SDL_Delay(ms);
+}
 
-				if (key == kbd_last && !val) kbd_last = 0; // key in kbd_last has been released => 0
-				else if (val) kbd_last = key; // set kbd_last to new key
+void Machine::serviceHost()
+{
+	Uint32 ticks = SDL_GetTicks();
+
+	if ((Sint32)(ticks - next_input_ticks) >= 0)
+	{
+		if (!options.headless) handleInput();
+		if (tracer && tracer->pollSignal()) tracer->dump(TRACE_DUMP_SIGNAL);
+		if (tracer && tracer->pollQuitSignal()) stop(EXIT_REASON_QUIT);
+		if (debugger && !paused) processCommands(); // while paused, waitWhilePaused() takes over
+		if (options.max_time && (ticks - start_ticks) >= options.max_time)
+			stop(EXIT_REASON_MAX_TIME);
+		next_input_ticks = ticks + 1000 / INPUT_POLL_FREQUENCY;
+	}
+
+	if (options.status_interval && (Sint32)(ticks - next_status_ticks) >= 0)
+	{
+		printStatus();
+		next_status_ticks = ticks + options.status_interval;
+	}
+
+	if (frame_interval && (Sint32)(ticks - next_frame_ticks) >= 0)
+	{
+		syncSGPU();
+		sgpu->render(); // only presents if something changed
+		next_frame_ticks += frame_interval;
+		if ((Sint32)(ticks - next_frame_ticks) >= 0) next_frame_ticks = ticks + frame_interval; // don't catch up on missed frames
+	}
+}
+
+void Machine::checkStopConditions()
+{
+	if (options.stop_on_halt && cpu->isHalted() && cpu->isIRQDisabled())
+		stop(EXIT_REASON_HALT);
+	else if (options.stop_pc >= 0 && cpu->getPC() == options.stop_pc)
+		stop(EXIT_REASON_STOP_PC);
+}
+
+void Machine::stop(int reason)
+{
+	if (!running) return; // keep the first reason
+	exit_reason = reason;
+	running = 0;
+}
+
+bool Machine::CheckBreakpoint(dword address)
+{
+	if (breakpoints_suspended || !debugger->isBreakpoint(address)) return false;
+
+	cout << "Breakpoint at " << symbols.describe(address) << " (cycle " << dec << cpu->getCycles() << ")" << endl;
+	debugBreak();
+	return true;
+}
+
+void Machine::CheckWatchpoint(dword address, byte value, byte access)
+{
+	if (debugger->isWatched(address, access)) hitWatchpoint(false, address, value, access);
+}
+
+void Machine::hitWatchpoint(bool io, dword address, byte value, byte access)
+{
+	bool read = access == MEM_TRAP_READ;
+	cout << "Watchpoint: " << (read ? "read 0x" : "write 0x") << hex << setfill('0') << setw(2) << (int)value << (read ? " from " : " to ");
+	if (io) cout << "port 0x" << setw(2) << address;
+	else cout << symbols.describe(address);
+	cout << setfill(' ') << " at " << symbols.describe(cpu->getInstructionPC()) << " (cycle " << dec << cpu->getInstructionCycles() << ")" << endl;
+	debugBreak();
+}
+
+void Machine::debugBreak()
+{
+	scheduler.schedule(EVENT_SLICE, cpu->getCycles()); // ends the slice after the current instruction
+	if (debugger->isChannelOpen()) paused = true;
+	else stop(EXIT_REASON_BREAK);
+}
+
+void Machine::applyTraps()
+{
+	debugger->getPageTraps(memory_map.traps);
+	syncSGPU(); // the framebuffer mapping depends on the SGPU state
+	mapMemory();
+}
+
+void Machine::processCommands()
+{
+	string line;
+	while (running && debugger->pollCommand(&line, paused))
+		handleCommand(line);
+}
+
+void Machine::handleCommand(const string& line)
+{
+	switch (debugger->execute(line, symbols))
+	{
+		case DEBUG_TRAPS:
+			applyTraps();
+			break;
+		case DEBUG_CONTINUE:
+			if (!paused) break;
+			paused = false;
+			step(); // may pause again on a watchpoint
+			break;
+		case DEBUG_STEP:
+			if (!paused)
+			{
+				cerr << "Not paused" << endl;
+				break;
 			}
+			step();
+			cout << "Stepped to " << symbols.describe(cpu->getPC()) << " (cycle " << dec << cpu->getCycles() << ")" << endl;
+			break;
+		case DEBUG_PAUSE:
+			paused = true;
+			break;
+		case DEBUG_REGS:
+			cpu->writeState(cout);
+			cout << endl;
+			break;
+		case DEBUG_QUIT:
+			stop(EXIT_REASON_QUIT);
+			break;
+	}
+}
+
+void Machine::waitWhilePaused()
+{
+	cout << "Paused at " << symbols.describe(cpu->getPC()) << " (cycle " << dec << cpu->getCycles() << ")" << endl;
+	while (paused && running)
+	{
+		processCommands();
+		if (running && paused && !debugger->isChannelOpen())
+		{
+			cout << "Command channel closed" << endl;
+			stop(EXIT_REASON_BREAK);
 		}
+		if (!options.headless) handleInput();
+		if (tracer && tracer->pollQuitSignal()) stop(EXIT_REASON_QUIT);
+		SDL_Delay(1000 / INPUT_POLL_FREQUENCY);
+	}
+	if (speed > 0) throttle.start(cpu->getCycles(), GetClockFrequency(), speed); // don't catch up on the pause
+}
+
+void Machine::step()
+{
+	breakpoints_suspended = true;
+	cpu->next();
+	breakpoints_suspended = false;
+	if (check_stop) checkStopConditions();
+	if (cpu->getCycles() >= scheduler.getNextDeadline()) processEvents();
+}
+
+void Machine::printStatus()
+{
+	Uint64 counter = SDL_GetPerformanceCounter();
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	const CPUStats& cpu_stats = cpu->getStats();
+	const SGPUStats& sgpu_stats = sgpu->getStats();
+	uint64_t instructions = cpu_stats.instructions + cpu_stats.skipped_instructions;
+	uint64_t sgpu_commands = 0;
+	for (int i = 0; i <= SGPU_CMD_FLIP; i++) sgpu_commands += sgpu_stats.commands[i];
+
+	double seconds = max(counter - last_status.counter, (Uint64)1) / frequency;
+	uint64_t cycles = cpu->getCycles() - last_status.cycles;
+	uint64_t halted = cpu_stats.halted_cycles - last_status.halted_cycles;
+
+	ios::fmtflags flags = cout.flags();
+	streamsize precision = cout.precision();
+	cout << dec << fixed << setprecision(2)
+		<< "Status: " << (counter - start_counter) / frequency << " s, "
+		<< (instructions - last_status.instructions) / seconds / 1e6 << " MIPS, "
+		<< setprecision(1) << cycles / seconds / GetClockFrequency() * 100 << "% of real time, "
+		<< (cycles ? halted * 100.0 / cycles : 0.0) << "% halted, "
+		<< sgpu_commands - last_status.sgpu_commands << " SGPU commands, "
+		<< cpu_stats.irqs - last_status.irqs << " IRQs" << endl;
+	cout.flags(flags);
+	cout.precision(precision);
+
+	last_status.counter = counter;
+	last_status.cycles = cpu->getCycles();
+	last_status.instructions = instructions;
+	last_status.halted_cycles = cpu_stats.halted_cycles;
+	last_status.sgpu_commands = sgpu_commands;
+	last_status.irqs = cpu_stats.irqs;
+}
+
+void Machine::writeJSON(const string& file, void (Machine::*write)(ostream&))
+{
+	if (file == "-")
+	{
+		(this->*write)(cout);
+		return;
+	}
+
+	ofstream out(file.c_str());
+	if (out.is_open()) (this->*write)(out);
+	else cerr << "Unable to write '" << file << "'" << endl;
+}
+
+void Machine::writeStats(ostream& out)
+{
+	/* Memory regions, accesses are counted per page and attributed by the page address */
+	static const struct
+	{
+		const char* name;
+		int offset, size;
+	} regions[] = {
+		{ "zeropage", 0, 0x0100 },
+		{ "ram", RAM_OFFSET, RAM_SIZE },
+		{ "rom_0", ROM_0_OFFSET, ROM_0_SIZE },
+		{ "rom_n", ROM_N_OFFSET, ROM_N_SIZE },
+		{ "framebuffer", FB_N_OFFSET, FB_APERTURE_SIZE },
+		{ "bootrom_0", BOOTROM_0_OFFSET, BOOTROM_0_SIZE }, // takes the page shared with bootrom_n, like the memory map
+		{ "bootrom_n", BOOTROM_N_OFFSET, BOOTROM_N_SIZE },
+		{ "unmapped", 0, 0 } // everything else
+	};
+	static const int region_count = sizeof(regions) / sizeof(regions[0]);
+	static const char* commands[] = { "unknown", "fill", "tty_write", "blit", "scroll", "dma", "flip" };
+
+	const CPUStats& cpu_stats = cpu->getStats();
+	const SGPUStats& sgpu_stats = sgpu->getStats();
+	double host_seconds = max(SDL_GetPerformanceCounter() - start_counter, (Uint64)1) / (double)SDL_GetPerformanceFrequency();
+	double emulated_seconds = (double)(cpu->getCycles() - start_cycles) / GetClockFrequency();
+	uint64_t instructions = cpu_stats.instructions + cpu_stats.skipped_instructions;
+
+	uint64_t fetches[region_count] = { 0 };
+	uint64_t reads[region_count] = { 0 };
+	uint64_t writes[region_count] = { 0 };
+	for (int page = 0; page < MEM_PAGE_COUNT; page++)
+	{
+		int address = page << MEM_PAGE_SHIFT;
+		int region = 0;
+		while (region < region_count - 1
+			&& (address < regions[region].offset || address >= regions[region].offset + regions[region].size))
+			region++;
+		fetches[region] += cpu_stats.fetches[page];
+		reads[region] += cpu_stats.reads[page];
+		writes[region] += cpu_stats.writes[page];
+	}
+
+	out << dec << "{" << endl;
+	out << "  \"host_seconds\": " << host_seconds << "," << endl;
+	out << "  \"emulated_seconds\": " << emulated_seconds << "," << endl;
+	out << "  \"speed\": " << emulated_seconds / host_seconds << "," << endl;
+	out << "  \"cycles\": " << cpu->getCycles() << "," << endl;
+	out << "  \"halted_cycles\": " << cpu_stats.halted_cycles << "," << endl;
+	out << "  \"loop_skipped_cycles\": " << loop_cycles << "," << endl;
+	out << "  \"instructions\": " << instructions << "," << endl;
+	out << "  \"executed_instructions\": " << cpu_stats.instructions << "," << endl;
+	out << "  \"mips\": " << instructions / host_seconds / 1e6 << "," << endl;
+	out << "  \"opcode_classes\": {";
+	for (int i = 0; i < OPCODE_CLASS_COUNT; i++)
+		out << (i ? ", " : "") << "\"" << CPU::getOpcodeClassName(i) << "\": " << cpu_stats.classes[i];
+	out << "}," << endl;
+	out << "  \"memory\": {";
+	for (int i = 0; i < region_count; i++)
+		out << (i ? ", " : "") << "\"" << regions[i].name << "\": {\"instructions\": " << fetches[i] << ", \"reads\": " << reads[i] << ", \"writes\": " << writes[i] << "}";
+	out << "}," << endl;
+	out << "  \"irqs\": {\"taken\": " << cpu_stats.irqs << ", \"timer0\": " << timer0_irqs
+		<< ", \"sgpu\": " << sgpu_stats.irqs << "}," << endl;
+	out << "  \"sgpu\": {\"commands\": {";
+	for (int i = 0; i <= SGPU_CMD_FLIP; i++)
+		out << (i ? ", " : "") << "\"" << commands[i] << "\": " << sgpu_stats.commands[i];
+	out << "}, \"rejected\": " << sgpu_stats.rejected << ", \"bytes_drawn\": " << sgpu_stats.bytes_drawn << "}" << endl;
+	out << "}" << endl;
+}
+
+void Machine::writeState(ostream& out)
+{
+	static const char* reasons[] = { "quit", "", "halt", "stop_pc", "max_cycles", "max_time", "break" };
+
+	out << "{" << endl;
+	out << "  \"exit_reason\": \"" << reasons[exit_reason] << "\"," << endl;
+	out << "  \"cycles\": " << dec << cpu->getCycles() << "," << endl;
+	out << "  \"cpu\": ";
+	cpu->writeState(out);
+	out << "," << endl;
+	out << "  \"io\": {";
+	out << "\"rom_page\": " << (int)rom_page << ", ";
+	out << "\"bootrom_page\": " << (int)bootrom_page << ", ";
+	out << "\"fb_page\": " << sgpu->getFramebufferPage() << ", ";
+	out << "\"sgpu_mode\": " << (int)sgpu->getMode() << ", ";
+	out << "\"t0_ctrl\": " << (int)t0_ctrl << ", ";
+	out << "\"t0_kcycles\": " << t0_kcycles;
+	out << "}," << endl;
+
+	out << "  \"memory\": {" << endl;
+	out << hex << setfill('0');
+	out << "    \"zeropage\": \"";
+	for (unsigned int i = 0; i < sizeof(zeropage); i++) out << setw(2) << (int)zeropage[i];
+	out << "\"," << endl;
+	out << "    \"ram\": \"";
+	for (unsigned int i = 0; i < sizeof(ram); i++) out << setw(2) << (int)ram[i];
+	out << "\"" << endl;
+	out << dec << setfill(' ');
+	out << "  }" << endl;
+	out << "}" << endl;
+}
+
+/* Identifies the ROM images a state belongs to (FNV-1a) */
+static uint64_t hashImage(const byte* data, int size)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (int i = 0; i < size; i++)
+		hash = (hash ^ data[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+int Machine::saveState(const string& file_name)
+{
+	syncSGPU(); // a running fill is only drawn up to the last sync
+	StateWriter state;
+	state.beginSection(STATE_SECTION_MACHINE);
+	state.put32((uint32_t)rom_size);
+	state.put64(hashImage(rom, rom_size));
+	state.put32((uint32_t)bootrom_size);
+	state.put64(hashImage(bootrom, bootrom_size));
+	state.put8(rom_page);
+	state.put8(bootrom_page);
+	state.put8(t0_ctrl);
+	state.put16(t0_kcycles);
+	state.put64(t0_start);
+	state.put64(scheduler.getDeadline(EVENT_TIMER0));
+	state.put8((byte)kbd_char);
+	state.put8((byte)kbd_last);
+	state.endSection();
+
+	cpu->saveState(state);
+
+	state.beginSection(STATE_SECTION_MEMORY);
+	state.putBytes(zeropage, sizeof(zeropage));
+	state.putBytes(ram, sizeof(ram));
+	state.endSection();
+
+	sgpu->saveState(state);
+
+	if (state.write(file_name)) return -1;
+	cout << "State saved to '" << file_name << "' at cycle " << dec << cpu->getCycles() << endl;
+	return 0;
+}
+
+int Machine::loadState(const string& file_name)
+{
+	Uint64 start = SDL_GetPerformanceCounter();
+	StateReader state;
+	if (state.open(file_name)) return -1;
+
+	if (state.openSection(STATE_SECTION_MACHINE))
+	{
+		cerr << "State '" << file_name << "' has no machine section" << endl;
+		return -1;
+	}
+	bool same_rom = (int)state.get32() == rom_size && state.get64() == hashImage(rom, rom_size);
+	bool same_bootrom = (int)state.get32() == bootrom_size && state.get64() == hashImage(bootrom, bootrom_size);
+	if (!same_rom || !same_bootrom)
+	{
+		cerr << "State '" << file_name << "' has been saved with a different " << (same_rom ? "BootROM" : "ROM") << endl;
+		return -1;
+	}
+	rom_page = state.get8();
+	bootrom_page = state.get8();
+	t0_ctrl = state.get8();
+	t0_kcycles = state.get16();
+	t0_start = state.get64();
+	uint64_t t0_deadline = state.get64();
+	kbd_char = state.get8();
+	kbd_last = (char)state.get8();
+
+	bool complete = !state.hasError() && !cpu->loadState(state) && !state.openSection(STATE_SECTION_MEMORY);
+	if (complete)
+	{
+		state.getBytes(zeropage, sizeof(zeropage));
+		state.getBytes(ram, sizeof(ram));
+		complete = !state.hasError() && !sgpu->loadState(state);
+	}
+	if (!complete)
+	{
+		cerr << "State '" << file_name << "' is incomplete or does not match this machine" << endl;
+		return -1;
+	}
 
-		cpu->next();
+	/* Rebuild what depends on the restored registers */
+	mapMemory();
+	if (t0_deadline == EVENT_NEVER) scheduler.cancel(EVENT_TIMER0);
+	else scheduler.schedule(EVENT_TIMER0, t0_deadline);
+	scheduleSGPU();
+
+	double us = (SDL_GetPerformanceCounter() - start) * 1e6 / SDL_GetPerformanceFrequency();
+	cout << "State loaded from '" << file_name << "' (" << dec << state.getSize() / 1024 << " KiB, cycle "
+		<< cpu->getCycles() << ") in " << (int)us << " us" << endl;
+	return 0;
+}
+
+void Machine::processEvents()
+{
+	uint64_t now = cpu->getCycles();
+	int event;
+	cpu->noteSideEffect(); // device state visible to the program may change
+	while ((event = scheduler.popDueEvent(now)) >= 0)
+	{
+		switch (event)
+		{
+			case EVENT_TIMER0:
+				SET_BIT(t0_ctrl, T0_CTRL_TRIGGER);
+				t0_start = now;
+				scheduler.schedule(EVENT_TIMER0, now + max((int)t0_kcycles, 1));
+				if (GET_BIT(t0_ctrl, T0_CTRL_ENABLE_IRQ))
+				{
+					cpu->triggerIRQ();
+					timer0_irqs++;
+				}
+				break;
+			case EVENT_SGPU:
+				syncSGPU();
+				scheduleSGPU();
+				break;
+			case EVENT_SLICE:
+				slice_done = true;
+				break;
+			case EVENT_LIMIT:
+				stop(EXIT_REASON_MAX_CYCLES);
+				break;
+			case EVENT_CAPTURE:
+				captureFrame();
+				next_capture += options.capture_interval; // stays on the grid if serviced late
+				scheduler.schedule(EVENT_CAPTURE, max(next_capture, now));
+				break;
+		}
+	}
+}
 
-		/* Timer handling */
-		if (t0_kcycles_counted >= t0_kcycles && (t0_ctrl & T0_CTRL_ENABLE))
+void Machine::handleInput()
+{
+	/* Keyboard/event handling */
+	SDL_Event event;
+	while (SDL_PollEvent(&event))
+	{
+		if (event.type == SDL_QUIT)
 		{
-			t0_ctrl |= T0_CTRL_TRIGGER;
-			t0_kcycles_counted = 0;
-			if ((t0_ctrl & T0_CTRL_ENABLE_IRQ))
-				cpu->triggerIRQ();
+			stop(EXIT_REASON_QUIT);
+			break;
 		}
-		else if (!(t0_ctrl & T0_CTRL_ENABLE))
+		else if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP)
 		{
-			t0_kcycles_counted = 0;
+			int val = event.key.state == SDL_PRESSED ? 1 : 0;
+			int key = event.key.keysym.sym;
+
+			if (key <= 255 && key != 0) kbd_state[key] = val;
+			else if (key == SDLK_LSHIFT || key == SDLK_RSHIFT) kbd_state[0] = val; // map shift key to keycode 0
+
+			if (key == kbd_last && !val) kbd_last = 0; // key in kbd_last has been released => 0
+			else if (val) kbd_last = key; // set kbd_last to new key
 		}
+	}
+}
 
-		/* Rendering */
-		sgpu->render();
+void Machine::captureFrame()
+{
+	syncSGPU();
+	sgpu->composeFrame(capture_frame);
+	sgpu->composeConsole(capture_frame);
+	if (capture.writeFrame(capture_frame))
+	{
+		cerr << "Capture failed, stopping capture" << endl;
+		capture.close();
+		scheduler.cancel(EVENT_CAPTURE);
 	}
-	delete sgpu;
-	return 0;
+}
+
+void Machine::syncSGPU()
+{
+	bool busy = sgpu->isBusy();
+	sgpu->sync(cpu->getCycles());
+	if (busy && !sgpu->isBusy()) mapFramebufferPages(); // command completed, framebuffer may be mapped directly again
+	if (sgpu->pollIRQ()) cpu->triggerIRQ();
+}
+
+void Machine::scheduleSGPU()
+{
+	uint64_t deadline = sgpu->getNextEvent();
+	if (deadline == EVENT_NEVER) scheduler.cancel(EVENT_SGPU);
+	else scheduler.schedule(EVENT_SGPU, deadline);
+}
+
+void Machine::scheduleTimer0()
+{
+	if (!GET_BIT(t0_ctrl, T0_CTRL_ENABLE))
+	{
+		scheduler.cancel(EVENT_TIMER0);
+		return;
+	}
+
+	/* Counting starts with the instruction enabling the timer */
+	if (!scheduler.isScheduled(EVENT_TIMER0))
+		t0_start = cpu->getInstructionCycles();
+	scheduler.schedule(EVENT_TIMER0, max(t0_start + t0_kcycles, cpu->getCycles()));
 }
 
 Machine::~Machine()
 {
 	if (cpu != NULL) delete cpu; // free only when CPU has been created with new
+	delete profiler;
+	delete tracer;
+	delete coverage;
+	delete debugger;
+	delete[] capture_frame;
 }
 
-void Machine::WriteMem(dword address, byte value)
+void Machine::WriteMemSlow(dword address, byte value)
 {
 	if (address < 0x0100)
 	{
@@ -174,13 +873,20 @@ void Machine::WriteMem(dword address, byte value)
 	{
 		ram[address - RAM_OFFSET] = value;
 	}
-	else if (address >= FB_N_OFFSET && address < (FB_N_OFFSET + FB_N_SIZE))
+	else if (address >= FB_N_OFFSET && address < (FB_N_OFFSET + sgpu->getWindowSize()))
 	{
+		syncSGPU();
 		sgpu->writeFB(address, value); // pass over to SGPU
 	}
 }
 
-byte Machine::ReadMem(dword address)
+byte Machine::ReadMemDMA(dword address)
+{
+	if (address >= FB_N_OFFSET && address < (FB_N_OFFSET + FB_APERTURE_SIZE)) return 0;
+	return ReadMem(address);
+}
+
+byte Machine::ReadMemSlow(dword address)
 {
 	if (address < 0x0100)
 	{
@@ -190,8 +896,10 @@ byte Machine::ReadMem(dword address)
 	{
 		return ram[address - RAM_OFFSET];
 	}
-	else if (address >= FB_N_OFFSET && address < (FB_N_OFFSET + FB_N_SIZE))
+	else if (address >= FB_N_OFFSET && address < (FB_N_OFFSET + sgpu->getWindowSize()))
 	{
+		syncSGPU();
+		if (sgpu->isBusy()) cpu->noteSideEffect(); // changes while a command is running
 		return sgpu->readFB(address); // pass over to SGPU
 	}
 	else if (address >= BOOTROM_0_OFFSET && address < (BOOTROM_0_OFFSET + BOOTROM_0_SIZE))
@@ -217,16 +925,107 @@ byte Machine::ReadMem(dword address)
 	else if (address >= BOOTROM_N_OFFSET && address < (BOOTROM_N_OFFSET + BOOTROM_N_SIZE))
 	{
 		int _address = address - BOOTROM_N_OFFSET;
-		if (_address + (BOOTROM_N_SIZE * bootrom_page) >= rom_size) return 0x76; // return halt instruction when exceeding bounds
+		if (_address + (BOOTROM_N_SIZE * bootrom_page) >= bootrom_size) return 0x76; // return halt instruction when exceeding bounds
 
 		return bootrom[_address + (BOOTROM_N_SIZE * bootrom_page)];
 	}
 	return 0;
 }
 
+void Machine::mapRegion(int offset, int size, byte* data, int data_size, byte* fill, byte flags)
+{
+	int first = offset >> MEM_PAGE_SHIFT;
+	int last = (offset + size - 1) >> MEM_PAGE_SHIFT;
+	for (int page = first; page <= last && page < MEM_PAGE_COUNT; page++)
+	{
+		int page_addr = page << MEM_PAGE_SHIFT;
+		int start = page_addr - offset; // index of the first byte of the page inside the region
+		byte* read = NULL;
+		if (page_addr >= offset && (page_addr + MEM_PAGE_SIZE) <= (offset + size))
+		{
+			if (start + MEM_PAGE_SIZE <= data_size) read = data + start;
+			else if (start >= data_size) read = fill;
+		}
+
+		byte traps = memory_map.traps[page];
+		memory_map.read[page] = (traps & (MEM_TRAP_EXEC | MEM_TRAP_READ)) ? NULL : read;
+		memory_map.flags[page] = flags;
+		if ((flags & MEM_PAGE_MMIO) || (traps & MEM_TRAP_WRITE)) memory_map.write[page] = NULL;
+		else if (flags & (MEM_PAGE_READONLY | MEM_PAGE_WRITE_IGNORE)) memory_map.write[page] = sink_page;
+		else memory_map.write[page] = read;
+	}
+}
+
+void Machine::mapMemory()
+{
+	memset(unmapped_page, 0, sizeof(unmapped_page));
+	memset(halt_page, 0x76, sizeof(halt_page));
+
+	mapRegion(0, 0x10000, NULL, 0, unmapped_page, MEM_PAGE_WRITE_IGNORE);
+	mapRegion(0, sizeof(zeropage), zeropage, sizeof(zeropage), NULL, 0);
+	mapRegion(RAM_OFFSET, RAM_SIZE, ram, RAM_SIZE, NULL, 0);
+	mapRomPages();
+	mapBootRomPages();
+	mapFramebufferPages();
+}
+
+void Machine::mapRomPages()
+{
+	if (rom_size == 0)
+	{
+		mapRegion(ROM_0_OFFSET, ROM_0_SIZE, NULL, 0, halt_page, MEM_PAGE_READONLY); // always return halt when ROM is empty
+		mapRegion(ROM_N_OFFSET, ROM_N_SIZE, NULL, 0, halt_page, MEM_PAGE_READONLY);
+		return;
+	}
+
+	int bank = ROM_N_SIZE * rom_page;
+	if (coverage)
+	{
+		coverage->mapImage(ROM_0_OFFSET, ROM_0_SIZE, COVERAGE_ROM, 0);
+		coverage->mapImage(ROM_N_OFFSET, ROM_N_SIZE, COVERAGE_ROM, bank);
+	}
+	mapRegion(ROM_0_OFFSET, ROM_0_SIZE, rom, rom_size, unmapped_page, MEM_PAGE_READONLY);
+	if (bank < rom_size)
+		mapRegion(ROM_N_OFFSET, ROM_N_SIZE, rom + bank, rom_size - bank, halt_page, MEM_PAGE_READONLY);
+	else
+		mapRegion(ROM_N_OFFSET, ROM_N_SIZE, NULL, 0, halt_page, MEM_PAGE_READONLY);
+}
+
+void Machine::mapBootRomPages()
+{
+	int bank = BOOTROM_N_SIZE * bootrom_page;
+	if (coverage)
+	{
+		coverage->mapImage(BOOTROM_N_OFFSET, BOOTROM_N_SIZE, COVERAGE_BOOTROM, bank);
+		coverage->mapImage(BOOTROM_0_OFFSET, BOOTROM_0_SIZE, COVERAGE_BOOTROM, 0);
+	}
+	if (bank < bootrom_size)
+		mapRegion(BOOTROM_N_OFFSET, BOOTROM_N_SIZE, bootrom + bank, bootrom_size - bank, halt_page, MEM_PAGE_READONLY);
+	else
+		mapRegion(BOOTROM_N_OFFSET, BOOTROM_N_SIZE, NULL, 0, halt_page, MEM_PAGE_READONLY);
+
+	// page 0 takes precedence where both regions share a page
+	mapRegion(BOOTROM_0_OFFSET, BOOTROM_0_SIZE, bootrom, bootrom_size, unmapped_page, MEM_PAGE_READONLY);
+}
+
+void Machine::mapFramebufferPages()
+{
+	int start = sgpu->getWindowStart();
+	int size = sgpu->getWindowSize();
+	int fb_size = FB_WIDTH * FB_HEIGHT;
+
+	// the aperture is unmapped beyond the current window
+	mapRegion(FB_N_OFFSET, FB_APERTURE_SIZE, NULL, 0, unmapped_page, MEM_PAGE_WRITE_IGNORE);
+	if (start < fb_size && !sgpu->isBusy()) // running commands are synchronized on every access
+		mapRegion(FB_N_OFFSET, size, sgpu->getFB0() + start, fb_size - start, NULL, MEM_PAGE_MMIO);
+	else
+		mapRegion(FB_N_OFFSET, size, NULL, 0, NULL, MEM_PAGE_MMIO);
+}
+
 void Machine::WriteIO(dword address, byte value)
 {
 	if (address > 255) return; // the z80 only has up to 256 I/O ports, discard everything above that
+	if (!isLatchIO(address) || ReadIO(address) != value) cpu->noteSideEffect();
 	switch (address)
 	{
 		case KBD_CHAR:
@@ -234,28 +1033,62 @@ void Machine::WriteIO(dword address, byte value)
 			break;
 		case TIMER0_CTRL:
 			t0_ctrl = value;
+			scheduleTimer0();
 			break;
 		case TIMER0_KCYCLES_LOW:
 			t0_kcycles &= 0xff00;
 			t0_kcycles |= value;
+			scheduleTimer0();
 			break;
 		case TIMER0_KCYCLES_HIGH:
 			t0_kcycles &= 0xff;
-			t0_kcycles |= (8 << value);
+			t0_kcycles |= (value << 8);
+			scheduleTimer0();
 			break;
 		case BOOTROM_PAGE:
 			bootrom_page = value;
+			mapBootRomPages();
 			break;
 		case ROM_PAGE:
 			rom_page = value;
+			mapRomPages();
 			break;
 		default	:
 			if (address >= SGPU_IO_OFFSET && address < (SGPU_IO_OFFSET + SGPU_IO_SIZE))
+			{
+				syncSGPU();
+				bool busy = sgpu->isBusy();
 				sgpu->writeIO(address, value);
+				if (address == FB_PAGE_NUMBER || address == SGPU_MODE || busy != sgpu->isBusy()) mapFramebufferPages();
+				if (sgpu->pollIRQ()) cpu->triggerIRQ();
+				scheduleSGPU();
+			}
+			else if (address >= SGPU_OBJ_IO_OFFSET && address < (SGPU_OBJ_IO_OFFSET + SGPU_OBJ_IO_SIZE))
+			{
+				sgpu->writeObjectIO(address, value);
+			}
 			break;
 	}
 }
 
+bool Machine::isLatchIO(dword address)
+{
+	switch (address)
+	{
+		case KBD_CHAR:
+		case BOOTROM_PAGE:
+		case ROM_PAGE:
+		case FB_PAGE_NUMBER:
+		case SGPU_MODE:
+		case SGPU_CMD_BUF_ADDR:
+		case SGPU_CMD_BUF_VALUE:
+		case SGPU_RING_HEAD:
+			return true;
+		default:
+			return false;
+	}
+}
+
 byte Machine::ReadIO(dword address)
 {
 	if (address > 255) return 0; // the z80 only has up to 256 I/O ports, discard everything above that
@@ -272,14 +1105,19 @@ byte Machine::ReadIO(dword address)
 		case TIMER0_KCYCLES_LOW:
 			return t0_kcycles & 0xff;
 		case TIMER0_KCYCLES_HIGH:
-			return (8 >> t0_kcycles) & 0xff;
+			return (t0_kcycles >> 8) & 0xff;
 		case BOOTROM_PAGE:
 			return bootrom_page;
 		case ROM_PAGE:
 			return rom_page;
 		default	:
 			if (address >= SGPU_IO_OFFSET && address < (SGPU_IO_OFFSET + SGPU_IO_SIZE))
+			{
+				syncSGPU();
 				return sgpu->readIO(address);
+			}
+			if (address >= SGPU_OBJ_IO_OFFSET && address < (SGPU_OBJ_IO_OFFSET + SGPU_OBJ_IO_SIZE))
+				return sgpu->readObjectIO(address);
 			return 0;
 	}
 }
@@ -289,16 +1127,6 @@ int Machine::GetClockFrequency()
 	return clock_frequency;
 }
 
-void Machine::Cycle()
-{
-#if (defined(nanosleep) && !defined(NO_CYCLING))
-	nanosleep(&cycle_spec, NULL);
-#endif
-	t0_kcycles_counted++;
-	sgpu->cycle();
-}
-
-
 /*********************
  * Wrapper functions *
  *********************/
@@ -312,22 +1140,35 @@ byte Machine_ReadMem(dword address)
 	return instance->ReadMem(address);
 }
 
+byte Machine_ReadMemDMA(dword address)
+{
+	return instance->ReadMemDMA(address);
+}
+
 void Machine_WriteIO(dword address, byte value)
 {
 	instance->WriteIO(address, value);
+	instance->CheckWatchpointIO(address, value, MEM_TRAP_WRITE);
 }
 
 byte Machine_ReadIO(dword address)
 {
-	return instance->ReadIO(address);
+	byte value = instance->ReadIO(address);
+	instance->CheckWatchpointIO(address, value, MEM_TRAP_READ);
+	return value;
 }
 
-int Machine_GetClockFrequency()
+bool Machine_CheckBreakpoint(dword address)
 {
-	return instance->GetClockFrequency();
+	return instance->CheckBreakpoint(address);
+}
+
+void Machine_CheckWatchpoint(dword address, byte value, byte access)
+{
+	instance->CheckWatchpoint(address, value, access);
 }
 
-void Machine_Cycle()
+int Machine_GetClockFrequency()
 {
-	instance->Cycle();
+	return instance->GetClockFrequency();
 }
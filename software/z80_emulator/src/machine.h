@@ -23,8 +23,28 @@
 #include <config.standard.h>
 #include <stdafx.h>
 #include <SDL2/SDL.h>
+#include "memory.h"
 #include "cpu.h"
 #include "sgpu.h"
+#include "scheduler.h"
+#include "options.h"
+#include "throttle.h"
+#include "capture.h"
+#include "shared_frame.h"
+#include "profiler.h"
+#include "symbols.h"
+#include "trace.h"
+#include "coverage.h"
+#include "debugger.h"
+#include "savestate.h"
+
+/* Reasons for Machine::run() to return, used as exit codes */
+#define EXIT_REASON_QUIT 0			// window has been closed
+#define EXIT_REASON_HALT 2			// HALT with interrupts disabled
+#define EXIT_REASON_STOP_PC 3		// stop address reached
+#define EXIT_REASON_MAX_CYCLES 4	// cycle budget exhausted
+#define EXIT_REASON_MAX_TIME 5		// wall time exhausted
+#define EXIT_REASON_BREAK 6			// breakpoint or watchpoint without command channel
 
 class Machine
 {
@@ -41,7 +61,7 @@ public:
 	int init();
 
 	/**
-	 * Starts the machine
+	 * Starts the machine, returns one of EXIT_REASON_*
      */
 	int run();
 
@@ -49,25 +69,208 @@ public:
 
 	string getRomName();
 
-	void WriteMem(dword address, byte value);
+	/**
+	 * Applies the command line options (ROM names, headless mode, stop conditions)
+	 */
+	void setOptions(const Options& options);
+
+	/**
+	 * Writes CPU, I/O and memory state as JSON
+	 */
+	void writeState(ostream& out);
+
+	/**
+	 * Writes a snapshot of CPU, memory, timer and SGPU, returns -1 on errors
+	 */
+	int saveState(const string& file_name);
+
+	/**
+	 * Continues from a snapshot taken with the same ROMs, returns -1 on errors
+	 */
+	int loadState(const string& file_name);
+
+	/**
+	 * Writes the runtime statistics (speed, instruction mix, device activity) as JSON
+	 */
+	void writeStats(ostream& out);
 
-	byte ReadMem(dword address);
+	inline void WriteMem(dword address, byte value)
+	{
+		byte* page = memory_map.write[address >> MEM_PAGE_SHIFT];
+		if (page) page[address & MEM_PAGE_MASK] = value;
+		else WriteMemSlow(address, value);
+	}
+
+	inline byte ReadMem(dword address)
+	{
+		byte* page = memory_map.read[address >> MEM_PAGE_SHIFT];
+		if (page) return page[address & MEM_PAGE_MASK];
+		return ReadMemSlow(address);
+	}
+
+	/**
+	 * Memory read on behalf of the SGPU DMA engine; the framebuffer
+	 * window is not a valid source and reads as 0
+	 */
+	byte ReadMemDMA(dword address);
 
 	void WriteIO(dword address, byte value);
 
 	byte ReadIO(dword address);
 
-	int GetClockFrequency();
+	/**
+	 * Called before executing an instruction on a page with breakpoints.
+	 * Returns true if the CPU has to stop before the instruction.
+	 */
+	bool CheckBreakpoint(dword address);
 
-	void Cycle();
+	/**
+	 * Called after a CPU access to a page with watchpoints
+	 */
+	void CheckWatchpoint(dword address, byte value, byte access);
+
+	/**
+	 * Called after a CPU access to an I/O port
+	 */
+	inline void CheckWatchpointIO(dword address, byte value, byte access)
+	{
+		if (debugger && debugger->isWatchedIO(address, access)) hitWatchpoint(true, address, value, access);
+	}
+
+	int GetClockFrequency();
 
 	~Machine();
 
 private:
+	void WriteMemSlow(dword address, byte value);
+
+	byte ReadMemSlow(dword address);
+
+	/**
+	 * Maps 'size' bytes at 'offset' to 'data' (which holds 'data_size' valid bytes).
+	 * Pages past the valid bytes are mapped to 'fill', pages only partially
+	 * covered by the region are left to the slow path.
+	 */
+	void mapRegion(int offset, int size, byte* data, int data_size, byte* fill, byte flags);
+
+	/**
+	 * (Re)builds the whole memory map
+	 */
+	void mapMemory();
+
+	void mapRomPages();
+
+	void mapBootRomPages();
+
+	void mapFramebufferPages();
+
+	/**
+	 * Runs the CPU until cycle 'end' or until the machine stops
+	 */
+	void runSlice(uint64_t end);
+
+	/**
+	 * Fast-forwards a halted or busy-waiting CPU to the next event
+	 */
+	void skipIdle();
+
+	/**
+	 * Sleeps until the next input poll if a halted CPU can only be woken by the host
+	 */
+	void waitForHost();
+
+	/**
+	 * Services all events which are due
+	 */
+	void processEvents();
+
+	/**
+	 * Polls input and presents frames when their host time has come
+	 */
+	void serviceHost();
+
+	/**
+	 * Polls the host for keyboard/window events
+	 */
+	void handleInput();
+
+	/**
+	 * Brings the SGPU up to the current cycle
+	 */
+	void syncSGPU();
+
+	/**
+	 * Updates the SGPU completion event after its state may have changed
+	 */
+	void scheduleSGPU();
+
+	void scheduleTimer0();
+
+	/**
+	 * Captures the current screen
+	 */
+	void captureFrame();
+
+	/**
+	 * True for ports which only store the value written (and read it back),
+	 * so writing the current value again has no effect
+	 */
+	bool isLatchIO(dword address);
+
+	/**
+	 * Checks the per-instruction stop conditions (HALT, stop address)
+	 */
+	void checkStopConditions();
+
+	/**
+	 * Prints the activity since the last status line
+	 */
+	void printStatus();
+
+	/**
+	 * Writes the JSON document produced by 'write' to 'file' ("-" = stdout)
+	 */
+	void writeJSON(const string& file, void (Machine::*write)(ostream&));
+
+	void stop(int reason);
+
+	/**
+	 * Reports a watched access and breaks after the current instruction
+	 */
+	void hitWatchpoint(bool io, dword address, byte value, byte access);
+
+	/**
+	 * Ends the current slice and waits for commands, stops the
+	 * emulator if there is no command channel
+	 */
+	void debugBreak();
+
+	/**
+	 * Updates the page traps after breakpoints or watchpoints changed
+	 */
+	void applyTraps();
+
+	/**
+	 * Executes the commands received on the command channel
+	 */
+	void processCommands();
+
+	void handleCommand(const string& line);
+
+	/**
+	 * Waits for commands until execution is resumed
+	 */
+	void waitWhilePaused();
+
+	/**
+	 * Executes one instruction, ignoring a breakpoint at PC
+	 */
+	void step();
 
 	CPU* cpu;
 
 	string rom_name;
+	Options options;
 
 	byte zeropage[0x0100]; // 256 bytes of memory mapped from 0x0 to 0x00ff
 	byte ram[RAM_SIZE];
@@ -81,8 +284,15 @@ private:
 	int rom_size;
 	byte rom_page;
 
+	/* Memory bus */
+	MemoryMap memory_map;
+	byte unmapped_page[MEM_PAGE_SIZE]; // reads of unmapped or empty memory (0)
+	byte halt_page[MEM_PAGE_SIZE]; // reads past the end of a banked ROM (HALT)
+	byte sink_page[MEM_PAGE_SIZE]; // target of ignored writes
+
 	/* Simple graphics processing unit (SGPU) */
 	SGPU* sgpu;
+	SharedFrame shared_frame;
 
 	/* Keyboard */
 	byte* kbd_state;
@@ -92,11 +302,48 @@ private:
 	/* Timer 0 */
 	byte t0_ctrl;
 	dword t0_kcycles;
-	dword t0_kcycles_counted;
+	uint64_t t0_start; // cycle at which counting started
+
+	/* Frame capture */
+	Capture capture;
+	byte* capture_frame; // composited RGB332 frame
+	uint64_t next_capture; // cycle of the next capture
+
+	/* Profiling */
+	Profiler* profiler; // NULL = off
+	SymbolTable symbols;
+	Tracer* tracer; // NULL = off
+	Coverage* coverage; // NULL = off
+
+	/* Debugger */
+	Debugger* debugger; // NULL = off
+	bool paused; // waiting for commands
+	bool breakpoints_suspended; // executing the instruction at a breakpoint after resuming
+
+	/* Statistics */
+	uint64_t timer0_irqs; // interrupts requested by timer 0
+	struct
+	{
+		Uint64 counter; // SDL performance counter
+		uint64_t cycles, instructions, halted_cycles, sgpu_commands, irqs;
+	} last_status; // counters at the last status line
+	Uint32 next_status_ticks;
 
+	Scheduler scheduler;
+	Throttle throttle;
+	double speed; // 0 = unthrottled
+	uint64_t idle_cycles; // cycles skipped while halted
+	uint64_t loop_cycles; // cycles skipped in busy-wait loops
 	int clock_frequency;
-	timespec cycle_spec;
 	int running;
+	int exit_reason;
+	bool check_stop; // any per-instruction stop condition enabled
+	bool slice_done;
+	Uint32 start_ticks; // host time at start in ms
+	Uint64 start_counter; // SDL performance counter at start
+	uint64_t start_cycles; // cycle count at start (restored state)
+	Uint32 next_input_ticks, next_frame_ticks;
+	Uint32 frame_interval; // in ms, 0 = no presentation
 };
 
 static Machine* instance;
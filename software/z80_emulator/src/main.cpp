@@ -21,24 +21,21 @@
 
 int main(int argc, char* argv[])
 {
+	Options options;
+	int ret = parseOptions(argc, argv, &options);
+	if (ret) return ret > 0 ? 0 : -1;
+
 	cout << "Z80 Emulator starting" << endl << endl;
 
-	int ret = SDL_Init(SDL_INIT_EVERYTHING); // initialize SDL2
+	ret = SDL_Init(options.headless ? SDL_INIT_TIMER : SDL_INIT_EVERYTHING); // initialize SDL2
 	if (ret)
 	{
 		cerr << "Failed to initialize SDL2: " << SDL_GetError() << endl;
 		return -1;
 	}
 
-	string rom = "rom.bin"; // standard ROM name is 'rom.bin'
-
-	for (int i = 1; i < argc; i++) // i = 1, because i[0] is the application name
-	{
-		rom = argv[i];
-	}
-
 	Machine* machine = new Machine();
-	machine->setRomName(rom);
+	machine->setOptions(options);
 	if (machine->init())
 	{
 		cerr << "Failed to initialize machine" << endl;
@@ -53,5 +50,5 @@ int main(int argc, char* argv[])
 	delete machine;
 	SDL_Quit();
 
-	return 0;
+	return ret;
 }
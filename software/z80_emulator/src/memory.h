@@ -0,0 +1,55 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdafx.h>
+
+/* The 64 KiB address space is split into 256 pages of 256 bytes */
+#define MEM_PAGE_SHIFT 8
+#define MEM_PAGE_SIZE (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK (MEM_PAGE_SIZE - 1)
+#define MEM_PAGE_COUNT (0x10000 >> MEM_PAGE_SHIFT)
+
+/* Page flags */
+#define MEM_PAGE_READONLY 0x01		// ROM, writes are ignored
+#define MEM_PAGE_WRITE_IGNORE 0x02	// nothing mapped, reads return 0 and writes are ignored
+#define MEM_PAGE_MMIO 0x04			// writes are passed to a device handler
+
+/* Debugger traps, accesses to a page with traps take the slow path */
+#define MEM_TRAP_EXEC 0x01			// breakpoint in the page
+#define MEM_TRAP_READ 0x02			// read watchpoint in the page
+#define MEM_TRAP_WRITE 0x04			// write watchpoint in the page
+
+/**
+ * Page table of the memory bus. Each page points to the host
+ * memory backing it, so an access is a shift plus a load.
+ * A NULL pointer sends the access through Machine::ReadMem()/WriteMem()
+ * (device handlers, pages only partially covered by a region, debugger traps).
+ */
+struct MemoryMap
+{
+	byte* read[MEM_PAGE_COUNT];
+	byte* write[MEM_PAGE_COUNT];
+	byte flags[MEM_PAGE_COUNT];
+	byte traps[MEM_PAGE_COUNT]; // MEM_TRAP_*, pages with traps have no read (exec, read) or write (write) pointer
+};
+
+#endif // MEMORY_H
@@ -0,0 +1,309 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "options.h"
+#include "trace.h" // TRACE_DEFAULT_SIZE
+#include <cstdlib> // strtoull, strtod
+
+Options::Options()
+{
+	rom_name = "rom.bin"; // standard ROM name is 'rom.bin'
+	bootrom_name = BOOTROM_FILENAME;
+	headless = false;
+	max_cycles = 0;
+	max_time = 0;
+	stop_on_halt = false;
+	stop_pc = -1;
+	refresh = FRAME_FREQUENCY;
+	speed = -1; // real time with a window, unthrottled when headless
+	idle_skip = true;
+	sgpu_thread = false;
+	render_thread = false;
+	capture_interval = CLOCK_FREQUENCY / FRAME_FREQUENCY;
+	status_interval = 0;
+	trace_size = TRACE_DEFAULT_SIZE;
+}
+
+/**
+ * Parses an unsigned number (decimal, 0x... hexadecimal or $... hexadecimal)
+ */
+static bool parseNumber(const char* str, uint64_t* value)
+{
+	char* end;
+	if (str[0] == '$') *value = strtoull(str + 1, &end, 16);
+	else *value = strtoull(str, &end, 0);
+	return *str != 0 && *end == 0;
+}
+
+static bool hasValue(const string& arg)
+{
+	return arg == "--rom" || arg == "--bootrom" || arg == "--state-json"
+		|| arg == "--max-cycles" || arg == "--max-time" || arg == "--stop-pc"
+		|| arg == "--refresh" || arg == "--speed" || arg == "--capture" || arg == "--capture-interval"
+		|| arg == "--shm" || arg == "--stats-json" || arg == "--status"
+		|| arg == "--profile" || arg == "--profile-pc" || arg == "--symbols"
+		|| arg == "--trace" || arg == "--trace-size" || arg == "--coverage" || arg == "--coverage-listing"
+		|| arg == "--break" || arg == "--watch" || arg == "--watch-io" || arg == "--commands"
+		|| arg == "--save-state" || arg == "--load-state";
+}
+
+int parseOptions(int argc, char* argv[], Options* options)
+{
+	for (int i = 1; i < argc; i++) // i = 1, because i[0] is the application name
+	{
+		string arg = argv[i];
+		bool has_value = (i + 1) < argc;
+		uint64_t number;
+
+		if (arg == "-h" || arg == "--help")
+		{
+			printUsage(argv[0]);
+			return 1;
+		}
+		else if (arg == "--headless")
+		{
+			options->headless = true;
+		}
+		else if (arg == "--stop-on-halt")
+		{
+			options->stop_on_halt = true;
+		}
+		else if (arg == "--turbo")
+		{
+			options->speed = 0;
+		}
+		else if (arg == "--no-idle-skip")
+		{
+			options->idle_skip = false;
+		}
+		else if (arg == "--sgpu-thread")
+		{
+			options->sgpu_thread = true;
+		}
+		else if (arg == "--render-thread")
+		{
+			options->render_thread = true;
+		}
+		else if (arg.compare(0, 2, "--") != 0)
+		{
+			options->rom_name = arg;
+		}
+		else if (hasValue(arg) && !has_value)
+		{
+			cerr << "Missing value for option " << arg << endl;
+			return -1;
+		}
+		else if (arg == "--rom")
+		{
+			options->rom_name = argv[++i];
+		}
+		else if (arg == "--bootrom")
+		{
+			options->bootrom_name = argv[++i];
+		}
+		else if (arg == "--state-json")
+		{
+			options->state_file = argv[++i];
+		}
+		else if (arg == "--save-state")
+		{
+			options->save_state_file = argv[++i];
+		}
+		else if (arg == "--load-state")
+		{
+			options->load_state_file = argv[++i];
+		}
+		else if (arg == "--stats-json")
+		{
+			options->stats_file = argv[++i];
+		}
+		else if (arg == "--status")
+		{
+			char* end;
+			double seconds = strtod(argv[++i], &end);
+			if (*end != 0 || seconds < 0)
+			{
+				cerr << "Invalid time '" << argv[i] << "'" << endl;
+				return -1;
+			}
+			options->status_interval = (unsigned int)(seconds * 1000);
+		}
+		else if (arg == "--profile")
+		{
+			options->profile_file = argv[++i];
+		}
+		else if (arg == "--profile-pc")
+		{
+			options->profile_pc_file = argv[++i];
+		}
+		else if (arg == "--symbols")
+		{
+			options->symbols_file = argv[++i];
+		}
+		else if (arg == "--trace")
+		{
+			options->trace_file = argv[++i];
+		}
+		else if (arg == "--trace-size")
+		{
+			if (!parseNumber(argv[++i], &number) || number == 0 || number > 2048)
+			{
+				cerr << "Invalid trace size '" << argv[i] << "'" << endl;
+				return -1;
+			}
+			options->trace_size = (unsigned int)number;
+		}
+		else if (arg == "--coverage")
+		{
+			options->coverage_file = argv[++i];
+		}
+		else if (arg == "--coverage-listing")
+		{
+			options->coverage_listing_file = argv[++i];
+		}
+		else if (arg == "--break")
+		{
+			options->debug_commands.push_back(string("break ") + argv[++i]);
+		}
+		else if (arg == "--watch" || arg == "--watch-io")
+		{
+			string watch = argv[++i]; // <range>[:r|w|rw]
+			size_t colon = watch.find(':');
+			if (colon != string::npos) watch[colon] = ' ';
+			options->debug_commands.push_back(arg.substr(2) + " " + watch);
+		}
+		else if (arg == "--commands")
+		{
+			options->commands_file = argv[++i];
+		}
+		else if (arg == "--shm")
+		{
+			options->shm_name = argv[++i];
+		}
+		else if (arg == "--capture")
+		{
+			options->capture_name = argv[++i];
+		}
+		else if (arg == "--capture-interval")
+		{
+			if (!parseNumber(argv[++i], &number) || number == 0)
+			{
+				cerr << "Invalid capture interval '" << argv[i] << "'" << endl;
+				return -1;
+			}
+			options->capture_interval = number;
+		}
+		else if (arg == "--max-cycles")
+		{
+			if (!parseNumber(argv[++i], &number))
+			{
+				cerr << "Invalid cycle count '" << argv[i] << "'" << endl;
+				return -1;
+			}
+			options->max_cycles = number;
+		}
+		else if (arg == "--max-time")
+		{
+			char* end;
+			double seconds = strtod(argv[++i], &end);
+			if (*end != 0 || seconds < 0)
+			{
+				cerr << "Invalid time '" << argv[i] << "'" << endl;
+				return -1;
+			}
+			options->max_time = (unsigned int)(seconds * 1000);
+		}
+		else if (arg == "--stop-pc")
+		{
+			if (!parseNumber(argv[++i], &number) || number > 0xffff)
+			{
+				cerr << "Invalid address '" << argv[i] << "'" << endl;
+				return -1;
+			}
+			options->stop_pc = (int)number;
+		}
+		else if (arg == "--refresh")
+		{
+			if (!parseNumber(argv[++i], &number) || number > 1000)
+			{
+				cerr << "Invalid refresh rate '" << argv[i] << "'" << endl;
+				return -1;
+			}
+			options->refresh = (unsigned int)number;
+		}
+		else if (arg == "--speed")
+		{
+			char* end;
+			double speed = strtod(argv[++i], &end);
+			if (*end != 0 || speed <= 0)
+			{
+				cerr << "Invalid speed '" << argv[i] << "'" << endl;
+				return -1;
+			}
+			options->speed = speed;
+		}
+		else
+		{
+			cerr << "Unknown option " << arg << endl;
+			printUsage(argv[0]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void printUsage(const char* name)
+{
+	cout << "Usage: " << name << " [options] [rom]" << endl << endl;
+	cout << "  --rom <file>          ROM to load (default: rom.bin)" << endl;
+	cout << "  --bootrom <file>      BootROM to load (default: " << BOOTROM_FILENAME << ")" << endl;
+	cout << "  --headless            run without window (no SDL video/TTF)" << endl;
+	cout << "  --max-cycles <n>      stop after n CPU cycles" << endl;
+	cout << "  --max-time <seconds>  stop after the given wall time" << endl;
+	cout << "  --stop-on-halt        stop on HALT with interrupts disabled" << endl;
+	cout << "  --speed <factor>      run at a multiple of real time (e.g. 2 or 10)" << endl;
+	cout << "  --turbo               run as fast as possible" << endl;
+	cout << "  --no-idle-skip        execute busy-wait loops instead of skipping them" << endl;
+	cout << "  --sgpu-thread         execute SGPU fills on a worker thread" << endl;
+	cout << "                        (only status and IRQ timing is cycle accurate)" << endl;
+	cout << "  --refresh <hz>        frame presentation rate (default: " << FRAME_FREQUENCY << ", 0 = off)" << endl;
+	cout << "  --render-thread       upload and present frames on a separate thread" << endl;
+	cout << "  --stop-pc <addr>      stop when PC reaches addr" << endl;
+	cout << "  --state-json <file>   write the final machine state as JSON ('-' = stdout)" << endl;
+	cout << "  --save-state <file>   write a machine snapshot when the emulation stops" << endl;
+	cout << "  --load-state <file>   continue from a snapshot written by --save-state (same ROMs)" << endl;
+	cout << "  --stats-json <file>   write runtime statistics as JSON ('-' = stdout)" << endl;
+	cout << "  --status <seconds>    print a status line (MIPS, speed, activity) periodically" << endl;
+	cout << "  --profile <file>      write cycles per call stack in folded format (flamegraph.pl)" << endl;
+	cout << "  --profile-pc <file>   write instructions and cycles per PC" << endl;
+	cout << "  --symbols <file>      guest symbols for profiles (z80asm labels, listing or map file)" << endl;
+	cout << "  --trace <file>        record executed instructions, dumped to file on exit, HALT with" << endl;
+	cout << "                        interrupts disabled, illegal opcodes, DDS, SIGUSR1 and crashes" << endl;
+	cout << "  --trace-size <MiB>    size of the trace ring (default: " << TRACE_DEFAULT_SIZE << ")" << endl;
+	cout << "  --coverage <file>     write bitmaps of the executed, read and written bytes" << endl;
+	cout << "  --coverage-listing <file> write the coverage as annotated ranges" << endl;
+	cout << "  --break <addr>        stop before executing addr (address or symbol)" << endl;
+	cout << "  --watch <range>[:r|w|rw] stop after accesses to addr or first-last (default: w)" << endl;
+	cout << "  --watch-io <port>[:r|w|rw] stop after accesses to an I/O port (default: w)" << endl;
+	cout << "  --commands <file>     execute debugger commands from file, '-' = start paused and read stdin" << endl;
+	cout << "  --shm <name>          export framebuffers and TTY in POSIX shared memory (e.g. /z80emu0)" << endl;
+	cout << "  --capture <file>      capture frames to .ppm/.png files (e.g. frame%05d.png) or a .rgb/.y4m stream" << endl;
+	cout << "  --capture-interval <n> cycles between captured frames (default: " << CLOCK_FREQUENCY / FRAME_FREQUENCY << ")" << endl;
+	cout << "  -h, --help            show this help" << endl;
+}
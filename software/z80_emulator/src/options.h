@@ -0,0 +1,98 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <config.standard.h>
+#include <stdafx.h>
+#include <vector>
+
+/**
+ * Command line options of the emulator
+ */
+struct Options
+{
+	Options();
+
+	string rom_name;
+	string bootrom_name;
+
+	/* Batch execution */
+	bool headless; // run without window, renderer and fonts
+	uint64_t max_cycles; // 0 = unlimited
+	unsigned int max_time; // wall time in ms, 0 = unlimited
+	bool stop_on_halt; // stop on HALT with interrupts disabled
+	int stop_pc; // stop when reaching this address, -1 = disabled
+	string state_file; // final state dump (JSON), "-" = stdout
+
+	/* Save states */
+	string save_state_file; // machine snapshot written when the emulation stops, empty = none
+	string load_state_file; // machine snapshot restored before the emulation starts
+
+	/* Statistics */
+	string stats_file; // final statistics (JSON), "-" = stdout
+	unsigned int status_interval; // status line period in ms, 0 = off
+
+	/* Profiling */
+	string profile_file; // folded call stacks, empty = no profiling
+	string profile_pc_file; // per-PC instructions and cycles
+	string symbols_file; // guest symbols (label file, listing or map)
+
+	/* Execution trace */
+	string trace_file; // dump target of the trace ring, empty = no tracing
+	unsigned int trace_size; // ring size in MiB
+
+	/* Coverage */
+	string coverage_file; // bitmaps of executed/read/written bytes, empty = none
+	string coverage_listing_file; // the same as text, with symbols
+
+	/* Debugger */
+	vector<string> debug_commands; // from --break, --watch and --watch-io
+	string commands_file; // debugger commands, "-" = read stdin while running
+
+	/* Presentation */
+	unsigned int refresh; // frames per second, 0 = never present
+	bool render_thread; // upload and present on a separate thread
+
+	/* Shared memory export */
+	string shm_name; // POSIX shared memory segment, empty = no export
+
+	/* Frame capture */
+	string capture_name; // image sequence or stream, empty = no capture
+	uint64_t capture_interval; // in CPU cycles
+
+	/* Throttling */
+	double speed; // multiple of CLOCK_FREQUENCY, 0 = unthrottled, < 0 = default
+	bool idle_skip; // fast-forward busy-wait loops
+
+	/* SGPU */
+	bool sgpu_thread; // execute SGPU fills on a worker thread
+};
+
+/**
+ * Parses the command line into 'options'.
+ * Returns 0 on success, 1 if the usage has been printed
+ * and -1 on invalid arguments.
+ */
+int parseOptions(int argc, char* argv[], Options* options);
+
+void printUsage(const char* name);
+
+#endif // OPTIONS_H
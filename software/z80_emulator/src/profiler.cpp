@@ -0,0 +1,154 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "profiler.h"
+
+Profiler::Profiler()
+{
+	pc_instructions = new uint64_t[0x10000];
+	pc_cycles = new uint64_t[0x10000];
+	memset(pc_instructions, 0, 0x10000 * sizeof(uint64_t));
+	memset(pc_cycles, 0, 0x10000 * sizeof(uint64_t));
+	depth = 0;
+	node = 0;
+	halted_parent = -1;
+	halted_node = -1;
+	overflows = 0;
+	start(0, 0);
+}
+
+void Profiler::start(dword pc, dword sp)
+{
+	nodes.clear();
+	children.clear();
+	Node root = { pc, PROFILER_NODE_CALL, -1, 0 };
+	nodes.push_back(root);
+	stack[0].node = 0;
+	stack[0].sp = sp;
+	depth = 1;
+	node = 0;
+	halted_parent = -1;
+}
+
+void Profiler::addCycles(dword pc, uint64_t cycles, bool halted)
+{
+	pc_cycles[pc] += cycles;
+	if (!halted)
+	{
+		nodes[node].cycles += cycles;
+		return;
+	}
+
+	if (halted_parent != node)
+	{
+		halted_node = getChild(node, 0, PROFILER_NODE_HALTED);
+		halted_parent = node;
+	}
+	nodes[halted_node].cycles += cycles;
+}
+
+void Profiler::enter(dword target, dword sp, int kind)
+{
+	if (depth == PROFILER_MAX_DEPTH)
+	{
+		overflows++;
+		return;
+	}
+
+	node = getChild(node, target, kind);
+	stack[depth].node = node;
+	stack[depth].sp = sp;
+	depth++;
+}
+
+void Profiler::leave(dword sp)
+{
+	/* Leave every frame below the new stack pointer, this also unwinds frames left without RET */
+	while (depth > 1 && stack[depth - 1].sp < sp)
+		depth--;
+	node = stack[depth - 1].node;
+}
+
+int Profiler::getChild(int parent, dword address, int kind)
+{
+	uint64_t key = ((uint64_t)parent << 24) | ((uint64_t)kind << 16) | address;
+	map<uint64_t, int>::iterator it = children.find(key);
+	if (it != children.end()) return it->second;
+
+	Node child = { address, kind, parent, 0 };
+	nodes.push_back(child);
+	children[key] = (int)nodes.size() - 1;
+	return (int)nodes.size() - 1;
+}
+
+string Profiler::getNodeName(const Node& node, SymbolTable& symbols)
+{
+	if (node.kind == PROFILER_NODE_HALTED) return "[halted]";
+	if (node.kind == PROFILER_NODE_IRQ) return "irq:" + symbols.getName(node.address);
+	return symbols.getName(node.address);
+}
+
+int Profiler::writeFolded(const string& file_name, SymbolTable& symbols)
+{
+	ofstream out(file_name.c_str());
+	if (!out.is_open())
+	{
+		cerr << "Unable to write profile to '" << file_name << "'" << endl;
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < nodes.size(); i++)
+	{
+		if (nodes[i].cycles == 0) continue;
+
+		string stack_names = getNodeName(nodes[i], symbols);
+		for (int parent = nodes[i].parent; parent >= 0; parent = nodes[parent].parent)
+			stack_names = getNodeName(nodes[parent], symbols) + ";" + stack_names;
+		out << stack_names << " " << dec << nodes[i].cycles << endl;
+	}
+
+	if (overflows)
+		cerr << "Profiler: " << dec << overflows << " calls deeper than " << PROFILER_MAX_DEPTH << " frames were not tracked" << endl;
+	return 0;
+}
+
+int Profiler::writeFlat(const string& file_name, SymbolTable& symbols)
+{
+	ofstream out(file_name.c_str());
+	if (!out.is_open())
+	{
+		cerr << "Unable to write profile to '" << file_name << "'" << endl;
+		return -1;
+	}
+
+	out << "# address\tsymbol\tinstructions\tcycles" << endl;
+	for (int pc = 0; pc < 0x10000; pc++)
+	{
+		if (pc_cycles[pc] == 0) continue;
+		out << hex << setfill('0') << "0x" << setw(4) << pc << setfill(' ') << dec << "\t" << symbols.describe((dword)pc)
+			<< "\t" << pc_instructions[pc] << "\t" << pc_cycles[pc] << endl;
+	}
+	return 0;
+}
+
+Profiler::~Profiler()
+{
+	delete[] pc_instructions;
+	delete[] pc_cycles;
+}
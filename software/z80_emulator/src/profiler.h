@@ -0,0 +1,121 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdafx.h>
+#include <map>
+#include <vector>
+#include "symbols.h"
+
+#define PROFILER_MAX_DEPTH 256 // deeper calls are attributed to the deepest tracked frame
+
+/* Kinds of call tree nodes */
+#define PROFILER_NODE_CALL 0	// CALL or RST
+#define PROFILER_NODE_IRQ 1		// interrupt entry
+#define PROFILER_NODE_HALTED 2	// cycles spent halted in the parent
+
+/**
+ * Guest profiler counting every instruction (no sampling). Instructions
+ * and T-states are accumulated per PC and per node of a call tree, which
+ * follows CALL/RST/IRQ entries and returns by the stack pointer.
+ */
+class Profiler
+{
+public:
+	Profiler();
+
+	/**
+	 * Starts at 'pc' with the stack pointer 'sp', the root frame is named after 'pc'
+	 */
+	void start(dword pc, dword sp);
+
+	/**
+	 * Accounts an executed instruction
+	 */
+	inline void count(dword pc, unsigned int cycles)
+	{
+		pc_instructions[pc]++;
+		pc_cycles[pc] += cycles;
+		nodes[node].cycles += cycles;
+	}
+
+	/**
+	 * Accounts cycles without executed instructions (halted or skipped idle loop iterations)
+	 */
+	void addCycles(dword pc, uint64_t cycles, bool halted);
+
+	/**
+	 * A call to 'target' has been made, 'sp' is the stack pointer after pushing the return address
+	 */
+	void enter(dword target, dword sp, int kind);
+
+	/**
+	 * A return has popped the stack up to 'sp'
+	 */
+	void leave(dword sp);
+
+	/**
+	 * Writes one line per call stack with the T-states spent in its innermost
+	 * frame ("main;draw;fill 1234"), as accepted by flamegraph.pl and speedscope
+	 */
+	int writeFolded(const string& file_name, SymbolTable& symbols);
+
+	/**
+	 * Writes address, symbol, instructions and T-states of every executed PC
+	 */
+	int writeFlat(const string& file_name, SymbolTable& symbols);
+
+	~Profiler();
+
+private:
+	struct Node
+	{
+		dword address; // call target
+		int kind; // PROFILER_NODE_*
+		int parent; // -1 for the root
+		uint64_t cycles; // spent in this frame itself
+	};
+
+	struct Frame
+	{
+		int node;
+		dword sp; // stack pointer inside the frame, returning above it leaves the frame
+	};
+
+	/**
+	 * Index of the child of 'parent', created on first use
+	 */
+	int getChild(int parent, dword address, int kind);
+
+	string getNodeName(const Node& node, SymbolTable& symbols);
+
+	uint64_t* pc_instructions;
+	uint64_t* pc_cycles;
+	vector<Node> nodes;
+	map<uint64_t, int> children; // (parent, kind, address) -> node
+	Frame stack[PROFILER_MAX_DEPTH];
+	int depth; // number of frames on 'stack'
+	int node; // node of the innermost frame
+	int halted_parent, halted_node; // last PROFILER_NODE_HALTED child looked up
+	unsigned int overflows; // calls beyond PROFILER_MAX_DEPTH
+};
+
+#endif // PROFILER_H
@@ -0,0 +1,277 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "savestate.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h> // _open, _read
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static void putLE(byte* dst, uint64_t value, int size)
+{
+	for (int i = 0; i < size; i++)
+		dst[i] = (byte)(value >> (i * 8));
+}
+
+static uint64_t getLE(const byte* src, int size)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < size; i++)
+		value |= (uint64_t)src[i] << (i * 8);
+	return value;
+}
+
+StateWriter::StateWriter()
+{
+	data.resize(STATE_HEADER_SIZE);
+	section_start = 0;
+	section_count = 0;
+}
+
+void StateWriter::beginSection(uint32_t id)
+{
+	section_start = data.size();
+	data.resize(section_start + STATE_SECTION_HEADER_SIZE);
+	putLE(&data[section_start], id, 4);
+}
+
+void StateWriter::endSection()
+{
+	putLE(&data[section_start + 4], data.size() - section_start - STATE_SECTION_HEADER_SIZE, 4);
+	section_count++;
+}
+
+void StateWriter::put8(byte value)
+{
+	data.push_back(value);
+}
+
+void StateWriter::put16(dword value)
+{
+	size_t at = data.size();
+	data.resize(at + 2);
+	putLE(&data[at], value, 2);
+}
+
+void StateWriter::put32(uint32_t value)
+{
+	size_t at = data.size();
+	data.resize(at + 4);
+	putLE(&data[at], value, 4);
+}
+
+void StateWriter::put64(uint64_t value)
+{
+	size_t at = data.size();
+	data.resize(at + 8);
+	putLE(&data[at], value, 8);
+}
+
+void StateWriter::putBytes(const void* bytes, size_t size)
+{
+	data.insert(data.end(), (const byte*)bytes, (const byte*)bytes + size);
+}
+
+int StateWriter::write(const string& file_name)
+{
+	memcpy(&data[0], STATE_MAGIC, 8);
+	putLE(&data[8], STATE_VERSION, 2);
+	putLE(&data[10], 0, 2);
+	putLE(&data[12], section_count, 4);
+
+	ofstream out(file_name.c_str(), ofstream::out | ofstream::binary | ofstream::trunc);
+	if (!out.is_open() || !out.write((const char*)&data[0], data.size()))
+	{
+		cerr << "Unable to write state to '" << file_name << "'" << endl;
+		return -1;
+	}
+	return 0;
+}
+
+StateReader::StateReader()
+{
+	data = NULL;
+	size = 0;
+	mapped = false;
+	version = 0;
+	section_count = 0;
+	pos = NULL;
+	end = NULL;
+	error = false;
+}
+
+int StateReader::open(const string& file_name)
+{
+	close();
+	int fd = ::open(file_name.c_str(), O_RDONLY | O_BINARY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0)
+	{
+		cerr << "Unable to open state '" << file_name << "'" << endl;
+		if (fd >= 0) ::close(fd);
+		return -1;
+	}
+	size = (size_t)info.st_size;
+
+	if (size >= STATE_HEADER_SIZE)
+	{
+#ifdef _WIN32
+		buffer.resize(size);
+		size_t done = 0;
+		while (done < size)
+		{
+			int count = _read(fd, &buffer[done], (unsigned int)(size - done));
+			if (count <= 0) break;
+			done += count;
+		}
+		if (done == size) data = &buffer[0];
+#else
+		void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping != MAP_FAILED)
+		{
+			data = (const byte*)mapping;
+			mapped = true;
+		}
+#endif
+	}
+	::close(fd); // the mapping stays valid
+
+	if (!data || memcmp(data, STATE_MAGIC, 8) != 0)
+	{
+		cerr << "'" << file_name << "' is not a state file" << endl;
+		close();
+		return -1;
+	}
+	version = (uint16_t)getLE(data + 8, 2);
+	section_count = (uint32_t)getLE(data + 12, 4);
+	if (version == 0 || version > STATE_VERSION)
+	{
+		cerr << "Unsupported state version " << dec << version << " in '" << file_name << "'" << endl;
+		close();
+		return -1;
+	}
+	return 0;
+}
+
+int StateReader::openSection(uint32_t id)
+{
+	size_t offset = STATE_HEADER_SIZE;
+	for (uint32_t i = 0; i < section_count && offset + STATE_SECTION_HEADER_SIZE <= size; i++)
+	{
+		uint32_t section_id = (uint32_t)getLE(data + offset, 4);
+		size_t section_size = (size_t)getLE(data + offset + 4, 4);
+		offset += STATE_SECTION_HEADER_SIZE;
+		if (section_size > size - offset) break; // truncated
+		if (section_id == id)
+		{
+			pos = data + offset;
+			end = pos + section_size;
+			return 0;
+		}
+		offset += section_size;
+	}
+	pos = NULL;
+	end = NULL;
+	return -1;
+}
+
+const byte* StateReader::take(size_t count)
+{
+	if (!pos || (size_t)(end - pos) < count)
+	{
+		error = true;
+		return NULL;
+	}
+	const byte* p = pos;
+	pos += count;
+	return p;
+}
+
+byte StateReader::get8()
+{
+	const byte* p = take(1);
+	return p ? *p : 0;
+}
+
+dword StateReader::get16()
+{
+	const byte* p = take(2);
+	return p ? (dword)getLE(p, 2) : 0;
+}
+
+uint32_t StateReader::get32()
+{
+	const byte* p = take(4);
+	return p ? (uint32_t)getLE(p, 4) : 0;
+}
+
+uint64_t StateReader::get64()
+{
+	const byte* p = take(8);
+	return p ? getLE(p, 8) : 0;
+}
+
+void StateReader::getBytes(void* bytes, size_t count)
+{
+	const byte* p = take(count);
+	if (p) memcpy(bytes, p, count);
+	else memset(bytes, 0, count);
+}
+
+bool StateReader::hasError()
+{
+	return error;
+}
+
+uint16_t StateReader::getVersion()
+{
+	return version;
+}
+
+size_t StateReader::getSize()
+{
+	return size;
+}
+
+void StateReader::close()
+{
+#ifndef _WIN32
+	if (mapped) munmap((void*)data, size);
+#endif
+	buffer.clear();
+	data = NULL;
+	size = 0;
+	mapped = false;
+	pos = NULL;
+	end = NULL;
+	error = false;
+}
+
+StateReader::~StateReader()
+{
+	close();
+}
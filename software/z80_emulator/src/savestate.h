@@ -0,0 +1,138 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stdafx.h>
+#include <vector>
+
+/*
+ * State file layout (little endian):
+ *   header: "Z80STATE", u16 version, u16 flags (0), u32 section count
+ *   sections: u32 id, u32 size, data
+ * Sections may grow in later versions by appending fields, readers
+ * ignore bytes past the fields they know and missing sections.
+ */
+#define STATE_MAGIC "Z80STATE"
+#define STATE_VERSION 1
+#define STATE_HEADER_SIZE 16
+#define STATE_SECTION_HEADER_SIZE 8
+
+/* Sections */
+#define STATE_SECTION_MACHINE 1		// ROM identity, bank registers, timer 0, keyboard
+#define STATE_SECTION_CPU 2			// registers and interrupt state
+#define STATE_SECTION_MEMORY 3		// zeropage and RAM
+#define STATE_SECTION_SGPU 4		// registers, command buffer, running command, object memory
+#define STATE_SECTION_FRAMEBUFFERS 5
+#define STATE_SECTION_TTY 6
+
+/**
+ * Collects the sections of a state file in memory and writes them at once
+ */
+class StateWriter
+{
+public:
+	StateWriter();
+
+	void beginSection(uint32_t id);
+
+	void endSection();
+
+	void put8(byte value);
+
+	void put16(dword value);
+
+	void put32(uint32_t value);
+
+	void put64(uint64_t value);
+
+	void putBytes(const void* data, size_t size);
+
+	/**
+	 * Writes the header and all sections, returns -1 on errors
+	 */
+	int write(const string& file_name);
+
+private:
+	vector<byte> data;
+	size_t section_start; // offset of the open section's header
+	uint32_t section_count;
+};
+
+/**
+ * Maps a state file and reads its sections in place. Reads past the end
+ * of a section return 0 and set the error flag.
+ */
+class StateReader
+{
+public:
+	StateReader();
+
+	/**
+	 * Maps 'file_name' and checks its header, returns -1 on errors
+	 */
+	int open(const string& file_name);
+
+	/**
+	 * Continues reading at the start of section 'id', returns -1 if it is missing
+	 */
+	int openSection(uint32_t id);
+
+	byte get8();
+
+	dword get16();
+
+	uint32_t get32();
+
+	uint64_t get64();
+
+	void getBytes(void* data, size_t size);
+
+	/**
+	 * True if a read went past the end of its section
+	 */
+	bool hasError();
+
+	uint16_t getVersion();
+
+	size_t getSize();
+
+	void close();
+
+	~StateReader();
+
+private:
+	/**
+	 * Returns the next 'size' bytes of the section or NULL if there are less left
+	 */
+	const byte* take(size_t size);
+
+	const byte* data;
+	size_t size;
+	bool mapped; // data is a file mapping, otherwise owned by 'buffer'
+	vector<byte> buffer;
+	uint16_t version;
+	uint32_t section_count;
+	const byte* pos; // read position in the current section
+	const byte* end;
+	bool error;
+};
+
+#endif // SAVESTATE_H
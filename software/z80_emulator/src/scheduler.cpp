@@ -0,0 +1,78 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "scheduler.h"
+
+Scheduler::Scheduler()
+{
+	for (int i = 0; i < EVENT_COUNT; i++)
+		deadlines[i] = EVENT_NEVER;
+	next_deadline = EVENT_NEVER;
+}
+
+void Scheduler::schedule(int event, uint64_t deadline)
+{
+	deadlines[event] = deadline;
+	if (deadline < next_deadline) next_deadline = deadline;
+	else updateNextDeadline();
+}
+
+void Scheduler::cancel(int event)
+{
+	deadlines[event] = EVENT_NEVER;
+	updateNextDeadline();
+}
+
+bool Scheduler::isScheduled(int event)
+{
+	return deadlines[event] != EVENT_NEVER;
+}
+
+uint64_t Scheduler::getDeadline(int event)
+{
+	return deadlines[event];
+}
+
+int Scheduler::popDueEvent(uint64_t now)
+{
+	if (now < next_deadline) return -1;
+
+	for (int i = 0; i < EVENT_COUNT; i++)
+	{
+		if (deadlines[i] <= now)
+		{
+			cancel(i);
+			return i;
+		}
+	}
+	return -1;
+}
+
+void Scheduler::updateNextDeadline()
+{
+	next_deadline = EVENT_NEVER;
+	for (int i = 0; i < EVENT_COUNT; i++)
+	{
+		if (deadlines[i] < next_deadline) next_deadline = deadlines[i];
+	}
+}
+
+Scheduler::~Scheduler()
+{
+}
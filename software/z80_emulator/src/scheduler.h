@@ -0,0 +1,79 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdafx.h>
+
+/* Events */
+#define EVENT_TIMER0 0	// timer 0 expires
+#define EVENT_SGPU 1	// SGPU command completes
+#define EVENT_SLICE 2	// end of the current emulation slice
+#define EVENT_LIMIT 3	// cycle budget exhausted
+#define EVENT_CAPTURE 4	// next frame capture
+#define EVENT_COUNT 5
+
+#define EVENT_NEVER UINT64_MAX
+
+/**
+ * Keeps the deadlines (in CPU cycles) of timed device events,
+ * so devices only need to be serviced when one of them passed.
+ */
+class Scheduler
+{
+public:
+	Scheduler();
+
+	/**
+	 * Schedules 'event' at cycle 'deadline', replacing
+	 * a previous deadline of the same event
+	 */
+	void schedule(int event, uint64_t deadline);
+
+	void cancel(int event);
+
+	bool isScheduled(int event);
+
+	uint64_t getDeadline(int event);
+
+	/**
+	 * Cycle at which the earliest event is due
+	 */
+	inline uint64_t getNextDeadline()
+	{
+		return next_deadline;
+	}
+
+	/**
+	 * Unschedules and returns an event due at cycle 'now'
+	 * or -1 if there is none
+	 */
+	int popDueEvent(uint64_t now);
+
+	~Scheduler();
+
+private:
+	void updateNextDeadline();
+
+	uint64_t deadlines[EVENT_COUNT];
+	uint64_t next_deadline;
+};
+
+#endif // SCHEDULER_H
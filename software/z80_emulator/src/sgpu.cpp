@@ -18,17 +18,81 @@
 */
 
 #include "sgpu.h"
-#include "endian.h"
+#include "wrappers.h"
+#include "savestate.h"
 #include <config.standard.h>
 
 SGPU::SGPU(int addr)
 {
 	this->addr = addr;
 	framebuffer_page = 0;
+	mode = 0;
+	window_start = 0;
+	window_size = FB_N_SIZE;
 	framebuffer_changed = false;
+	line_dirty = NULL;
+	synced_cycles = 0;
+	window = NULL;
+	renderer = NULL;
+	fb0_texture = NULL;
+	default_font = NULL;
+	glyph_atlas = NULL;
+	tty_tex = NULL;
+	glyph_width = 0;
+	glyph_height = 0;
+	tty_buffer = NULL;
+	tty_dirty = NULL;
+	for (int i = 0; i < SGPU_FB_COUNT; i++)
+		framebuffers[i] = NULL;
+	front = 0;
+	framebuffer0 = NULL;
+	front_buffer = NULL;
+	cmd_tmp = 0;
+	memset(&cmd, 0, sizeof(cmd));
+	ring_base = 0;
+	ring_head = 0;
+	ring_tail = 0;
+	memset(ring_entry, 0, sizeof(ring_entry));
+	irq_reg = 0;
+	irq_raised = false;
+	memset(&stats, 0, sizeof(stats));
+	obj_mem = NULL;
+	obj_addr = 0;
+	obj_ctrl = 0;
+	tile_key = 0;
+	tile_scroll_x = 0;
+	tile_scroll_y = 0;
+	memory_map = NULL;
+	shared = NULL;
+	worker = NULL;
+	worker_job = NULL;
+	worker_done = NULL;
+	worker_busy = false;
+	worker_quit = false;
+	for (int i = 0; i < RENDER_FRAME_COUNT; i++)
+	{
+		frames[i].pixels = NULL;
+		frames[i].tty = NULL;
+		frames[i].tty_end = 0;
+	}
+	frame_back = 0;
+	frame_front = 1;
+	SDL_AtomicSet(&frame_middle, 2);
+	render_thread = NULL;
+	render_wake = NULL;
+	render_started = NULL;
+	render_status = 0;
+	render_quit = false;
+	render_full = true;
+	shown_pixels = NULL;
+	shown_tty = NULL;
+	shown_tty_dirty = NULL;
+	capture_glyphs = NULL;
+	capture_cell_width = 0;
+	capture_cell_height = 0;
 }
 
-int SGPU::init(int width, int height)
+int SGPU::init(int width, int height, bool render_thread)
 {
 	/* Window initialization */
 	window = SDL_CreateWindow(WINDOW_TITLE, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height, 0);
@@ -38,13 +102,6 @@ int SGPU::init(int width, int height)
 		return -1;
 	}
 
-	/* Framebuffer stuff */
-	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-	fb0_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB332, SDL_TEXTUREACCESS_STREAMING, FB_WIDTH, FB_HEIGHT);
-
-	/* Command buffer initalization */
-	memset(&cmd_buf, 0, sizeof(cmd_buf));
-
 	/* Console (tty) initialization */
 	if (TTF_Init() == -1)
 	{
@@ -59,10 +116,112 @@ int SGPU::init(int width, int height)
 		return -1;
 	}
 
+	if (initBuffers()) return -1;
+	if (render_thread) return startRenderThread();
+	return initRenderer();
+}
+
+int SGPU::initRenderer()
+{
+	/* Framebuffer stuff */
+	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+	fb0_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB332, SDL_TEXTUREACCESS_STREAMING, FB_WIDTH, FB_HEIGHT);
+	if (!renderer || !fb0_texture)
+	{
+		cerr << "Failed to create renderer: " << SDL_GetError() << endl;
+		return -1;
+	}
+
+	return initConsole();
+}
+
+void SGPU::destroyRenderer()
+{
+	if (glyph_atlas) SDL_DestroyTexture(glyph_atlas);
+	if (tty_tex) SDL_DestroyTexture(tty_tex);
+	if (fb0_texture) SDL_DestroyTexture(fb0_texture);
+	if (renderer) SDL_DestroyRenderer(renderer);
+	glyph_atlas = NULL;
+	tty_tex = NULL;
+	fb0_texture = NULL;
+	renderer = NULL;
+}
+
+int SGPU::startRenderThread()
+{
+	int fb_size = FB_WIDTH * FB_HEIGHT;
+	for (int i = 0; i < RENDER_FRAME_COUNT; i++)
+	{
+		frames[i].pixels = new byte[fb_size];
+		frames[i].tty = new char[tty_size];
+		memset(frames[i].pixels, 0, fb_size);
+		memcpy(frames[i].tty, tty_buffer, tty_size);
+		frames[i].tty_end = tty_end;
+	}
+	shown_pixels = new byte[fb_size];
+	shown_tty = new char[tty_size];
+	shown_tty_dirty = new bool[tty_size];
+	memset(shown_tty_dirty, 0, tty_size * sizeof(bool));
+
+	render_wake = SDL_CreateSemaphore(0);
+	render_started = SDL_CreateSemaphore(0);
+	if (render_wake && render_started)
+		render_thread = SDL_CreateThread(renderMain, "Render", this);
+	if (!render_thread)
+	{
+		cerr << "Failed to start render thread: " << SDL_GetError() << endl;
+		return -1;
+	}
+
+	/* The renderer is created by the thread that uses it */
+	SDL_SemWait(render_started);
+	if (render_status)
+	{
+		SDL_WaitThread(render_thread, NULL);
+		render_thread = NULL;
+	}
+	return render_status;
+}
+
+int SGPU::renderMain(void* data)
+{
+	SGPU* sgpu = (SGPU*)data;
+	sgpu->render_status = sgpu->initRenderer();
+	SDL_SemPost(sgpu->render_started);
+	if (sgpu->render_status) return sgpu->render_status;
+
+	while (true)
+	{
+		SDL_SemWait(sgpu->render_wake);
+		if (sgpu->render_quit) break;
+		if (!(SDL_AtomicGet(&sgpu->frame_middle) & RENDER_FRAME_FRESH)) continue; // already presented
+
+		/* Swap the presented frame with the latest one */
+		sgpu->frame_front = SDL_AtomicSet(&sgpu->frame_middle, sgpu->frame_front) & ~RENDER_FRAME_FRESH;
+		sgpu->presentFrame(sgpu->frame_front);
+	}
+
+	sgpu->destroyRenderer();
+	return 0;
+}
+
+int SGPU::initHeadless()
+{
+	cout << "SGPU running headless" << endl;
+	return initBuffers();
+}
+
+int SGPU::initBuffers()
+{
+	/* Command buffer initalization */
+	memset(&cmd_buf, 0, sizeof(cmd_buf));
+
 	tty_index = 0;
+	cursor_x = 0;
+	cursor_y = 0;
 	tty_size = TTY_WIDTH * TTY_HEIGHT;
 	tty_changed = false;
-	tty_buffer = new char[tty_size + 1];
+	tty_buffer = shared ? shared->getConsole() : new char[tty_size + 1];
 	if (!tty_buffer)
 	{
 		cerr << "Failed to allocate buffer for console" << endl;
@@ -70,34 +229,162 @@ int SGPU::init(int width, int height)
 	}
 	memset(tty_buffer, ' ', tty_size * sizeof(char));
 	tty_buffer[tty_size] = 0;
+	tty_end = tty_size;
 
+	tty_dirty = new bool[tty_size];
+	memset(tty_dirty, 0, tty_size * sizeof(bool));
+
+	obj_mem = new byte[SGPU_OBJ_MEM_SIZE];
+	memset(obj_mem, 0, SGPU_OBJ_MEM_SIZE);
+
+	return 0;
+}
+
+/**
+ * Stores the cell size of the console glyphs of 'font', returns -1 if it has none
+ */
+static int getGlyphSize(TTF_Font* font, int* width, int* height)
+{
+	*height = TTF_FontHeight(font);
+	*width = 0;
+	for (int i = 0; i < TTY_GLYPH_COUNT; i++)
+	{
+		int advance = 0;
+		if (TTF_GlyphMetrics(font, TTY_GLYPH_FIRST + i, NULL, NULL, NULL, NULL, &advance) == 0)
+			*width = max(*width, advance);
+	}
+	if (*width <= 0 || *height <= 0)
+	{
+		cerr << "Default font has no usable glyphs" << endl;
+		return -1;
+	}
+	return 0;
+}
+
+int SGPU::initConsole()
+{
+	if (getGlyphSize(default_font, &glyph_width, &glyph_height)) return -1;
+
+	/* Rasterize all glyphs once, side by side */
+	SDL_Surface* atlas = SDL_CreateRGBSurfaceWithFormat(0, glyph_width * TTY_GLYPH_COUNT, glyph_height, 32, SDL_PIXELFORMAT_ARGB8888);
+	if (!atlas)
+	{
+		cerr << "Failed to create glyph atlas: " << SDL_GetError() << endl;
+		return -1;
+	}
+
+	SDL_Color white = {255, 255, 255, 255};
+	for (int i = 0; i < TTY_GLYPH_COUNT; i++)
+	{
+		SDL_Surface* glyph = TTF_RenderGlyph_Blended(default_font, TTY_GLYPH_FIRST + i, white);
+		if (!glyph) continue;
+
+		SDL_Rect src = { 0, 0, min(glyph->w, glyph_width), min(glyph->h, glyph_height) };
+		SDL_Rect dst = { i * glyph_width, 0, src.w, src.h };
+		SDL_SetSurfaceBlendMode(glyph, SDL_BLENDMODE_NONE); // keep the glyph's alpha
+		SDL_BlitSurface(glyph, &src, atlas, &dst);
+		SDL_FreeSurface(glyph);
+	}
+
+	glyph_atlas = SDL_CreateTextureFromSurface(renderer, atlas);
+	SDL_FreeSurface(atlas);
+	tty_tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET,
+		TTY_WIDTH * glyph_width, TTY_HEIGHT * glyph_height);
+	if (!glyph_atlas || !tty_tex)
+	{
+		cerr << "Failed to create console textures: " << SDL_GetError() << endl;
+		return -1;
+	}
+	SDL_SetTextureBlendMode(glyph_atlas, SDL_BLENDMODE_NONE); // cells are replaced, not blended
+	SDL_SetTextureBlendMode(tty_tex, SDL_BLENDMODE_BLEND);
+
+	/* Start with a transparent console */
+	SDL_SetRenderTarget(renderer, tty_tex);
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+	SDL_RenderClear(renderer);
+	SDL_SetRenderTarget(renderer, NULL);
 
 	return 0;
 }
 
 int SGPU::initFB0(int width, int height)
 {
-	framebuffer0 = new byte[width * height];
+	for (int i = 0; i < SGPU_FB_COUNT; i++)
+	{
+		framebuffers[i] = shared ? shared->getFramebuffer(i) : new byte[width * height];
+		memset(framebuffers[i], 0, width * height);
+	}
 	fb0_width = width;
 	fb0_height = height;
-	memset(framebuffer0, 0, width * height);
+	updateBuffers();
+
+	line_dirty = new bool[height];
+	markDirty(0, width * height); // the texture content is undefined
 	return 1;
 }
 
+int SGPU::startWorker()
+{
+	worker_job = SDL_CreateSemaphore(0);
+	worker_done = SDL_CreateSemaphore(0);
+	if (worker_job && worker_done)
+		worker = SDL_CreateThread(workerMain, "SGPU", this);
+
+	if (!worker)
+	{
+		cerr << "Failed to start SGPU worker, executing commands inline: " << SDL_GetError() << endl;
+		return -1;
+	}
+	return 0;
+}
+
+void SGPU::setSharedFrame(SharedFrame* shared)
+{
+	this->shared = shared;
+}
+
+void SGPU::setMemoryMap(MemoryMap* memory_map)
+{
+	this->memory_map = memory_map;
+}
+
+int SGPU::workerMain(void* data)
+{
+	SGPU* sgpu = (SGPU*)data;
+	while (true)
+	{
+		SDL_SemWait(sgpu->worker_job);
+		if (sgpu->worker_quit) break;
+
+		memset(sgpu->framebuffer0 + sgpu->cmd.addr, sgpu->cmd.value, sgpu->cmd.size);
+		SDL_SemPost(sgpu->worker_done);
+	}
+	return 0;
+}
+
+void SGPU::waitForWorker()
+{
+	if (!worker_busy) return;
+	SDL_SemWait(worker_done);
+	worker_busy = false;
+}
+
 void SGPU::writeFB(dword page_addr, byte value)
 {
-	int fb_addr = (framebuffer_page * FB_N_SIZE + page_addr) - addr;
-	framebuffer_changed = true;
-	if (fb_addr <= (FB_WIDTH * FB_HEIGHT))
+	unsigned int fb_addr = window_start + (page_addr - addr);
+	waitForWorker();
+	if (fb_addr < (FB_WIDTH * FB_HEIGHT))
 	{
 		framebuffer0[fb_addr] = value;
+		markDrawn(fb_addr, 1);
 	}
 }
 
 byte SGPU::readFB(dword page_addr)
 {
-	int fb_addr = (framebuffer_page * FB_N_SIZE + page_addr) - addr;
-	if (fb_addr <= (FB_WIDTH * FB_HEIGHT))
+	unsigned int fb_addr = window_start + (page_addr - addr);
+	waitForWorker();
+	if (fb_addr < (FB_WIDTH * FB_HEIGHT))
 	{
 		return framebuffer0[fb_addr];
 	}
@@ -111,6 +398,13 @@ void SGPU::writeIO(byte port, byte value)
 	{
 		case SGPU_FB_PAGE_NUMBER:
 			framebuffer_page = value;
+			updateWindow();
+			break;
+		case _SGPU_MODE:
+			waitForWorker(); // the draw buffer may change
+			mode = value & ((1 << SGPU_MODE_APERTURE) | (1 << SGPU_MODE_DOUBLE_BUFFER));
+			updateWindow();
+			updateBuffers();
 			break;
 		case _SGPU_CMD_BUF_ADDR:
 			cmd_buf_addr = value;
@@ -118,6 +412,21 @@ void SGPU::writeIO(byte port, byte value)
 		case _SGPU_CMD_BUF_VALUE:
 			cmd_buf.data[cmd_buf_addr & 0xff] = value & 0xff;
 			break;
+		case _SGPU_RING_BASE:
+			ring_base = value; // may only be changed while the ring is empty
+			ring_head = 0;
+			ring_tail = 0;
+			break;
+		case _SGPU_RING_HEAD:
+			if (ring_base) ring_head = value & ~(SGPU_RING_ENTRY_SIZE - 1);
+			break;
+		case _SGPU_IRQ:
+		{
+			byte status = irq_reg & ~value & 0xf0; // written 1 clears a status bit
+			irq_reg = status | (value & ((1 << SGPU_IRQ_ENABLE_DRAINED) | (1 << SGPU_IRQ_ENABLE_MARKED) | (1 << SGPU_IRQ_ENABLE_FLIP)));
+			if ((status >> 4) & irq_reg) irq_raised = true; // enabled while pending
+			break;
+		}
 		default:
 			break;
 	}
@@ -134,74 +443,928 @@ byte SGPU::readIO(byte port)
 			return cmd_buf_addr;
 		case _SGPU_CMD_BUF_VALUE:
 			return cmd_buf.data[cmd_buf_addr & 0xff];
+		case _SGPU_CAPS:
+			return (1 << SGPU_CAP_APERTURE) | (1 << SGPU_CAP_BLIT) | (1 << SGPU_CAP_RING) | (1 << SGPU_CAP_OBJECTS) | (1 << SGPU_CAP_FLIP);
+		case _SGPU_MODE:
+			return mode;
+		case _SGPU_RING_BASE:
+			return ring_base;
+		case _SGPU_RING_HEAD:
+			return ring_head;
+		case _SGPU_RING_TAIL:
+			return ring_tail;
+		case _SGPU_IRQ:
+			return irq_reg;
+		case _SGPU_FRONT:
+			return front;
 		default:
 			break;
 	}
 	return 0;
 }
 
+void SGPU::writeObjectIO(byte port, byte value)
+{
+	port -= SGPU_OBJ_IO_OFFSET;
+	byte* reg = NULL;
+	switch (port)
+	{
+		case _SGPU_OBJ_ADDR_LOW:
+			obj_addr = (obj_addr & 0xff00) | value;
+			break;
+		case _SGPU_OBJ_ADDR_HIGH:
+			obj_addr = (obj_addr & 0xff) | (value << 8);
+			break;
+		case _SGPU_OBJ_DATA:
+			writeObject(obj_addr++, value);
+			break;
+		case _SGPU_OBJ_CTRL:
+			reg = &obj_ctrl;
+			break;
+		case _SGPU_TILE_KEY:
+			reg = &tile_key;
+			break;
+		case _SGPU_TILE_SCROLL_X:
+			reg = &tile_scroll_x;
+			break;
+		case _SGPU_TILE_SCROLL_Y:
+			reg = &tile_scroll_y;
+			break;
+		default:
+			break;
+	}
+
+	/* Layer settings change the whole picture */
+	if (reg && *reg != value)
+	{
+		bool visible = obj_ctrl != 0;
+		*reg = value;
+		if (visible || obj_ctrl != 0) markDirty(0, fb0_width * fb0_height);
+	}
+}
+
+byte SGPU::readObjectIO(byte port)
+{
+	port -= SGPU_OBJ_IO_OFFSET;
+	switch (port)
+	{
+		case _SGPU_OBJ_ADDR_LOW:
+			return obj_addr & 0xff;
+		case _SGPU_OBJ_ADDR_HIGH:
+			return (obj_addr >> 8) & 0xff;
+		case _SGPU_OBJ_DATA:
+		{
+			unsigned int addr = obj_addr++;
+			return (addr < SGPU_OBJ_MEM_SIZE) ? obj_mem[addr] : 0;
+		}
+		case _SGPU_OBJ_CTRL:
+			return obj_ctrl;
+		case _SGPU_TILE_KEY:
+			return tile_key;
+		case _SGPU_TILE_SCROLL_X:
+			return tile_scroll_x;
+		case _SGPU_TILE_SCROLL_Y:
+			return tile_scroll_y;
+		default:
+			break;
+	}
+	return 0;
+}
+
+void SGPU::writeObject(unsigned int obj_addr, byte value)
+{
+	if (obj_addr >= SGPU_OBJ_MEM_SIZE || obj_mem[obj_addr] == value) return;
+
+	if (obj_addr >= SGPU_SPRITES_OFFSET)
+	{
+		int sprite = (obj_addr - SGPU_SPRITES_OFFSET) / SGPU_SPRITE_SIZE;
+		markSpriteDirty(sprite); // old position
+		obj_mem[obj_addr] = value;
+		markSpriteDirty(sprite); // new position
+		return;
+	}
+
+	obj_mem[obj_addr] = value;
+	if (obj_addr < SGPU_MAP_OFFSET) // tile pixels, may be shown anywhere
+	{
+		if (obj_ctrl != 0) markDirty(0, fb0_width * fb0_height);
+	}
+	else if (obj_addr < SGPU_MAP_OFFSET + SGPU_MAP_WIDTH * SGPU_MAP_HEIGHT)
+	{
+		if (!GET_BIT(obj_ctrl, SGPU_OBJ_TILES)) return;
+
+		/* Scanlines of the map row, which may wrap around the bottom */
+		int map_y = ((obj_addr - SGPU_MAP_OFFSET) / SGPU_MAP_WIDTH) * SGPU_TILE_SIZE;
+		int map_height = SGPU_MAP_HEIGHT * SGPU_TILE_SIZE;
+		for (int i = 0; i < SGPU_TILE_SIZE; i++)
+		{
+			int line = (map_y + i - tile_scroll_y % map_height + map_height) % map_height;
+			if (line < fb0_height) markDirty(line * fb0_width, fb0_width);
+		}
+	}
+}
+
+void SGPU::markSpriteDirty(int sprite)
+{
+	if (!GET_BIT(obj_ctrl, SGPU_OBJ_SPRITES)) return;
+
+	byte* attr = obj_mem + SGPU_SPRITES_OFFSET + sprite * SGPU_SPRITE_SIZE;
+	if (attr[1] < fb0_height) markDirty(attr[1] * fb0_width, SGPU_TILE_SIZE * fb0_width);
+}
+
 byte* SGPU::getFB0()
 {
 	return framebuffer0;
 }
 
+byte* SGPU::getFrontBuffer()
+{
+	return front_buffer;
+}
+
+void SGPU::composeFrame(byte* out)
+{
+	waitForWorker();
+	for (int y = 0; y < fb0_height; y++)
+		composeLine(y, out + y * fb0_width);
+}
+
+int SGPU::initCaptureConsole()
+{
+	/* Headless runs have not loaded the font yet, TTF needs no window */
+	if (!default_font)
+	{
+		if (TTF_Init() == -1 || !(default_font = TTF_OpenFont(FONT_DEFAULT_NAME, 30)))
+		{
+			cerr << "Failed to load default font, capturing without console: " << SDL_GetError() << endl;
+			return -1;
+		}
+	}
+	int font_width, font_height;
+	if (getGlyphSize(default_font, &font_width, &font_height)) return -1;
+
+	/* Like the console texture, a cell covers 1 / TTY_WIDTH x 1 / TTY_HEIGHT of the screen */
+	capture_cell_width = fb0_width / TTY_WIDTH;
+	capture_cell_height = fb0_height / TTY_HEIGHT;
+	int cell_size = capture_cell_width * capture_cell_height;
+	capture_glyphs = new byte[TTY_GLYPH_COUNT * cell_size]();
+
+	SDL_Color white = {255, 255, 255, 255};
+	for (int i = 1; i < TTY_GLYPH_COUNT; i++) // 0 is the space
+	{
+		SDL_Surface* glyph = TTF_RenderGlyph_Blended(default_font, TTY_GLYPH_FIRST + i, white);
+		if (!glyph) continue;
+
+		/* Average the alpha of the ARGB8888 glyph over each capture pixel of its cell */
+		byte* mask = capture_glyphs + i * cell_size;
+		for (int y = 0; y < capture_cell_height; y++)
+		{
+			int from_y = y * font_height / capture_cell_height;
+			int to_y = max((y + 1) * font_height / capture_cell_height, from_y + 1);
+			for (int x = 0; x < capture_cell_width; x++)
+			{
+				int from_x = x * font_width / capture_cell_width;
+				int to_x = max((x + 1) * font_width / capture_cell_width, from_x + 1);
+				unsigned int sum = 0;
+				for (int gy = from_y; gy < to_y && gy < glyph->h; gy++)
+				{
+					const Uint32* row = (const Uint32*)((const byte*)glyph->pixels + gy * glyph->pitch);
+					for (int gx = from_x; gx < to_x && gx < glyph->w; gx++)
+						sum += row[gx] >> 24;
+				}
+				mask[y * capture_cell_width + x] = (byte)(sum / ((to_y - from_y) * (to_x - from_x)));
+			}
+		}
+		SDL_FreeSurface(glyph);
+	}
+	return 0;
+}
+
+void SGPU::composeConsole(byte* out)
+{
+	if (!capture_glyphs) return;
+
+	int cell_size = capture_cell_width * capture_cell_height;
+	for (int i = 0; i < tty_end && i < tty_size; i++)
+	{
+		int glyph = (unsigned char)tty_buffer[i] - TTY_GLYPH_FIRST;
+		if (glyph <= 0 || glyph >= TTY_GLYPH_COUNT) continue; // space or not printable, the console is transparent
+
+		const byte* mask = capture_glyphs + glyph * cell_size;
+		byte* cell = out + (i / TTY_WIDTH) * capture_cell_height * fb0_width + (i % TTY_WIDTH) * capture_cell_width;
+		for (int y = 0; y < capture_cell_height; y++)
+		{
+			for (int x = 0; x < capture_cell_width; x++)
+			{
+				int alpha = mask[y * capture_cell_width + x];
+				if (!alpha) continue;
+
+				/* Blend white over the RGB332 pixel */
+				byte pixel = cell[y * fb0_width + x];
+				int r = (pixel >> 5) & 0x7, g = (pixel >> 2) & 0x7, b = pixel & 0x3;
+				r += ((0x7 - r) * alpha + 127) / 255;
+				g += ((0x7 - g) * alpha + 127) / 255;
+				b += ((0x3 - b) * alpha + 127) / 255;
+				cell[y * fb0_width + x] = (byte)((r << 5) | (g << 2) | b);
+			}
+		}
+	}
+}
+
+int SGPU::getFramebufferPage()
+{
+	return framebuffer_page;
+}
+
+unsigned int SGPU::getWindowStart()
+{
+	return window_start;
+}
+
+unsigned int SGPU::getWindowSize()
+{
+	return window_size;
+}
+
+byte SGPU::getMode()
+{
+	return mode;
+}
+
+void SGPU::updateWindow()
+{
+	window_size = GET_BIT(mode, SGPU_MODE_APERTURE) ? FB_APERTURE_SIZE : FB_N_SIZE;
+	window_start = framebuffer_page * window_size;
+}
+
+void SGPU::updateBuffers()
+{
+	front_buffer = framebuffers[front];
+	if (GET_BIT(mode, SGPU_MODE_DOUBLE_BUFFER)) framebuffer0 = framebuffers[(front + 1) % SGPU_FB_COUNT];
+	else framebuffer0 = front_buffer;
+}
+
+void SGPU::flip()
+{
+	if (GET_BIT(mode, SGPU_MODE_DOUBLE_BUFFER))
+	{
+		front = (front + 1) % SGPU_FB_COUNT;
+		updateBuffers();
+		markDirty(0, fb0_width * fb0_height); // the texture still shows the previous frame
+	}
+	if (GET_BIT(cmd.data[2], 0)) raiseIRQ(SGPU_IRQ_FLIP);
+}
+
 int SGPU::render()
 {
+	if (shared) publishShared();
+	if (render_thread) return publishFrame();
+	if (!renderer) return 0; // headless
+	if (!framebuffer_changed && !tty_changed) return 0; // nothing to present
+
 	if (framebuffer_changed)
 	{
-		SDL_UpdateTexture(fb0_texture, NULL, framebuffer0, FB_WIDTH);
-		SDL_RenderCopy(renderer, fb0_texture, NULL, NULL);
-		framebuffer_changed = false;
+		waitForWorker();
+		uploadFramebuffer();
 	}
-	if (tty_changed)
-	{
-		SDL_Rect tty_rect;
-		tty_rect.x = 0;
-		tty_rect.y = 0;
-		tty_rect.w = FB_WIDTH;
-		tty_rect.h = FB_HEIGHT;
 
-		SDL_RenderCopy(renderer, tty_tex, NULL, &tty_rect); // Copy TTY on to Framebuffer 1
+	if (tty_changed && tty_tex)
+	{
+		renderConsole(tty_buffer, tty_end, tty_dirty);
 		tty_changed = false;
 	}
 
+	presentLayers();
+	return 1;
+}
+
+void SGPU::presentLayers()
+{
+	/* The back buffer is undefined after presenting, so both layers are drawn every frame */
+	SDL_RenderCopy(renderer, fb0_texture, NULL, NULL);
+	if (tty_tex) SDL_RenderCopy(renderer, tty_tex, NULL, NULL); // Copy TTY on to Framebuffer 1
+
 	SDL_RenderPresent(renderer);
-	return 0;
 }
 
-void SGPU::cycle()
+void SGPU::publishShared()
 {
-	int id = getCmdBufId();
-	int status = (int)cmd_buf.data[0];
-	if (GET_BIT(status, 0)) // Bit 0 of status byte is a trigger bit
+	if (!framebuffer_changed && !tty_changed) return;
+
+	waitForWorker();
+	shared->publish(line_dirty, front, synced_cycles);
+
+	/* Without window the dirty state has no other consumer */
+	if (!renderer && !render_thread)
 	{
-		if (!cmd_buf.trigger)
+		memset(line_dirty, 0, fb0_height * sizeof(bool));
+		memset(tty_dirty, 0, tty_size * sizeof(bool));
+		framebuffer_changed = false;
+		tty_changed = false;
+	}
+}
+
+int SGPU::publishFrame()
+{
+	if (!framebuffer_changed && !tty_changed) return 0; // nothing to present
+
+	composeFrame(frames[frame_back].pixels);
+	memcpy(frames[frame_back].tty, tty_buffer, tty_size);
+	frames[frame_back].tty_end = tty_end;
+
+	/* The render thread finds the changes by comparing frames */
+	memset(line_dirty, 0, fb0_height * sizeof(bool));
+	memset(tty_dirty, 0, tty_size * sizeof(bool));
+	framebuffer_changed = false;
+	tty_changed = false;
+
+	frame_back = SDL_AtomicSet(&frame_middle, frame_back | RENDER_FRAME_FRESH) & ~RENDER_FRAME_FRESH;
+	SDL_SemPost(render_wake);
+	return 1;
+}
+
+void SGPU::presentFrame(int index)
+{
+	const byte* pixels = frames[index].pixels;
+	int line = 0;
+	while (line < fb0_height)
+	{
+		if (!render_full && memcmp(shown_pixels + line * fb0_width, pixels + line * fb0_width, fb0_width) == 0)
 		{
-			cmd_buf.trigger = true;
-			cmd_tmp = 0;
+			line++;
+			continue;
 		}
-		if (cmd_buf.trigger)
+
+		/* Upload consecutive changed lines at once */
+		int first = line;
+		while (line < fb0_height && (render_full || memcmp(shown_pixels + line * fb0_width, pixels + line * fb0_width, fb0_width) != 0))
+			line++;
+		memcpy(shown_pixels + first * fb0_width, pixels + first * fb0_width, (line - first) * fb0_width);
+
+		SDL_Rect rect = { 0, first, fb0_width, line - first };
+		void* texture_pixels;
+		int pitch;
+		if (SDL_LockTexture(fb0_texture, &rect, &texture_pixels, &pitch) == 0)
 		{
-			switch (id)
-			{
-				case SGPU_CMD_FILL:
-					if (!fillBlock())
-					{
-						stopCommand(status, SGPU_CMD_ACK);
-					}
-					break;
-				case SGPU_CMD_TTY_WRITE:
-					if (!default_font)
-						stopCommand(status, SGPU_CMD_NACK);
-					if (!writeCharacter())
-						stopCommand(status, SGPU_CMD_ACK);
-					break;
-				default:
-					stopCommand(status, SGPU_CMD_NACK);
-					break;
-			}
+			for (int y = 0; y < rect.h; y++)
+				memcpy((byte*)texture_pixels + y * pitch, pixels + (first + y) * fb0_width, fb0_width);
+			SDL_UnlockTexture(fb0_texture);
+		}
+	}
+
+	/* Console cells, text beyond the end is kept as 0 */
+	bool console_changed = false;
+	for (int i = 0; i < tty_size; i++)
+	{
+		char c = (i < frames[index].tty_end) ? frames[index].tty[i] : 0;
+		if (render_full || c != shown_tty[i])
+		{
+			shown_tty[i] = c;
+			shown_tty_dirty[i] = true;
+			console_changed = true;
+		}
+	}
+	if (console_changed && tty_tex) renderConsole(shown_tty, tty_size, shown_tty_dirty);
+
+	render_full = false;
+	presentLayers();
+}
+
+void SGPU::sync(uint64_t now)
+{
+	while (synced_cycles < now)
+	{
+		if (!cmd.running && !startNextCommand())
+		{
+			synced_cycles = now;
+			break;
+		}
+
+		if (cmd.cycles < 0) // command never completes
+		{
+			synced_cycles = now;
+			break;
+		}
+
+		uint64_t end = cmd.start + cmd.cycles;
+		if (now < end)
+		{
+			advanceCommand(now - cmd.start);
+			synced_cycles = now;
+			break;
+		}
+
+		finishCommand();
+		synced_cycles = end;
+	}
+}
+
+uint64_t SGPU::getNextEvent()
+{
+	if (!cmd.running && !startNextCommand()) return UINT64_MAX;
+
+	if (cmd.cycles < 0) return UINT64_MAX;
+	return cmd.start + cmd.cycles;
+}
+
+bool SGPU::isBusy()
+{
+	return cmd.running
+		|| GET_BIT(cmd_buf.data[0], 0) // Bit 0 of status byte is a trigger bit
+		|| ring_head != ring_tail;
+}
+
+bool SGPU::pollIRQ()
+{
+	bool raised = irq_raised;
+	irq_raised = false;
+	return raised;
+}
+
+bool SGPU::startNextCommand()
+{
+	if (GET_BIT(cmd_buf.data[0], 0))
+	{
+		startCommand(cmd_buf.data, CMD_SOURCE_BUFFER);
+		return true;
+	}
+	if (ring_head != ring_tail)
+	{
+		readGuestMemory((dword)((ring_base << 8) | ring_tail), ring_entry, SGPU_RING_ENTRY_SIZE);
+		startCommand(ring_entry, CMD_SOURCE_RING);
+		return true;
+	}
+	return false;
+}
+
+void SGPU::startCommand(const byte* data, int source)
+{
+	cmd.running = true;
+	cmd.source = source;
+	cmd.data = data;
+	cmd_tmp = 0;
+	cmd.id = data[1];
+	cmd.start = synced_cycles;
+	cmd.size = 0;
+	unsigned int fb_size = (unsigned int)(fb0_width * fb0_height);
+
+	if ((cmd.id == SGPU_CMD_FILL && cmd.data[2] == 0) || cmd.id == SGPU_CMD_DMA)
+	{
+		int offset = (cmd.id == SGPU_CMD_FILL) ? 3 : 4;
+		unsigned int addr = (unsigned int)((cmd.data[offset] << 8) | cmd.data[offset + 1]);
+		unsigned int count = (unsigned int)((cmd.data[offset + 2] << 8) | cmd.data[offset + 3]);
+
+		cmd.addr = min(addr, fb_size);
+		cmd.size = min(count, fb_size - cmd.addr);
+		cmd.value = cmd.data[7];
+		cmd.src = (dword)((cmd.data[2] << 8) | cmd.data[3]);
+		if (cmd.size < count)
+		{
+			cerr << "count = " << hex << count << dec << endl;
+			cerr << "Illegal access to Framebuffer (index exceeds size)" << endl;
+		}
+	}
+	else if (cmd.id == SGPU_CMD_BLIT)
+	{
+		cmd.x = cmd.data[2];
+		cmd.y = cmd.data[3];
+		cmd.dx = cmd.data[4];
+		cmd.dy = cmd.data[5];
+
+		/* Clip both rectangles to the framebuffer */
+		cmd.w = max(0, min((int)cmd.data[6], min(fb0_width - cmd.x, fb0_width - cmd.dx)));
+		cmd.h = max(0, min((int)cmd.data[7], min(fb0_height - cmd.y, fb0_height - cmd.dy)));
+	}
+	else if (cmd.id == SGPU_CMD_SCROLL)
+	{
+		cmd.dx = (signed char)cmd.data[2];
+		cmd.dy = (signed char)cmd.data[3];
+		cmd.value = cmd.data[4];
+	}
+	cmd.cycles = getCommandCycles();
+	if (cmd.cycles < 0 && source == CMD_SOURCE_RING) cmd.cycles = 1; // rejected, the ring must not stall
+
+	if (worker && cmd.id == SGPU_CMD_FILL && cmd.size > 0) // the worker only fills
+	{
+		markDrawn(cmd.addr, cmd.size); // uploads wait for the worker
+		worker_busy = true;
+		SDL_SemPost(worker_job);
+	}
+}
+
+int SGPU::getCommandCycles()
+{
+	switch (cmd.id)
+	{
+		case SGPU_CMD_FILL:
+		{
+			if (cmd.data[2] != 0) return -1; // unsupported fill mode, never completes
+
+			unsigned int addr = (unsigned int)((cmd.data[3] << 8) | cmd.data[4]);
+			unsigned int count = (unsigned int)((cmd.data[5] << 8) | cmd.data[6]);
+			unsigned int limit = (unsigned int)(fb0_width * fb0_height + 1);
+
+			/* 8 bytes per cycle, completion is detected in the cycle after the last byte */
+			int cycles = count / SGPU_BYTES_PER_CYCLE + 1;
+			if (addr >= limit) return 1;
+			int limit_cycles = (limit - addr + SGPU_BYTES_PER_CYCLE - 1) / SGPU_BYTES_PER_CYCLE + 1; // aborted when exceeding the framebuffer
+			return min(cycles, limit_cycles);
+		}
+		case SGPU_CMD_BLIT:
+			return (cmd.w * cmd.h) / SGPU_BYTES_PER_CYCLE + 1;
+		case SGPU_CMD_SCROLL:
+			return (fb0_width * fb0_height) / SGPU_BYTES_PER_CYCLE + 1;
+		case SGPU_CMD_DMA:
+			return cmd.size / SGPU_BYTES_PER_CYCLE + 1;
+		case SGPU_CMD_FLIP:
+		{
+			uint64_t frame_cycles = max(Machine_GetClockFrequency() / SGPU_FRAME_FREQUENCY, 1);
+			return (int)(frame_cycles - cmd.start % frame_cycles); // until the next frame starts
+		}
+		default:
+			return 1;
+	}
+}
+
+void SGPU::advanceCommand(uint64_t elapsed)
+{
+	if (cmd.id == SGPU_CMD_FILL && !worker)
+		fillTo((unsigned int)min(elapsed * SGPU_BYTES_PER_CYCLE, (uint64_t)cmd.size));
+}
+
+void SGPU::finishCommand()
+{
+	int response = SGPU_CMD_ACK;
+	switch (cmd.id)
+	{
+		case SGPU_CMD_FILL:
+			if (cmd.data[2] != 0) response = SGPU_CMD_NACK; // unsupported fill mode (ring only)
+			else if (worker) waitForWorker();
+			else fillTo(cmd.size);
+			if (response == SGPU_CMD_ACK) stats.bytes_drawn += cmd.size;
+			break;
+		case SGPU_CMD_TTY_WRITE:
+			writeCharacter();
+			break;
+		case SGPU_CMD_BLIT:
+			blitRect(cmd.x, cmd.y, cmd.w, cmd.h, cmd.dx, cmd.dy);
+			stats.bytes_drawn += cmd.w * cmd.h;
+			break;
+		case SGPU_CMD_SCROLL:
+			scroll(cmd.dx, cmd.dy, cmd.value);
+			stats.bytes_drawn += fb0_width * fb0_height;
+			break;
+		case SGPU_CMD_DMA:
+			dmaCopy(cmd.src, cmd.addr, cmd.size);
+			stats.bytes_drawn += cmd.size;
+			break;
+		case SGPU_CMD_FLIP:
+			flip();
+			break;
+		default:
+			response = SGPU_CMD_NACK;
+			break;
+	}
+
+	cmd.running = false;
+	stats.commands[cmd.id <= SGPU_CMD_FLIP ? cmd.id : 0]++;
+	if (response == SGPU_CMD_NACK) stats.rejected++;
+	if (cmd.source == CMD_SOURCE_RING) retireRingEntry(response);
+	else stopCommand((int)cmd_buf.data[0], response);
+}
+
+void SGPU::retireRingEntry(int response)
+{
+	cmd_tmp = 0;
+	if (ring_head == ring_tail) return; // ring has been reset meanwhile
+
+	ring_tail += SGPU_RING_ENTRY_SIZE;
+	if (response == SGPU_CMD_NACK) SET_BIT(irq_reg, SGPU_IRQ_ERROR);
+	if (GET_BIT(ring_entry[0], SGPU_RING_FLAG_IRQ)) raiseIRQ(SGPU_IRQ_MARKED);
+	if (ring_head == ring_tail) raiseIRQ(SGPU_IRQ_DRAINED);
+}
+
+void SGPU::raiseIRQ(int status_bit)
+{
+	SET_BIT(irq_reg, status_bit);
+	if (GET_BIT(irq_reg, (status_bit - 4)))
+	{
+		irq_raised = true; // enable bits are 4 below the status bits
+		stats.irqs++;
+	}
+}
+
+void SGPU::fillTo(unsigned int end)
+{
+	if (end <= cmd_tmp) return;
+	memset(framebuffer0 + cmd.addr + cmd_tmp, cmd.value, end - cmd_tmp);
+	markDrawn(cmd.addr + cmd_tmp, end - cmd_tmp);
+	cmd_tmp = end;
+}
+
+void SGPU::blitRect(int x, int y, int w, int h, int dst_x, int dst_y)
+{
+	if (w <= 0 || h <= 0) return;
+
+	/* Copy rows away from the overlap, memmove handles overlapping rows */
+	if (dst_y <= y)
+	{
+		for (int row = 0; row < h; row++)
+			memmove(framebuffer0 + (dst_y + row) * fb0_width + dst_x, framebuffer0 + (y + row) * fb0_width + x, w);
+	}
+	else
+	{
+		for (int row = h - 1; row >= 0; row--)
+			memmove(framebuffer0 + (dst_y + row) * fb0_width + dst_x, framebuffer0 + (y + row) * fb0_width + x, w);
+	}
+	markDrawn(dst_y * fb0_width, h * fb0_width);
+}
+
+void SGPU::scroll(int dx, int dy, byte value)
+{
+	int w = fb0_width - abs(dx);
+	int h = fb0_height - abs(dy);
+	if (w <= 0 || h <= 0)
+	{
+		memset(framebuffer0, value, fb0_width * fb0_height);
+	}
+	else
+	{
+		blitRect(max(-dx, 0), max(-dy, 0), w, h, max(dx, 0), max(dy, 0));
+
+		/* Uncovered rows and columns */
+		if (dy > 0) memset(framebuffer0, value, dy * fb0_width);
+		else if (dy < 0) memset(framebuffer0 + h * fb0_width, value, -dy * fb0_width);
+		if (dx != 0)
+		{
+			int column = (dx > 0) ? 0 : w;
+			for (int row = max(dy, 0); row < max(dy, 0) + h; row++)
+				memset(framebuffer0 + row * fb0_width + column, value, abs(dx));
+		}
+	}
+	markDrawn(0, fb0_width * fb0_height);
+}
+
+void SGPU::dmaCopy(dword src, unsigned int dst, unsigned int size)
+{
+	readGuestMemory(src, framebuffer0 + dst, size);
+	markDrawn(dst, size);
+}
+
+void SGPU::readGuestMemory(dword src, byte* dst, unsigned int size)
+{
+	unsigned int done = 0;
+	while (done < size)
+	{
+		dword address = (dword)(src + done);
+		unsigned int offset = address & MEM_PAGE_MASK;
+		unsigned int chunk = min(size - done, (unsigned int)MEM_PAGE_SIZE - offset); // up to the end of the page
+		byte* page = memory_map ? memory_map->read[address >> MEM_PAGE_SHIFT] : NULL;
+
+		if (page)
+		{
+			memcpy(dst + done, page + offset, chunk);
+		}
+		else
+		{
+			for (unsigned int i = 0; i < chunk; i++)
+				dst[done + i] = Machine_ReadMemDMA((dword)(address + i));
+		}
+		done += chunk;
+	}
+}
+
+void SGPU::markDirty(unsigned int offset, unsigned int size)
+{
+	if (size == 0) return;
+	unsigned int first = offset / fb0_width;
+	unsigned int last = min((offset + size - 1) / fb0_width, (unsigned int)fb0_height - 1);
+	for (unsigned int line = first; line <= last; line++)
+		line_dirty[line] = true;
+	framebuffer_changed = true;
+}
+
+void SGPU::markDrawn(unsigned int offset, unsigned int size)
+{
+	if (framebuffer0 == front_buffer) markDirty(offset, size);
+}
+
+void SGPU::uploadFramebuffer()
+{
+	int line = 0;
+	while (line < fb0_height)
+	{
+		if (!line_dirty[line])
+		{
+			line++;
+			continue;
+		}
+
+		/* Upload consecutive dirty lines at once */
+		int first = line;
+		while (line < fb0_height && line_dirty[line])
+			line_dirty[line++] = false;
+
+		SDL_Rect rect = { 0, first, fb0_width, line - first };
+		void* pixels;
+		int pitch;
+		if (SDL_LockTexture(fb0_texture, &rect, &pixels, &pitch) == 0)
+		{
+			for (int y = 0; y < rect.h; y++)
+				composeLine(first + y, (byte*)pixels + y * pitch);
+			SDL_UnlockTexture(fb0_texture);
+		}
+	}
+	framebuffer_changed = false;
+}
+
+/* Copies the pixels of 'src' that differ from 'key' */
+static inline void overlayKeyed(byte* dst, const byte* src, int count, byte key)
+{
+	for (int i = 0; i < count; i++)
+		dst[i] = (src[i] != key) ? src[i] : dst[i]; // branchless, vectorizes
+}
+
+void SGPU::composeLine(int y, byte* out)
+{
+	memcpy(out, front_buffer + y * fb0_width, fb0_width);
+	if (obj_ctrl == 0) return;
+
+	if (GET_BIT(obj_ctrl, SGPU_OBJ_TILES))
+	{
+		int map_width = SGPU_MAP_WIDTH * SGPU_TILE_SIZE;
+		int map_y = (y + tile_scroll_y) % (SGPU_MAP_HEIGHT * SGPU_TILE_SIZE);
+		const byte* map_row = obj_mem + SGPU_MAP_OFFSET + (map_y / SGPU_TILE_SIZE) * SGPU_MAP_WIDTH;
+		int tile_y = map_y % SGPU_TILE_SIZE;
+
+		int x = 0;
+		while (x < fb0_width)
+		{
+			int map_x = (x + tile_scroll_x) % map_width;
+			int tile_x = map_x % SGPU_TILE_SIZE;
+			int count = min(SGPU_TILE_SIZE - tile_x, fb0_width - x);
+			int tile = map_row[map_x / SGPU_TILE_SIZE] % SGPU_TILE_COUNT;
+			const byte* src = obj_mem + SGPU_TILES_OFFSET + (tile * SGPU_TILE_SIZE + tile_y) * SGPU_TILE_SIZE + tile_x;
+
+			overlayKeyed(out + x, src, count, tile_key);
+			x += count;
 		}
 	}
+
+	if (GET_BIT(obj_ctrl, SGPU_OBJ_SPRITES))
+	{
+		/* Later sprites are drawn above earlier ones */
+		for (int i = 0; i < SGPU_SPRITE_COUNT; i++)
+		{
+			const byte* attr = obj_mem + SGPU_SPRITES_OFFSET + i * SGPU_SPRITE_SIZE;
+			int sprite_x = attr[0], sprite_y = attr[1];
+			if (sprite_y >= fb0_height || y < sprite_y || y >= sprite_y + SGPU_TILE_SIZE || sprite_x >= fb0_width) continue;
+
+			int tile = attr[2] % SGPU_TILE_COUNT;
+			const byte* src = obj_mem + SGPU_TILES_OFFSET + (tile * SGPU_TILE_SIZE + (y - sprite_y)) * SGPU_TILE_SIZE;
+			overlayKeyed(out + sprite_x, src, min(SGPU_TILE_SIZE, fb0_width - sprite_x), attr[3]);
+		}
+	}
+}
+
+void SGPU::saveState(StateWriter& state)
+{
+	waitForWorker(); // the framebuffer holds the whole fill from here on
+	unsigned int fb_size = (unsigned int)(fb0_width * fb0_height);
+
+	state.beginSection(STATE_SECTION_SGPU);
+	state.put16((dword)fb0_width);
+	state.put16((dword)fb0_height);
+	state.put8(framebuffer_page);
+	state.put8(mode);
+	state.put8((byte)front);
+	state.putBytes(cmd_buf.data, sizeof(cmd_buf.data));
+	state.put8(cmd_buf_addr);
+	state.put32(cmd_tmp);
+	state.put64(synced_cycles);
+
+	/* The latched command refers to its source instead of the data pointer */
+	state.put8(cmd.running);
+	state.put8((byte)cmd.source);
+	state.put8((byte)cmd.id);
+	state.put64(cmd.start);
+	state.put32((uint32_t)cmd.cycles);
+	state.put32(cmd.addr);
+	state.put32(cmd.size);
+	state.put8(cmd.value);
+	state.put32((uint32_t)cmd.x);
+	state.put32((uint32_t)cmd.y);
+	state.put32((uint32_t)cmd.w);
+	state.put32((uint32_t)cmd.h);
+	state.put32((uint32_t)cmd.dx);
+	state.put32((uint32_t)cmd.dy);
+	state.put16(cmd.src);
+
+	state.put8(ring_base);
+	state.put8(ring_head);
+	state.put8(ring_tail);
+	state.putBytes(ring_entry, sizeof(ring_entry));
+	state.put8(irq_reg);
+	state.put8(irq_raised);
+
+	state.put16(obj_addr);
+	state.put8(obj_ctrl);
+	state.put8(tile_key);
+	state.put8(tile_scroll_x);
+	state.put8(tile_scroll_y);
+	state.putBytes(obj_mem, SGPU_OBJ_MEM_SIZE);
+	state.endSection();
+
+	state.beginSection(STATE_SECTION_FRAMEBUFFERS);
+	state.put32(SGPU_FB_COUNT);
+	for (int i = 0; i < SGPU_FB_COUNT; i++)
+		state.putBytes(framebuffers[i], fb_size);
+	state.endSection();
+
+	state.beginSection(STATE_SECTION_TTY);
+	state.put32((uint32_t)tty_size);
+	state.putBytes(tty_buffer, tty_size + 1);
+	state.put32((uint32_t)tty_index);
+	state.put32((uint32_t)cursor_x);
+	state.put32((uint32_t)cursor_y);
+	state.endSection();
+}
+
+int SGPU::loadState(StateReader& state)
+{
+	waitForWorker();
+	unsigned int fb_size = (unsigned int)(fb0_width * fb0_height);
+
+	if (state.openSection(STATE_SECTION_SGPU)) return -1;
+	int width = state.get16();
+	int height = state.get16();
+	if (width != fb0_width || height != fb0_height)
+	{
+		cerr << "State has a " << dec << width << "x" << height << " framebuffer, expected "
+			<< fb0_width << "x" << fb0_height << endl;
+		return -1;
+	}
+	framebuffer_page = state.get8();
+	mode = state.get8();
+	front = state.get8() % SGPU_FB_COUNT;
+	state.getBytes(cmd_buf.data, sizeof(cmd_buf.data));
+	cmd_buf_addr = state.get8();
+	cmd_tmp = state.get32();
+	synced_cycles = state.get64();
+
+	cmd.running = state.get8() != 0;
+	cmd.source = state.get8();
+	cmd.data = (cmd.source == CMD_SOURCE_RING) ? ring_entry : cmd_buf.data;
+	cmd.id = state.get8();
+	cmd.start = state.get64();
+	cmd.cycles = (int)state.get32();
+	cmd.addr = min(state.get32(), fb_size);
+	cmd.size = min(state.get32(), fb_size - cmd.addr);
+	cmd.value = state.get8();
+	cmd.x = (int)state.get32();
+	cmd.y = (int)state.get32();
+	cmd.w = (int)state.get32();
+	cmd.h = (int)state.get32();
+	cmd.dx = (int)state.get32();
+	cmd.dy = (int)state.get32();
+	cmd.src = state.get16();
+
+	ring_base = state.get8();
+	ring_head = state.get8();
+	ring_tail = state.get8();
+	state.getBytes(ring_entry, sizeof(ring_entry));
+	irq_reg = state.get8();
+	irq_raised = state.get8() != 0;
+
+	obj_addr = state.get16();
+	obj_ctrl = state.get8();
+	tile_key = state.get8();
+	tile_scroll_x = state.get8();
+	tile_scroll_y = state.get8();
+	state.getBytes(obj_mem, SGPU_OBJ_MEM_SIZE);
+
+	if (state.openSection(STATE_SECTION_FRAMEBUFFERS) || state.get32() != SGPU_FB_COUNT) return -1;
+	for (int i = 0; i < SGPU_FB_COUNT; i++)
+		state.getBytes(framebuffers[i], fb_size);
+
+	if (state.openSection(STATE_SECTION_TTY) || (int)state.get32() != tty_size) return -1;
+	state.getBytes(tty_buffer, tty_size + 1);
+	tty_buffer[tty_size] = 0;
+	tty_end = (int)strlen(tty_buffer); // text ends at the first 0
+	tty_index = (int)(state.get32() % tty_size);
+	cursor_x = (int)(state.get32() % TTY_WIDTH);
+	cursor_y = (int)(state.get32() % TTY_HEIGHT);
+	if (state.hasError()) return -1;
+
+	/* A fill saved without the worker is only partly drawn, the worker would never finish it */
+	if (worker && cmd.running && cmd.id == SGPU_CMD_FILL && cmd.data[2] == 0)
+		fillTo(cmd.size);
+
+	updateWindow();
+	updateBuffers();
+	markDirty(0, fb_size);
+	markCellsDirty(0, tty_size);
+	return 0;
 }
 
 void SGPU::dump()
@@ -216,57 +1379,92 @@ void SGPU::dump()
 	}
 
 	cout << endl << "command id = " << getCmdBufId() << endl;
-	cout << "trigger = " << (cmd_buf.trigger ? "True" : "False") << endl;
+	cout << "running = " << (cmd.running ? "True" : "False") << endl;
+	cout << "ring base = " << (dword)ring_base << ", head = " << (dword)ring_head << ", tail = " << (dword)ring_tail << endl;
 	cout << "============================================" << endl << endl;
 }
 
 SGPU::~SGPU()
 {
+	if (worker)
+	{
+		worker_quit = true;
+		SDL_SemPost(worker_job);
+		SDL_WaitThread(worker, NULL);
+	}
+	if (worker_job) SDL_DestroySemaphore(worker_job);
+	if (worker_done) SDL_DestroySemaphore(worker_done);
+
+	if (render_thread)
+	{
+		render_quit = true;
+		SDL_SemPost(render_wake);
+		SDL_WaitThread(render_thread, NULL);
+	}
+	if (render_wake) SDL_DestroySemaphore(render_wake);
+	if (render_started) SDL_DestroySemaphore(render_started);
+	for (int i = 0; i < RENDER_FRAME_COUNT; i++)
+	{
+		delete[] frames[i].pixels;
+		delete[] frames[i].tty;
+	}
+	delete[] shown_pixels;
+	delete[] shown_tty;
+	delete[] shown_tty_dirty;
+
 	dump();
-	delete[] framebuffer0;
+	if (glyph_atlas) SDL_DestroyTexture(glyph_atlas);
+	if (tty_tex) SDL_DestroyTexture(tty_tex);
+	if (default_font) TTF_CloseFont(default_font);
+	if (!shared)
+	{
+		for (int i = 0; i < SGPU_FB_COUNT; i++)
+			delete[] framebuffers[i];
+		delete[] tty_buffer;
+	}
+	delete[] line_dirty;
+	delete[] tty_dirty;
+	delete[] capture_glyphs;
+	delete[] obj_mem;
 }
 
-int SGPU::fillBlock()
+void SGPU::renderConsole(const char* text, int end, bool* dirty)
 {
-	if (cmd_buf.data[2] == 0)
-	{
-		unsigned int addr = (unsigned int)((cmd_buf.data[3] << 8) | cmd_buf.data[4]);
-		unsigned int count = (unsigned int)((cmd_buf.data[5] << 8) | cmd_buf.data[6]);
-
-#ifndef LITTLE_ENDIAN
-		addr = endian_swap(addr);
-		count = endian_swap(count);
-#endif // LITTLE_ENDIAN
+	SDL_SetRenderTarget(renderer, tty_tex);
+	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
 
+	for (int i = 0; i < tty_size; i++)
+	{
+		if (!dirty[i]) continue;
+		dirty[i] = false;
 
-		if ((cmd_tmp + addr) >= (unsigned int)(fb0_width * fb0_height + 1))
+		SDL_Rect dst = { (i % TTY_WIDTH) * glyph_width, (i / TTY_WIDTH) * glyph_height, glyph_width, glyph_height };
+		int glyph = (i < end) ? (unsigned char)text[i] - TTY_GLYPH_FIRST : 0;
+		if (glyph > 0 && glyph < TTY_GLYPH_COUNT) // 0 is the space
 		{
-			cerr << "count = " << hex << count << endl;
-			cerr << "Illegal access to Framebuffer (index exceeds size)" << endl;
-			return 0;
+			SDL_Rect src = { glyph * glyph_width, 0, glyph_width, glyph_height };
+			SDL_RenderCopy(renderer, glyph_atlas, &src, &dst);
 		}
-
-		int i;
-		for (i = 0; i < 8; i++)
+		else
 		{
-			if (cmd_tmp >= count)
-			{
-				return 0;
-			}
-
-			framebuffer0[addr + cmd_tmp] = cmd_buf.data[7];
-			cmd_tmp++;
+			SDL_RenderFillRect(renderer, &dst);
 		}
 	}
 
-	framebuffer_changed = true;
+	SDL_SetRenderTarget(renderer, NULL);
+}
 
-	return 1;
+void SGPU::markCellsDirty(int from, int to)
+{
+	for (int i = max(from, 0); i < to && i < tty_size; i++)
+		tty_dirty[i] = true;
+	tty_changed = true;
 }
 
 int SGPU::writeCharacter()
 {
-	char c = cmd_buf.data[2];
+	char c = cmd.data[2];
 	int c_idx = 1;
 	tty_index = cursor_y * TTY_WIDTH + cursor_x;
 	int count = 0;
@@ -276,17 +1474,19 @@ int SGPU::writeCharacter()
 		if (tty_index >= tty_size) tty_index = 0; // wrap around when buffer is full
 
 		tty_buffer[tty_index++] = c;
-		c = cmd_buf.data[2 + c_idx++];
+		c = cmd.data[2 + c_idx++];
 		count++;
 	}
 	if (tty_index >= tty_size) tty_index = tty_size - 1;
 	tty_buffer[tty_index] = 0;
 
-	SDL_Color White = {255, 255, 255};
-	SDL_Surface* tty_surface = TTF_RenderText_Solid(default_font, tty_buffer, White);
-	tty_tex = SDL_CreateTextureFromSurface(renderer, tty_surface);
-
-	tty_changed = true;
+	/* Text is shown up to the first 0, cells between the old and new end change as well */
+	int start = cursor_y * TTY_WIDTH + cursor_x;
+	int end = (int)strlen(tty_buffer);
+	if (count >= tty_size - start) markCellsDirty(0, tty_size); // wrapped around
+	else markCellsDirty(start, tty_index + 1);
+	markCellsDirty(min(tty_end, end), max(tty_end, end));
+	tty_end = end;
 
 	return 0;
 }
@@ -304,7 +1504,6 @@ int SGPU::getCmdBufId()
 void SGPU::stopCommand(int status, int response)
 {
 	cmd_tmp = 0;
-	cmd_buf.trigger = false;
 	setCmdBufId(response);
 	CLR_BIT(status, 0);
 	cmd_buf.data[0] = status;	
@@ -17,9 +17,38 @@
     along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <config.standard.h>
 #include <stdafx.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
+#include "memory.h"
+#include "shared_frame.h"
+
+class StateWriter;
+class StateReader;
+
+/* Glyphs in the console glyph atlas (printable ASCII) */
+#define TTY_GLYPH_FIRST 32
+#define TTY_GLYPH_COUNT 95
+
+/* Frames handed to the render thread (triple buffer) */
+#define RENDER_FRAME_COUNT 3
+#define RENDER_FRAME_FRESH 4 // set in the shared frame index until the frame is taken
+
+/* Origin of the running command */
+#define CMD_SOURCE_BUFFER 0
+#define CMD_SOURCE_RING 1
+
+/**
+ * Activity counters of the command engine
+ */
+struct SGPUStats
+{
+	uint64_t commands[SGPU_CMD_FLIP + 1]; // completed commands by id, [0] = unknown ids
+	uint64_t rejected; // commands answered with SGPU_CMD_NACK
+	uint64_t bytes_drawn; // framebuffer bytes written by commands
+	uint64_t irqs; // enabled interrupts raised
+};
 
 class SGPU
 {
@@ -30,10 +59,38 @@ public:
 	 */
 	SGPU(int addr);
 
-	int init(int width, int height);
+	/**
+	 * Creates the window; with 'render_thread' textures are uploaded
+	 * and presented on a thread of their own
+	 */
+	int init(int width, int height, bool render_thread);
+
+	/**
+	 * Initializes the SGPU without window, renderer and fonts
+	 */
+	int initHeadless();
 
 	int initFB0(int width, int height);
 
+	/**
+	 * Executes fills on a worker thread instead of the emulation thread.
+	 * Only status, ACK and IRQ timing is preserved: the worker writes the
+	 * whole fill at once, so framebuffer reads during a running fill may
+	 * see pixels the inline engine would not have written yet
+	 */
+	int startWorker();
+
+	/**
+	 * Places framebuffers and TTY cells in 'shared' and publishes frames there,
+	 * must be called before init()/initHeadless()
+	 */
+	void setSharedFrame(SharedFrame* shared);
+
+	/**
+	 * Sets the page table used as DMA source
+	 */
+	void setMemoryMap(MemoryMap* memory_map);
+
 	void writeFB(dword addr, byte value);
 
 	byte readFB(dword addr);
@@ -42,11 +99,96 @@ public:
 
 	byte readIO(byte port);
 
+	/**
+	 * Object unit registers (SGPU_OBJ_IO_OFFSET range)
+	 */
+	void writeObjectIO(byte port, byte value);
+
+	byte readObjectIO(byte port);
+
+	/**
+	 * Framebuffer the CPU and commands draw into
+	 */
 	byte* getFB0();
 
+	/**
+	 * Framebuffer that is displayed (differs from getFB0() when double buffering)
+	 */
+	byte* getFrontBuffer();
+
+	/**
+	 * Composites the displayed framebuffer, tile layer and sprites into 'out'
+	 * (fb0_width * fb0_height bytes, RGB332)
+	 */
+	void composeFrame(byte* out);
+
+	/**
+	 * Scales the console glyphs down to capture cells, loading the default
+	 * font if there is no window; returns -1 if captures go without console
+	 */
+	int initCaptureConsole();
+
+	/**
+	 * Blends the TTY cells over a frame from composeFrame() (no-op
+	 * without initCaptureConsole())
+	 */
+	void composeConsole(byte* out);
+
+	int getFramebufferPage();
+
+	/**
+	 * Framebuffer offset and size of the window at FB_N_OFFSET
+	 * (depends on page number and mode)
+	 */
+	unsigned int getWindowStart();
+
+	unsigned int getWindowSize();
+
+	byte getMode();
+
+	/**
+	 * Presents the framebuffer and TTY if either of them changed
+	 * (or hands them to the render thread), returns 1 if a frame has been presented
+	 */
 	int render();
 
-	void cycle();
+	/**
+	 * Lets the command engine catch up to CPU cycle 'now'
+	 */
+	void sync(uint64_t now);
+
+	/**
+	 * Cycle at which the running command completes
+	 * (UINT64_MAX if there is none)
+	 */
+	uint64_t getNextEvent();
+
+	/**
+	 * Returns true while a command is being executed or queued
+	 */
+	bool isBusy();
+
+	/**
+	 * Returns true once for every enabled interrupt raised since the last call
+	 */
+	bool pollIRQ();
+
+	/**
+	 * Appends registers, command engine, object memory, framebuffers
+	 * and console to 'state' (waits for a running fill first)
+	 */
+	void saveState(StateWriter& state);
+
+	/**
+	 * Restores the state saved by saveState(), the framebuffer size has to match.
+	 * Returns -1 on errors.
+	 */
+	int loadState(StateReader& state);
+
+	inline const SGPUStats& getStats()
+	{
+		return stats;
+	}
 
 	/**
 	 * Prints out debugging information.
@@ -56,7 +198,150 @@ public:
 	~SGPU();
 
 private:
-	int fillBlock();
+	int initBuffers();
+
+	/**
+	 * Creates the renderer and textures, these may only be used by the calling thread
+	 */
+	int initRenderer();
+
+	void destroyRenderer();
+
+	int startRenderThread();
+
+	static int renderMain(void* data);
+
+	/**
+	 * Copies the composited frame and console into the next free frame and publishes it
+	 */
+	int publishFrame();
+
+	/**
+	 * Publishes the dirty lines of the front buffer to the shared memory segment
+	 */
+	void publishShared();
+
+	/**
+	 * Uploads the scanlines and console cells that differ from the last presented frame
+	 * (render thread)
+	 */
+	void presentFrame(int index);
+
+	/**
+	 * Draws both layers and presents them
+	 */
+	void presentLayers();
+
+	/**
+	 * Starts the triggered command in the command buffer or else
+	 * the next entry of the command ring, returns false if there is none
+	 */
+	bool startNextCommand();
+
+	/**
+	 * Latches the command in 'data' (laid out like the command buffer),
+	 * which starts at the current cycle
+	 */
+	void startCommand(const byte* data, int source);
+
+	/**
+	 * Number of cycles the latched command takes (-1 if it never completes)
+	 */
+	int getCommandCycles();
+
+	/**
+	 * Brings the running command to the state 'elapsed' cycles after its start
+	 */
+	void advanceCommand(uint64_t elapsed);
+
+	void finishCommand();
+
+	/**
+	 * Advances the ring tail past the completed entry and raises its interrupts
+	 */
+	void retireRingEntry(int response);
+
+	void raiseIRQ(int status_bit);
+
+	/**
+	 * Fills the latched fill region up to byte 'end'
+	 */
+	void fillTo(unsigned int end);
+
+	/**
+	 * Copies a rectangle inside the framebuffer, source and destination may overlap
+	 */
+	void blitRect(int x, int y, int w, int h, int dst_x, int dst_y);
+
+	/**
+	 * Moves the framebuffer content by 'dx'/'dy', uncovered bytes are set to 'value'
+	 */
+	void scroll(int dx, int dy, byte value);
+
+	/**
+	 * Copies 'size' bytes of guest memory at 'src' to framebuffer offset 'dst'
+	 */
+	void dmaCopy(dword src, unsigned int dst, unsigned int size);
+
+	/**
+	 * Reads 'size' bytes of guest memory at 'src' into 'dst'
+	 */
+	void readGuestMemory(dword src, byte* dst, unsigned int size);
+
+	void waitForWorker();
+
+	void updateWindow();
+
+	/**
+	 * Selects the draw and front buffer after a flip or mode change
+	 */
+	void updateBuffers();
+
+	/**
+	 * Shows the back buffer (if double buffering) and raises the flip interrupt
+	 */
+	void flip();
+
+	/**
+	 * Marks the scanlines covering 'size' bytes at framebuffer offset 'offset' for upload
+	 */
+	void markDirty(unsigned int offset, unsigned int size);
+
+	/**
+	 * Same as markDirty() for changes of the draw buffer, which are only uploaded if it is displayed
+	 */
+	void markDrawn(unsigned int offset, unsigned int size);
+
+	/**
+	 * Uploads the dirty scanlines to the framebuffer texture
+	 */
+	void uploadFramebuffer();
+
+	/**
+	 * Composites scanline 'y' of the framebuffer, tile layer and sprites into 'out'
+	 */
+	void composeLine(int y, byte* out);
+
+	/**
+	 * Writes object memory and marks the scanlines showing the change
+	 */
+	void writeObject(unsigned int obj_addr, byte value);
+
+	void markSpriteDirty(int sprite);
+
+	static int workerMain(void* data);
+
+	/**
+	 * Rasterizes the glyph atlas and creates the console texture
+	 */
+	int initConsole();
+
+	/**
+	 * Draws the dirty console cells of 'text' (shown up to 'end') into the console texture
+	 */
+	void renderConsole(const char* text, int end, bool* dirty);
+
+	void markCellsDirty(int from, int to);
 
 	int writeCharacter();
 
@@ -67,19 +352,87 @@ private:
 	void stopCommand(int status, int response);
 
 	int addr;
-	byte* framebuffer0;
+	byte* framebuffers[SGPU_FB_COUNT];
+	int front; // index of the displayed framebuffer
+	byte* framebuffer0; // draw buffer
+	byte* front_buffer;
 	int fb0_width, fb0_height;
 	byte framebuffer_page;
-	bool framebuffer_changed;
+	byte mode;
+	unsigned int window_start, window_size;
+	bool framebuffer_changed; // any scanline dirty
+	bool* line_dirty;
 
 	/* Command buffer */
 	struct
 	{
 		byte data[256];
-		bool trigger;
 	} cmd_buf;
 	byte cmd_buf_addr;
-	unsigned int cmd_tmp;
+	unsigned int cmd_tmp; // bytes done by the running command
+	uint64_t synced_cycles;
+
+	/* Running command, latched when it starts */
+	struct
+	{
+		bool running;
+		int source; // CMD_SOURCE_*
+		const byte* data; // command buffer or ring entry
+		int id;
+		uint64_t start; // first cycle of the command
+		int cycles; // modeled duration, -1 = never completes
+		unsigned int addr, size; // FILL/DMA region (clipped to the framebuffer)
+		byte value;
+		int x, y, w, h; // BLIT source rectangle (clipped)
+		int dx, dy; // BLIT destination, SCROLL distance
+		dword src; // DMA source address
+	} cmd;
+
+	/* Command ring */
+	byte ring_base; // page, 0 = disabled
+	byte ring_head, ring_tail;
+	byte ring_entry[SGPU_RING_ENTRY_SIZE + 1]; // running entry, 0 terminated for TTY writes
+	byte irq_reg; // enable and status bits
+	bool irq_raised;
+
+	SGPUStats stats;
+
+	/* Object unit */
+	byte* obj_mem; // SGPU_OBJ_MEM_SIZE bytes: tiles, tile map and sprites
+	dword obj_addr;
+	byte obj_ctrl;
+	byte tile_key;
+	byte tile_scroll_x, tile_scroll_y;
+
+	MemoryMap* memory_map;
+	SharedFrame* shared; // holds the framebuffers and TTY cells if not NULL
+
+	/* Render thread */
+	struct
+	{
+		byte* pixels; // composited framebuffer
+		char* tty;
+		int tty_end;
+	} frames[RENDER_FRAME_COUNT];
+	int frame_back; // filled by the emulation thread
+	int frame_front; // presented by the render thread
+	SDL_atomic_t frame_middle; // latest published frame
+	SDL_Thread* render_thread;
+	SDL_sem* render_wake;
+	SDL_sem* render_started;
+	int render_status;
+	bool render_quit;
+	bool render_full; // nothing has been uploaded yet
+	byte* shown_pixels; // owned by the render thread from here on
+	char* shown_tty;
+	bool* shown_tty_dirty;
+
+	/* Fill worker */
+	SDL_Thread* worker;
+	SDL_sem* worker_job;
+	SDL_sem* worker_done;
+	bool worker_busy;
+	bool worker_quit;
 
 	/* Internal stuff */
 	SDL_TimerID framebuffer_timer;
@@ -89,9 +442,15 @@ private:
 
 	/* Console rendering */
 	TTF_Font* default_font;
-	SDL_Texture* tty_tex;
+	SDL_Texture* glyph_atlas;
+	SDL_Texture* tty_tex; // TTY_WIDTH x TTY_HEIGHT cells, render target
+	int glyph_width, glyph_height;
+	byte* capture_glyphs; // TTY_GLYPH_COUNT alpha masks of one capture cell each
+	int capture_cell_width, capture_cell_height;
 	char* tty_buffer;
+	bool* tty_dirty; // per cell
 	int tty_index, tty_size;
+	int tty_end; // text ends at the first 0 in tty_buffer
 	int tty_changed;
 	int cursor_x, cursor_y;
 };
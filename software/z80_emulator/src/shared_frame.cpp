@@ -0,0 +1,137 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "shared_frame.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+SharedFrame::SharedFrame()
+{
+	segment = NULL;
+	size = 0;
+}
+
+int SharedFrame::open(const string& name)
+{
+#ifdef _WIN32
+	cerr << "Shared memory export is not supported on this platform" << endl;
+	return -1;
+#else
+	this->name = (name[0] == '/') ? name : "/" + name;
+
+	uint32_t fb_size = FB_WIDTH * FB_HEIGHT;
+	uint32_t framebuffer_offset = (sizeof(SharedFrameHeader) + 63) & ~63; // cache line aligned
+	uint32_t tty_offset = framebuffer_offset + SGPU_FB_COUNT * fb_size;
+	size = tty_offset + TTY_WIDTH * TTY_HEIGHT + 1;
+
+	int fd = shm_open(this->name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		cerr << "Unable to create shared memory '" << this->name << "'" << endl;
+		return -1;
+	}
+	void* data = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd); // the mapping stays valid
+	if (data == MAP_FAILED)
+	{
+		cerr << "Unable to map shared memory '" << this->name << "'" << endl;
+		shm_unlink(this->name.c_str());
+		return -1;
+	}
+	segment = (byte*)data;
+
+	SharedFrameHeader* header = getHeader();
+	header->width = FB_WIDTH;
+	header->height = FB_HEIGHT;
+	header->buffer_count = SGPU_FB_COUNT;
+	header->framebuffer_offset = framebuffer_offset;
+	header->tty_width = TTY_WIDTH;
+	header->tty_height = TTY_HEIGHT;
+	header->tty_offset = tty_offset;
+	header->version = SHARED_FRAME_VERSION;
+	SDL_AtomicSet(&header->sequence, 0);
+	SDL_AtomicSet(&header->acknowledged, 0);
+	header->magic = SHARED_FRAME_MAGIC; // last, the header is complete
+
+	cout << "Exporting framebuffer to shared memory '" << this->name << "'" << endl;
+	return 0;
+#endif
+}
+
+bool SharedFrame::isOpen()
+{
+	return segment != NULL;
+}
+
+SharedFrameHeader* SharedFrame::getHeader()
+{
+	return (SharedFrameHeader*)segment;
+}
+
+byte* SharedFrame::getFramebuffer(int index)
+{
+	SharedFrameHeader* header = getHeader();
+	return segment + header->framebuffer_offset + index * header->width * header->height;
+}
+
+char* SharedFrame::getConsole()
+{
+	return (char*)segment + getHeader()->tty_offset;
+}
+
+void SharedFrame::publish(const bool* line_dirty, int front, uint64_t cycles)
+{
+	SharedFrameHeader* header = getHeader();
+	int sequence = SDL_AtomicAdd(&header->sequence, 1); // odd: being updated
+
+	/* Lines accumulate until the reader has seen them */
+	if (SDL_AtomicGet(&header->acknowledged) == sequence)
+		memset(header->dirty_lines, 0, sizeof(header->dirty_lines));
+	for (uint32_t line = 0; line < header->height && line < SHARED_DIRTY_SIZE * 8; line++)
+	{
+		if (line_dirty[line]) header->dirty_lines[line / 8] |= 1 << (line % 8);
+	}
+	header->front = front;
+	header->cycles = cycles;
+
+	SDL_AtomicAdd(&header->sequence, 1);
+}
+
+void SharedFrame::close()
+{
+#ifndef _WIN32
+	if (!segment) return;
+	munmap(segment, size);
+	shm_unlink(name.c_str());
+	segment = NULL;
+#endif
+}
+
+SharedFrame::~SharedFrame()
+{
+	close();
+}
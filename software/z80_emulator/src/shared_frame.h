@@ -0,0 +1,101 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SHARED_FRAME_H
+#define SHARED_FRAME_H
+
+#include <config.standard.h>
+#include <stdafx.h>
+#include <SDL2/SDL.h>
+
+#define SHARED_FRAME_MAGIC 0x4246385a // "Z8FB"
+#define SHARED_FRAME_VERSION 2
+#define SHARED_DIRTY_SIZE 32 // bytes of the dirty line bitmap (up to 256 lines)
+
+/**
+ * Header at the start of the shared memory segment, followed by
+ * 'buffer_count' framebuffers (RGB332) and the TTY cells
+ * (text ends at the first 0). Offsets are relative to the segment start.
+ *
+ * The sequence only guards the header. The framebuffers and TTY cells are
+ * the ones the SGPU draws into, so only the front buffer in double buffered
+ * mode is stable between two publishes; a single buffered frame or the
+ * console may be read while it is being drawn.
+ */
+struct SharedFrameHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width, height;
+	uint32_t buffer_count;
+	uint32_t framebuffer_offset; // framebuffer i is at framebuffer_offset + i * width * height
+	uint32_t tty_width, tty_height;
+	uint32_t tty_offset;
+	uint32_t front; // index of the displayed framebuffer
+	SDL_atomic_t sequence; // odd while the header is updated, +2 per published frame
+	SDL_atomic_t acknowledged; // written by the reader: sequence of the last frame it has consumed
+	uint64_t cycles; // CPU cycle of the last published frame
+	uint8_t dirty_lines[SHARED_DIRTY_SIZE]; // bit n % 8 of byte n / 8: scanline n changed since the acknowledged frame
+};
+
+/**
+ * Named POSIX shared memory segment that holds the SGPU framebuffers
+ * and TTY cells themselves, so external viewers can read them without copies
+ */
+class SharedFrame
+{
+public:
+	SharedFrame();
+
+	/**
+	 * Creates the segment 'name' (e.g. /z80emu0), returns 0 on success
+	 * and -1 on errors or if shared memory is not supported
+	 */
+	int open(const string& name);
+
+	bool isOpen();
+
+	SharedFrameHeader* getHeader();
+
+	byte* getFramebuffer(int index);
+
+	char* getConsole();
+
+	/**
+	 * Publishes a frame: adds the dirty lines 'line_dirty' to the bitmap, which
+	 * starts empty again once the reader has acknowledged the previous frame,
+	 * and stores the displayed buffer and the cycle
+	 */
+	void publish(const bool* line_dirty, int front, uint64_t cycles);
+
+	/**
+	 * Unmaps and removes the segment
+	 */
+	void close();
+
+	~SharedFrame();
+
+private:
+	string name;
+	byte* segment;
+	size_t size;
+};
+
+#endif // SHARED_FRAME_H
@@ -0,0 +1,174 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "symbols.h"
+#include <cstdio> // snprintf
+#include <cstdlib> // strtol
+
+static string formatAddress(dword address)
+{
+	char text[8];
+	snprintf(text, sizeof(text), "0x%04x", address);
+	return text;
+}
+
+static string stripColon(const string& token)
+{
+	return (!token.empty() && token[token.size() - 1] == ':') ? token.substr(0, token.size() - 1) : token;
+}
+
+static bool isIdentifier(const string& token)
+{
+	if (token.empty() || !(isalpha((unsigned char)token[0]) || token[0] == '_' || token[0] == '.')) return false;
+	for (size_t i = 1; i < token.size(); i++)
+	{
+		if (!(isalnum((unsigned char)token[i]) || token[i] == '_' || token[i] == '.')) return false;
+	}
+	return true;
+}
+
+/**
+ * Parses a 16 bit value: $4000, 0x4000, 4000h or decimal, 'hex' accepts plain hex digits instead of decimal
+ */
+static bool parseValue(const string& token, bool hex, dword* value)
+{
+	string digits = token;
+	int base = hex ? 16 : 10;
+	char last = digits.empty() ? 0 : digits[digits.size() - 1];
+	if (digits.size() > 1 && digits[0] == '$')
+	{
+		digits = digits.substr(1);
+		base = 16;
+	}
+	else if (digits.size() > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X'))
+	{
+		digits = digits.substr(2);
+		base = 16;
+	}
+	else if (digits.size() > 1 && (last == 'h' || last == 'H'))
+	{
+		digits = digits.substr(0, digits.size() - 1);
+		base = 16;
+	}
+	if (digits.empty()) return false;
+
+	char* end;
+	long number = strtol(digits.c_str(), &end, base);
+	if (*end != 0 || number < 0 || number > 0xffff) return false;
+	*value = (dword)number;
+	return true;
+}
+
+int SymbolTable::load(const string& file_name)
+{
+	ifstream file(file_name.c_str());
+	if (!file.is_open())
+	{
+		cerr << "Unable to load symbols from '" << file_name << "'" << endl;
+		return -1;
+	}
+
+	string line;
+	while (getline(file, line))
+	{
+		line = line.substr(0, line.find(';')); // comments
+
+		/* Split into tokens, '=' is a token of its own */
+		string tokens[8];
+		int count = 0;
+		string token;
+		for (size_t i = 0; i <= line.size() && count < 8; i++)
+		{
+			char c = (i < line.size()) ? line[i] : ' ';
+			if (c == ' ' || c == '\t' || c == '\r' || c == '=')
+			{
+				if (!token.empty()) tokens[count++] = token;
+				token.clear();
+				if (c == '=' && count < 8) tokens[count++] = "=";
+			}
+			else token += c;
+		}
+
+		dword address;
+		if (count >= 3 && (tokens[1] == "=" || tokens[1] == "equ" || tokens[1] == "EQU"))
+		{
+			/* Label file: name: equ $4000 */
+			if (isIdentifier(stripColon(tokens[0])) && parseValue(tokens[2], false, &address))
+				add(stripColon(tokens[0]), address);
+		}
+		else if (count >= 2 && parseValue(stripColon(tokens[0]), true, &address))
+		{
+			/* Listing (4000 ... label:) or map file (4000 label) */
+			bool found = false;
+			for (int i = 1; i < count && !found; i++)
+			{
+				if (tokens[i].size() > 1 && tokens[i][tokens[i].size() - 1] == ':' && isIdentifier(stripColon(tokens[i])))
+				{
+					add(stripColon(tokens[i]), address);
+					found = true;
+				}
+			}
+			if (!found && count == 2 && isIdentifier(tokens[1])) add(tokens[1], address);
+		}
+	}
+
+	cout << "Loaded " << dec << names.size() << " symbols from '" << file_name << "'" << endl;
+	return 0;
+}
+
+void SymbolTable::add(const string& name, dword address)
+{
+	if (!names.count(address)) names[address] = name; // the first label of an address names it
+	addresses[name] = address;
+}
+
+bool SymbolTable::isEmpty()
+{
+	return names.empty();
+}
+
+unsigned int SymbolTable::getCount()
+{
+	return (unsigned int)names.size();
+}
+
+string SymbolTable::getName(dword address)
+{
+	map<dword, string>::const_iterator it = names.find(address);
+	return (it != names.end()) ? it->second : formatAddress(address);
+}
+
+string SymbolTable::describe(dword address)
+{
+	map<dword, string>::const_iterator it = names.upper_bound(address);
+	if (it == names.begin()) return formatAddress(address);
+	--it;
+	if (it->first == address) return it->second;
+	if (address - it->first > SYMBOL_MAX_OFFSET) return formatAddress(address);
+
+	char offset[8];
+	snprintf(offset, sizeof(offset), "+0x%x", address - it->first);
+	return it->second + offset;
+}
+
+int SymbolTable::findAddress(const string& name)
+{
+	map<string, dword>::const_iterator it = addresses.find(name);
+	return (it != addresses.end()) ? it->second : -1;
+}
@@ -0,0 +1,69 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include <stdafx.h>
+#include <map>
+
+#define SYMBOL_MAX_OFFSET 0x400 // addresses further away from a symbol are printed as numbers
+
+/**
+ * Guest symbol names loaded from an assembler label file, listing or map file
+ */
+class SymbolTable
+{
+public:
+	/**
+	 * Adds the symbols found in 'file_name'. Recognized lines:
+	 * 'name: equ $4000' / 'name = 0x4000' (z80asm label files),
+	 * '4000 name' (map files) and '4000 ... name:' (listings).
+	 * Returns 0 on success and -1 if the file cannot be read.
+	 */
+	int load(const string& file_name);
+
+	bool isEmpty();
+
+	unsigned int getCount();
+
+	/**
+	 * Name of the symbol at 'address', "0x4000" if there is none
+	 */
+	string getName(dword address);
+
+	/**
+	 * Address relative to the nearest symbol below, e.g. "loop+0x3"
+	 * (a plain number beyond SYMBOL_MAX_OFFSET)
+	 */
+	string describe(dword address);
+
+	/**
+	 * Address of the symbol 'name', -1 if unknown
+	 */
+	int findAddress(const string& name);
+
+private:
+	void add(const string& name, dword address);
+
+	map<dword, string> names;
+	map<string, dword> addresses;
+};
+
+#endif // SYMBOLS_H
@@ -0,0 +1,92 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "throttle.h"
+
+Throttle::Throttle()
+{
+	counter_frequency = 1;
+	start_counter = 0;
+	start_cycles = 0;
+	counts_per_cycle = 0;
+	lag = 0;
+	max_lag = 0;
+	dropped = 0;
+}
+
+void Throttle::start(uint64_t cycles, int frequency, double speed)
+{
+	counter_frequency = SDL_GetPerformanceFrequency();
+	start_counter = SDL_GetPerformanceCounter();
+	start_cycles = cycles;
+	counts_per_cycle = (double)counter_frequency / (frequency * speed);
+	lag = 0;
+}
+
+void Throttle::sync(uint64_t cycles)
+{
+	Uint64 target = start_counter + (Uint64)((cycles - start_cycles) * counts_per_cycle);
+	Uint64 now = SDL_GetPerformanceCounter();
+
+	lag = (Sint64)(now - target);
+	if (lag < 0)
+	{
+		/* Ahead of host time, sleep whole milliseconds and leave the rest to the next slice */
+		Uint32 ms = (Uint32)((-lag * 1000) / counter_frequency);
+		if (ms > 0) SDL_Delay(ms);
+		lag = 0;
+		return;
+	}
+
+	if (lag > max_lag) max_lag = lag;
+
+	/* Behind: run unthrottled to catch up, unless the gap became too large */
+	Sint64 max_counts = (Sint64)(counter_frequency * THROTTLE_MAX_LAG / 1000);
+	if (lag > max_counts)
+	{
+		dropped += lag;
+		start_counter += lag;
+		lag = 0;
+	}
+}
+
+double Throttle::getLag()
+{
+	return toMs(lag);
+}
+
+double Throttle::getMaxLag()
+{
+	return toMs(max_lag);
+}
+
+double Throttle::getDroppedTime()
+{
+	return toMs(dropped);
+}
+
+double Throttle::toMs(Sint64 counts)
+{
+	return counts * 1000.0 / counter_frequency;
+}
+
+Throttle::~Throttle()
+{
+}
@@ -0,0 +1,76 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stdafx.h>
+#include <SDL2/SDL.h>
+
+/* Lag (in ms) after which the throttle stops catching up and drops the time */
+#define THROTTLE_MAX_LAG 250
+
+/**
+ * Holds emulated time in step with host time. Emulated cycles are
+ * compared against the host performance counter relative to a common
+ * starting point, so rounding errors of single sleeps do not accumulate.
+ */
+class Throttle
+{
+public:
+	Throttle();
+
+	/**
+	 * Starts throttling at cycle 'cycles' with 'frequency' cycles per second,
+	 * multiplied by 'speed'
+	 */
+	void start(uint64_t cycles, int frequency, double speed);
+
+	/**
+	 * Sleeps until host time reached emulated cycle 'cycles'.
+	 * Returns without sleeping if the emulation is behind.
+	 */
+	void sync(uint64_t cycles);
+
+	/**
+	 * Current lag behind host time in ms
+	 */
+	double getLag();
+
+	double getMaxLag();
+
+	/**
+	 * Host time in ms that has been dropped because the emulation could not catch up
+	 */
+	double getDroppedTime();
+
+	~Throttle();
+
+private:
+	double toMs(Sint64 counts);
+
+	Uint64 counter_frequency;
+	Uint64 start_counter;
+	uint64_t start_cycles;
+	double counts_per_cycle;
+	Sint64 lag, max_lag, dropped; // in performance counter units
+};
+
+#endif // THROTTLE_H
@@ -0,0 +1,233 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "trace.h"
+#include <csignal>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h> // _open, _write
+#else
+#include <unistd.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static Tracer* signal_tracer = NULL;
+static volatile sig_atomic_t dump_signal = 0;
+static volatile sig_atomic_t quit_signal = 0;
+
+static const char* dump_reasons[TRACE_DUMP_REASONS] = { "exit", "halt", "illegal opcode", "request", "signal", "crash" };
+
+Tracer::Tracer()
+{
+	ring = NULL;
+	block_count = 0;
+	block_used = NULL;
+	block = 0;
+	wrapped = false;
+	out = NULL;
+	block_end = NULL;
+	keyframe = true;
+	memset(last_regs, 0, sizeof(last_regs));
+	next_pc = 0;
+	last_cycles = 0;
+	records = 0;
+	pending_reason = -1;
+	dumped = 0;
+}
+
+int Tracer::init(const string& file_name, unsigned int size)
+{
+	this->file_name = file_name;
+	block_count = max(size / TRACE_BLOCK_SIZE, 2u); // dropping the oldest block keeps at least one
+	ring = new byte[(size_t)block_count * TRACE_BLOCK_SIZE];
+	block_used = new unsigned int[block_count];
+	if (!ring || !block_used)
+	{
+		cerr << "Unable to allocate the trace buffer" << endl;
+		return -1;
+	}
+	memset(block_used, 0, block_count * sizeof(unsigned int));
+
+	block = 0;
+	out = ring;
+	block_end = ring + TRACE_BLOCK_SIZE;
+	keyframe = true;
+	cout << "Tracing into a " << dec << (block_count * (TRACE_BLOCK_SIZE / 1024)) << " KiB ring, dumps go to '" << file_name << "'" << endl;
+	return 0;
+}
+
+void Tracer::nextBlock()
+{
+	block_used[block] = (unsigned int)(out - (ring + (size_t)block * TRACE_BLOCK_SIZE));
+	block++;
+	if (block == block_count)
+	{
+		block = 0;
+		wrapped = true;
+	}
+	out = ring + (size_t)block * TRACE_BLOCK_SIZE;
+	block_end = out + TRACE_BLOCK_SIZE;
+	block_used[block] = 0;
+	keyframe = true;
+}
+
+void Tracer::requestDump(int reason)
+{
+	if (reason == TRACE_DUMP_HALT || reason == TRACE_DUMP_ILLEGAL)
+	{
+		if (GET_BIT(dumped, reason)) return;
+		SET_BIT(dumped, reason);
+	}
+	pending_reason = reason;
+}
+
+int Tracer::dump(int reason)
+{
+	pending_reason = -1;
+	int fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (fd < 0 || writeDump(fd, reason))
+	{
+		cerr << "Unable to write trace to '" << file_name << "'" << endl;
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	close(fd);
+	cout << "Trace dumped to '" << file_name << "' (" << dump_reasons[reason] << ", "
+		<< dec << records << " instructions recorded)" << endl;
+	return 0;
+}
+
+static bool writeAll(int fd, const byte* data, size_t size)
+{
+	while (size > 0)
+	{
+		int written = (int)write(fd, data, (unsigned int)size);
+		if (written <= 0) return false;
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+static void putLE(byte* dst, uint64_t value, int size)
+{
+	for (int i = 0; i < size; i++)
+		dst[i] = (byte)(value >> (i * 8));
+}
+
+int Tracer::writeDump(int fd, int reason)
+{
+	unsigned int first = wrapped ? (block + 1) % block_count : 0;
+	unsigned int count = wrapped ? block_count : block + 1;
+
+	byte header[TRACE_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	memcpy(header, TRACE_MAGIC, 8);
+	putLE(header + 8, TRACE_VERSION, 2);
+	header[10] = (byte)reason;
+	putLE(header + 12, TRACE_BLOCK_SIZE, 4);
+	putLE(header + 16, count, 4);
+	putLE(header + 20, last_cycles, 8);
+	if (!writeAll(fd, header, sizeof(header))) return -1;
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		unsigned int index = (first + i) % block_count;
+		byte* data = ring + (size_t)index * TRACE_BLOCK_SIZE;
+		unsigned int used = block_used[index];
+		if (index == block) used = (out >= data && out <= data + TRACE_BLOCK_SIZE) ? (unsigned int)(out - data) : 0; // may be switching blocks
+		byte size[4];
+		putLE(size, used, 4);
+		if (!writeAll(fd, size, 4) || !writeAll(fd, data, used)) return -1;
+	}
+	return 0;
+}
+
+void Tracer::installSignalHandlers()
+{
+	signal_tracer = this;
+	signal(SIGSEGV, handleSignal);
+	signal(SIGABRT, handleSignal);
+	signal(SIGFPE, handleSignal);
+	signal(SIGINT, handleSignal);
+	signal(SIGTERM, handleSignal);
+#ifdef SIGBUS
+	signal(SIGBUS, handleSignal);
+#endif
+#ifdef SIGUSR1
+	signal(SIGUSR1, handleSignal);
+#endif
+}
+
+void Tracer::handleSignal(int sig)
+{
+#ifdef SIGUSR1
+	if (sig == SIGUSR1)
+	{
+		dump_signal = 1; // dumped by the emulation thread
+		return;
+	}
+#endif
+	if ((sig == SIGINT || sig == SIGTERM) && !quit_signal)
+	{
+		quit_signal = 1; // the machine quits and dumps on exit, like closing the window
+		return;
+	}
+
+	/* Fatal: dump with write() only and terminate as usual */
+	if (signal_tracer)
+	{
+		int fd = open(signal_tracer->file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+		if (fd >= 0)
+		{
+			signal_tracer->writeDump(fd, TRACE_DUMP_CRASH);
+			close(fd);
+		}
+		signal_tracer = NULL;
+	}
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+bool Tracer::pollSignal()
+{
+	if (!dump_signal) return false;
+	dump_signal = 0;
+	return true;
+}
+
+bool Tracer::pollQuitSignal()
+{
+	return quit_signal != 0;
+}
+
+uint64_t Tracer::getRecordCount()
+{
+	return records;
+}
+
+Tracer::~Tracer()
+{
+	if (signal_tracer == this) signal_tracer = NULL;
+	delete[] ring;
+	delete[] block_used;
+}
@@ -0,0 +1,212 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdafx.h>
+#include <atomic>
+
+/*
+ * Trace file layout (little endian):
+ *   header: "Z80TRACE", u16 version, u8 dump reason, u8 reserved,
+ *           u32 block size, u32 block count, u64 cycles at the dump, u32 reserved
+ *   blocks (oldest first): u32 used bytes, records
+ * Every block starts with a keyframe, so the oldest block can be dropped
+ * from the ring without losing the state needed to decode the others.
+ *
+ * Record: u8 header, [u16 PC], instruction bytes, then for keyframes
+ * AF, BC, DE, HL, SP (u16 each) and u64 cycles, otherwise [u8 register
+ * mask, changed registers (u16 each)] and the cycles since the previous
+ * record (LEB128). Registers and cycles are the state after the instruction.
+ */
+#define TRACE_MAGIC "Z80TRACE"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 32
+#define TRACE_BLOCK_SIZE 0x10000
+#define TRACE_RECORD_MAX 32 // largest record (keyframe with 4 instruction bytes)
+#define TRACE_DEFAULT_SIZE 16 // ring size in MiB
+
+/* Record header bits */
+#define TRACE_LENGTH_MASK 0x03	// instruction length - 1
+#define TRACE_PC 0x04			// PC follows, otherwise it is the address after the previous instruction
+#define TRACE_KEYFRAME 0x08		// all registers and the absolute cycle count follow
+#define TRACE_REGS 0x10			// register mask follows (bit n: register n of AF, BC, DE, HL, SP)
+#define TRACE_IRQ 0x20			// an interrupt has been taken before the instruction
+#define TRACE_REG_COUNT 5
+
+/* Dump reasons */
+#define TRACE_DUMP_EXIT 0		// emulator exit
+#define TRACE_DUMP_HALT 1		// HALT with interrupts disabled
+#define TRACE_DUMP_ILLEGAL 2	// illegal opcode
+#define TRACE_DUMP_REQUEST 3	// DDS instruction
+#define TRACE_DUMP_SIGNAL 4		// SIGUSR1
+#define TRACE_DUMP_CRASH 5		// fatal signal (emulator crash, SIGINT, SIGTERM)
+#define TRACE_DUMP_REASONS 6
+
+/**
+ * Records every executed instruction into a fixed-size ring of delta
+ * encoded blocks, which is written to a file on request (see tracedump)
+ */
+class Tracer
+{
+public:
+	Tracer();
+
+	/**
+	 * Allocates a ring of 'size' bytes, dumps go to 'file_name'.
+	 * Returns 0 on success and -1 on errors.
+	 */
+	int init(const string& file_name, unsigned int size);
+
+	/**
+	 * Appends an executed instruction, 'regs' holds AF, BC, DE, HL and SP
+	 */
+	inline void record(dword pc, const byte* bytes, int length, const dword* regs, uint64_t cycles, bool irq)
+	{
+		if (out + TRACE_RECORD_MAX > block_end) nextBlock();
+
+		byte* p = out; // published when complete, a dump in a signal handler sees whole records only
+		byte* header = p++;
+		*header = (byte)((length - 1) & TRACE_LENGTH_MASK);
+		if (irq) *header |= TRACE_IRQ;
+		if (keyframe || pc != next_pc)
+		{
+			*header |= TRACE_PC;
+			*p++ = pc & 0xff;
+			*p++ = pc >> 8;
+		}
+		for (int i = 0; i < length; i++)
+			*p++ = bytes[i];
+
+		if (keyframe)
+		{
+			*header |= TRACE_KEYFRAME;
+			for (int i = 0; i < TRACE_REG_COUNT; i++)
+			{
+				*p++ = regs[i] & 0xff;
+				*p++ = regs[i] >> 8;
+			}
+			for (int i = 0; i < 8; i++)
+				*p++ = (byte)(cycles >> (i * 8));
+			keyframe = false;
+		}
+		else
+		{
+			byte mask = 0;
+			for (int i = 0; i < TRACE_REG_COUNT; i++)
+			{
+				if (regs[i] != last_regs[i]) SET_BIT(mask, i);
+			}
+			if (mask)
+			{
+				*header |= TRACE_REGS;
+				*p++ = mask;
+				for (int i = 0; i < TRACE_REG_COUNT; i++)
+				{
+					if (!GET_BIT(mask, i)) continue;
+					*p++ = regs[i] & 0xff;
+					*p++ = regs[i] >> 8;
+				}
+			}
+
+			uint64_t delta = cycles - last_cycles;
+			while (delta >= 0x80)
+			{
+				*p++ = (byte)(delta | 0x80);
+				delta >>= 7;
+			}
+			*p++ = (byte)delta;
+		}
+
+		atomic_signal_fence(memory_order_release);
+		out = p;
+
+		memcpy(last_regs, regs, sizeof(last_regs));
+		next_pc = (dword)(pc + length);
+		last_cycles = cycles;
+		records++;
+
+		if (pending_reason >= 0) dump(pending_reason);
+	}
+
+	/**
+	 * Dumps once the instruction being executed has been recorded, automatic
+	 * triggers (HALT, illegal opcodes) only dump on their first occurrence
+	 */
+	void requestDump(int reason);
+
+	/**
+	 * Writes the ring to the trace file, returns -1 on errors
+	 */
+	int dump(int reason);
+
+	/**
+	 * Dumps on SIGUSR1 and on fatal signals (the latter then terminate as usual).
+	 * SIGINT and SIGTERM request a normal quit, a second one is fatal.
+	 */
+	void installSignalHandlers();
+
+	/**
+	 * Returns true once after SIGUSR1 has been received
+	 */
+	bool pollSignal();
+
+	/**
+	 * True after SIGINT or SIGTERM has been received
+	 */
+	bool pollQuitSignal();
+
+	uint64_t getRecordCount();
+
+	~Tracer();
+
+private:
+	/**
+	 * Continues in the next block of the ring, starting with a keyframe
+	 */
+	void nextBlock();
+
+	/**
+	 * Writes the dump to 'fd' using write() only, so it can be used in signal handlers
+	 */
+	int writeDump(int fd, int reason);
+
+	static void handleSignal(int signal);
+
+	string file_name;
+	byte* ring;
+	unsigned int block_count;
+	unsigned int* block_used;
+	unsigned int block; // block being written
+	bool wrapped; // all blocks hold data
+	byte* out; // write position in the current block
+	byte* block_end;
+	bool keyframe; // next record is a keyframe
+
+	dword last_regs[TRACE_REG_COUNT];
+	dword next_pc;
+	uint64_t last_cycles;
+	uint64_t records;
+
+	int pending_reason; // -1 = none
+	unsigned int dumped; // bit per automatic reason already dumped
+};
+
+#endif // TRACE_H
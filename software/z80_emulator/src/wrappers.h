@@ -19,8 +19,10 @@
 
 void Machine_WriteMem(dword address, byte value);
 byte Machine_ReadMem(dword address);
+byte Machine_ReadMemDMA(dword address);
 void Machine_WriteIO(dword address, byte value);
 byte Machine_ReadIO(dword address);
+bool Machine_CheckBreakpoint(dword address);
+void Machine_CheckWatchpoint(dword address, byte value, byte access);
 
 int Machine_GetClockFrequency();
-void Machine_Cycle();
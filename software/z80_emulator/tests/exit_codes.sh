@@ -0,0 +1,52 @@
+#!/bin/sh
+# Runs tiny BootROMs headless and checks the exit code of the emulator.
+# Usage: tests/exit_codes.sh [path to z80emu] (default: build/z80emu)
+
+EMU=${1:-build/z80emu}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+: > "$DIR/rom.bin"
+FAILED=0
+
+# check <name> <expected exit code> <BootROM bytes (printf escapes)> [options]
+check()
+{
+	name=$1
+	expected=$2
+	printf "$3" > "$DIR/bootrom.bin"
+	shift 3
+	"$EMU" --headless --rom "$DIR/rom.bin" --bootrom "$DIR/bootrom.bin" "$@" > "$DIR/out.txt" 2>&1
+	result=$?
+	if grep -q "Illegal opcode" "$DIR/out.txt"; then
+		echo "FAIL $name: illegal opcode executed"
+		FAILED=1
+	elif [ $result -eq $expected ]; then
+		echo "PASS $name"
+	else
+		echo "FAIL $name: exit code $result, expected $expected"
+		tail -n 20 "$DIR/out.txt"
+		FAILED=1
+	fi
+}
+
+# BootROM starts at 0xE000, the shutdown dump reads past its end
+check "halt" 2 '\363\166' --stop-on-halt					# DI; HALT
+check "stop-pc" 3 '\000\000\303\002\340' --stop-pc 0xe002	# NOP; NOP; JP $
+check "max-cycles" 4 '\303\000\340' --max-cycles 1000		# JP $
+check "break" 6 '\000\000\303\002\340' --break 0xe002 --max-cycles 1000	# NOP; NOP; JP $
+
+# Conditional jumps on parity and sign: POP AF loads F from C, a taken
+# jump reaches the HALT at 0xE00C, otherwise JP $ runs out of cycles
+# DI; LD BC, flags; PUSH BC; POP AF; JP cc, 0xE00C; JP $; HALT
+jump()
+{
+	check "$1" $2 "\363\001$3\000\305\361$4\014\340\303\011\340\166" --stop-on-halt --max-cycles 1000
+}
+jump "jp-pe-taken" 2 '\004' '\352'
+jump "jp-pe-not-taken" 4 '\000' '\352'
+jump "jp-po-not-taken" 4 '\004' '\342'
+jump "jp-m-taken" 2 '\200' '\372'
+jump "jp-m-not-taken" 4 '\000' '\372'
+jump "jp-p-not-taken" 4 '\200' '\362'
+
+exit $FAILED
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Saves a state in the middle of an SGPU fill and finishes the run from it,
+# with and without --sgpu-thread on either side.
+# Usage: tests/savestate.sh [path to z80emu] (default: build/z80emu)
+
+EMU=${1:-build/z80emu}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+: > "$DIR/rom.bin"
+FAILED=0
+
+# put <command buffer address> <value>: LD A,value; OUT (11),A; LD A,value; OUT (12),A
+put()
+{
+	printf "\076$1\323\013\076$2\323\014"
+}
+
+# Fills the whole framebuffer with 0x5a, waits for the command to complete,
+# then reads its last byte through framebuffer page 11 into A and halts
+{
+	printf '\363'
+	put '\001' '\001'; put '\002' '\000'
+	put '\003' '\000'; put '\004' '\000'
+	put '\005' '\113'; put '\006' '\000'
+	put '\007' '\132'; put '\000' '\001'
+	printf '\076\013\323\012\076\000\323\013'
+	printf '\333\014\267\000\302\111\340' # E049: IN A,(12); OR A; NOP; JP NZ,E049
+	printf '\072\077\206\166'
+} > "$DIR/bootrom.bin"
+
+# check <name> <options of the saving run> <options of the loading run>
+check()
+{
+	"$EMU" --headless --rom "$DIR/rom.bin" --bootrom "$DIR/bootrom.bin" --max-cycles 1000 \
+		--save-state "$DIR/state.bin" $2 > "$DIR/out.txt" 2>&1
+	"$EMU" --headless --rom "$DIR/rom.bin" --bootrom "$DIR/bootrom.bin" --stop-on-halt --max-cycles 100000 \
+		--load-state "$DIR/state.bin" --state-json "$DIR/state.json" $3 >> "$DIR/out.txt" 2>&1
+	af=$(grep -o '"af": [0-9]*' "$DIR/state.json" | grep -o '[0-9]*$')
+	if [ "$af" != "" ] && [ $((af >> 8)) -eq 90 ]; then
+		echo "PASS $1"
+	else
+		echo "FAIL $1: A = '$af' >> 8, expected 90 (0x5a)"
+		tail -n 20 "$DIR/out.txt"
+		FAILED=1
+	fi
+}
+
+check "inline" "" ""
+check "inline-to-worker" "" "--sgpu-thread"
+check "worker-to-inline" "--sgpu-thread" ""
+check "worker" "--sgpu-thread" "--sgpu-thread"
+
+exit $FAILED
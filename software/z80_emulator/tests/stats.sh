@@ -0,0 +1,31 @@
+#!/bin/sh
+# Runs a tiny BootROM headless and checks where --stats-json counts its instructions.
+# Usage: tests/stats.sh [path to z80emu] (default: build/z80emu)
+
+EMU=${1:-build/z80emu}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+: > "$DIR/rom.bin"
+FAILED=0
+
+# DI; NOP; NOP; HALT at RESET_PC (0xE000), four instructions in bootrom_0
+printf '\363\000\000\166' > "$DIR/bootrom.bin"
+"$EMU" --headless --rom "$DIR/rom.bin" --bootrom "$DIR/bootrom.bin" --stop-on-halt --stats-json "$DIR/stats.json" > "$DIR/out.txt" 2>&1
+
+# expect <region> <instructions>
+expect()
+{
+	actual=$(grep -o "\"$1\": {\"instructions\": [0-9]*" "$DIR/stats.json" | grep -o '[0-9]*$')
+	if [ "$actual" = "$2" ]; then
+		echo "PASS $1 instructions"
+	else
+		echo "FAIL $1 instructions: '$actual', expected $2"
+		FAILED=1
+	fi
+}
+
+expect "bootrom_0" 4
+expect "bootrom_n" 0
+expect "rom_0" 0
+
+exit $FAILED
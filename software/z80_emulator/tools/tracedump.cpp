@@ -0,0 +1,231 @@
+/*
+	Copyright (c) 2016-2017 Leon Maurice Adam.
+	
+	This file is part of Z80 Emulator.
+
+    Z80 Emulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Z80 Emulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Z80 Emulator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * tracedump - decodes execution traces written by z80emu --trace
+ *
+ * Usage: tracedump [--symbols <file>] [--last <n>] <trace file>
+ */
+
+#include <stdafx.h>
+#include <cstdlib> // strtoull
+#include "trace.h"
+#include "symbols.h"
+
+static const char* reasons[TRACE_DUMP_REASONS] = { "exit", "halt", "illegal opcode", "request", "signal", "crash" };
+static const char* register_names[TRACE_REG_COUNT] = { "AF", "BC", "DE", "HL", "SP" };
+
+static uint64_t getLE(const byte* src, int size)
+{
+	uint64_t value = 0;
+	for (int i = size - 1; i >= 0; i--)
+		value = (value << 8) | src[i];
+	return value;
+}
+
+/**
+ * Decoder state, carried from record to record
+ */
+struct TraceState
+{
+	dword pc, next_pc;
+	byte bytes[4];
+	int length;
+	dword regs[TRACE_REG_COUNT];
+	uint64_t cycles;
+	byte header;
+};
+
+/**
+ * Decodes the record at 'data', returns its size or -1 if it is truncated or invalid
+ */
+static int decodeRecord(const byte* data, unsigned int size, TraceState* state)
+{
+	const byte* p = data;
+	const byte* end = data + size;
+	if (p >= end) return -1;
+
+	state->header = *p++;
+	state->length = (state->header & TRACE_LENGTH_MASK) + 1;
+	bool keyframe = (state->header & TRACE_KEYFRAME) != 0;
+	if (keyframe && !(state->header & TRACE_PC)) return -1;
+
+	if (state->header & TRACE_PC)
+	{
+		if (end - p < 2) return -1;
+		state->pc = (dword)getLE(p, 2);
+		p += 2;
+	}
+	else state->pc = state->next_pc;
+
+	if (end - p < state->length) return -1;
+	memcpy(state->bytes, p, state->length);
+	p += state->length;
+	state->next_pc = (dword)(state->pc + state->length);
+
+	if (keyframe)
+	{
+		if (end - p < TRACE_REG_COUNT * 2 + 8) return -1;
+		for (int i = 0; i < TRACE_REG_COUNT; i++, p += 2)
+			state->regs[i] = (dword)getLE(p, 2);
+		state->cycles = getLE(p, 8);
+		p += 8;
+		return (int)(p - data);
+	}
+
+	if (state->header & TRACE_REGS)
+	{
+		if (p >= end) return -1;
+		byte mask = *p++;
+		for (int i = 0; i < TRACE_REG_COUNT; i++)
+		{
+			if (!GET_BIT(mask, i)) continue;
+			if (end - p < 2) return -1;
+			state->regs[i] = (dword)getLE(p, 2);
+			p += 2;
+		}
+	}
+
+	uint64_t delta = 0;
+	for (int shift = 0; ; shift += 7)
+	{
+		if (p >= end || shift > 63) return -1;
+		byte value = *p++;
+		delta |= (uint64_t)(value & 0x7f) << shift;
+		if (!(value & 0x80)) break;
+	}
+	state->cycles += delta;
+	return (int)(p - data);
+}
+
+static void printRecord(const TraceState& state, SymbolTable& symbols)
+{
+	cout << dec << setfill(' ') << setw(12) << state.cycles << "  " << hex << setfill('0') << setw(4) << state.pc << "  ";
+	for (int i = 0; i < 4; i++)
+	{
+		if (i < state.length) cout << setw(2) << (int)state.bytes[i] << " ";
+		else cout << "   ";
+	}
+	for (int i = 0; i < TRACE_REG_COUNT; i++)
+		cout << " " << register_names[i] << "=" << setw(4) << state.regs[i];
+	if (state.header & TRACE_IRQ) cout << "  [irq]";
+	if (!symbols.isEmpty()) cout << "  " << symbols.describe(state.pc);
+	cout << dec << setfill(' ') << endl;
+}
+
+int main(int argc, char* argv[])
+{
+	string file_name;
+	SymbolTable symbols;
+	uint64_t last = 0; // 0 = all records
+
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--symbols" && i + 1 < argc)
+		{
+			if (symbols.load(argv[++i])) return 1;
+		}
+		else if (arg == "--last" && i + 1 < argc)
+		{
+			last = strtoull(argv[++i], NULL, 0);
+		}
+		else if (arg.compare(0, 2, "--") != 0)
+		{
+			file_name = arg;
+		}
+		else
+		{
+			cerr << "Usage: " << argv[0] << " [--symbols <file>] [--last <n>] <trace file>" << endl;
+			return 1;
+		}
+	}
+	if (file_name.empty())
+	{
+		cerr << "Usage: " << argv[0] << " [--symbols <file>] [--last <n>] <trace file>" << endl;
+		return 1;
+	}
+
+	ifstream file(file_name.c_str(), ifstream::in | ifstream::binary | ifstream::ate);
+	if (!file.is_open())
+	{
+		cerr << "Unable to open '" << file_name << "'" << endl;
+		return 1;
+	}
+	size_t size = (size_t)file.tellg();
+	byte* data = new byte[size + 1];
+	file.seekg(0, ifstream::beg);
+	file.read((char*)data, size);
+	file.close();
+
+	if (size < TRACE_HEADER_SIZE || memcmp(data, TRACE_MAGIC, 8) != 0 || getLE(data + 8, 2) != TRACE_VERSION)
+	{
+		cerr << "'" << file_name << "' is not a version " << TRACE_VERSION << " trace" << endl;
+		delete[] data;
+		return 1;
+	}
+	int reason = data[10];
+	unsigned int block_count = (unsigned int)getLE(data + 16, 4);
+	cout << "# " << file_name << ": dumped on " << (reason < TRACE_DUMP_REASONS ? reasons[reason] : "?")
+		<< " at cycle " << getLE(data + 20, 8) << ", " << block_count << " blocks" << endl;
+	cout << "#       cycles  pc    bytes         registers after the instruction" << endl;
+
+	/* Two passes: count the records, then print the last ones */
+	uint64_t total = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		uint64_t index = 0;
+		uint64_t first = (last && pass == 1 && total > last) ? total - last : 0;
+		size_t offset = TRACE_HEADER_SIZE;
+		TraceState state;
+		memset(&state, 0, sizeof(state));
+
+		for (unsigned int block = 0; block < block_count; block++)
+		{
+			if (size - offset < 4) break;
+			unsigned int used = (unsigned int)getLE(data + offset, 4);
+			offset += 4;
+			if (used > size - offset)
+			{
+				cerr << "Truncated block " << block << endl;
+				break;
+			}
+
+			unsigned int position = 0;
+			while (position < used)
+			{
+				int length = decodeRecord(data + offset + position, used - position, &state);
+				if (length < 0)
+				{
+					cerr << "Invalid record in block " << block << " at offset " << position << endl;
+					break;
+				}
+				if (pass == 1 && index >= first) printRecord(state, symbols);
+				position += length;
+				index++;
+			}
+			offset += used;
+		}
+		total = index;
+	}
+
+	cout << "# " << total << " records" << endl;
+	delete[] data;
+	return 0;
+}